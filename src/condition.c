@@ -0,0 +1,685 @@
+// condition.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Conditions on a file, such as "size > 1M and ext in (csv, json)".   No application specific code should be here.
+ * See condition.h for details.
+*/
+
+
+#define _GNU_SOURCE		// for statx()
+
+#include "condition.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+
+// the fields of the file that can be tested.
+#define FIELD_NAME		0
+#define FIELD_EXT		1
+#define FIELD_SIZE		2
+#define FIELD_OWNER		3
+#define FIELD_GROUP		4
+#define FIELD_AGE		5
+
+// how the field is compared with the values of the test.  == and != are the same as 'in' and 'not in' with one value.
+#define CMP_IN			0
+#define CMP_NOT_IN		1
+#define CMP_LT			2
+#define CMP_LE			3
+#define CMP_GT			4
+#define CMP_GE			5
+
+// The program works on a single result, which each test replaces.  'and' and 'or' are jumps past the rest of their right hand side
+// when the result of the left hand side already gives the answer.
+#define OP_TEST			0
+#define OP_NOT			1
+#define OP_JUMP_FALSE	2
+#define OP_JUMP_TRUE	3
+
+// the longest word (or quoted value) in a condition.
+#define TOKEN_MAX		256
+
+
+typedef struct {
+	uint8_t op;
+	uint8_t field;
+	uint8_t compare;
+	uint16_t count;		// the number of values for a test.
+	int32_t arg;		// the first of the values for a test, or where a jump goes to.
+} instr_t;
+
+
+typedef struct {
+	long long num;
+	char *str;			// for the name and ext (NULL for the others).
+} value_t;
+
+
+typedef struct {
+	instr_t *code;
+	int codelen;
+	int codesize;
+	value_t *values;
+	int valuecount;
+	int valuesize;
+	int *starts;		// where each of the conditions starts in the code.  Each one ends where the next one starts.
+	int count;
+	unsigned int statmask;	// what the tests need to know about the file.
+} condition_t;
+
+
+#define TOK_END			0
+#define TOK_WORD		1
+#define TOK_STRING		2		// a value in quotes, which is never taken as a keyword.
+#define TOK_OPEN		3
+#define TOK_CLOSE		4
+#define TOK_COMMA		5
+#define TOK_COMPARE		6
+
+typedef struct {
+	condition_t *cond;
+	const char *next;		// the rest of the expression.
+	int type;				// the current token.
+	int compare;
+	char text[TOKEN_MAX];
+	char *error;
+	size_t errorlen;
+	int failed;
+} parser_t;
+
+
+// what the program knows about the file so far.
+typedef struct {
+	const char *path;
+	unsigned int mask;
+	int stated;				// 1 once the file has been looked at, or -1 if it could not be.
+	struct statx stx;
+	long long now;			// nanoseconds since the epoch, when it was looked at.
+} file_t;
+
+
+
+extern CONDITION condition_new(void)
+{
+	condition_t *cond = calloc(1, sizeof(condition_t));
+	assert(cond);
+	return((CONDITION) cond);
+}
+
+
+extern void condition_free(CONDITION condptr)
+{
+	condition_t *cond = condptr;
+	assert(cond);
+
+	int i;
+	for (i=0; i < cond->valuecount; i++) {
+		if (cond->values[i].str) { free(cond->values[i].str); }
+	}
+	if (cond->values) { free(cond->values); }
+	if (cond->code) { free(cond->code); }
+	if (cond->starts) { free(cond->starts); }
+	free(cond);
+}
+
+
+static void fail(parser_t *parser, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void fail(parser_t *parser, const char *fmt, ...)
+{
+	assert(parser);
+	assert(fmt);
+
+	// only the first error is kept, as the rest are usually caused by it.
+	if (parser->failed == 0) {
+		parser->failed = 1;
+		if (parser->error && parser->errorlen > 0) {
+			va_list args;
+			va_start(args, fmt);
+			vsnprintf(parser->error, parser->errorlen, fmt, args);
+			va_end(args);
+		}
+	}
+}
+
+
+static int emit(condition_t *cond, int op, int field, int compare, int arg, int count)
+{
+	assert(cond);
+
+	if (cond->codelen >= cond->codesize) {
+		cond->codesize = cond->codesize ? cond->codesize * 2 : 16;
+		cond->code = realloc(cond->code, cond->codesize * sizeof(instr_t));
+		assert(cond->code);
+	}
+	instr_t *instr = &cond->code[cond->codelen];
+	instr->op = op;
+	instr->field = field;
+	instr->compare = compare;
+	instr->count = count;
+	instr->arg = arg;
+	return(cond->codelen ++);
+}
+
+
+static value_t * add_value(condition_t *cond)
+{
+	assert(cond);
+
+	if (cond->valuecount >= cond->valuesize) {
+		cond->valuesize = cond->valuesize ? cond->valuesize * 2 : 16;
+		cond->values = realloc(cond->values, cond->valuesize * sizeof(value_t));
+		assert(cond->values);
+	}
+	value_t *value = &cond->values[cond->valuecount ++];
+	memset(value, 0, sizeof(value_t));
+	return(value);
+}
+
+
+// characters that end a word.
+static int is_special(char c)
+{
+	return(c == 0 || isspace((unsigned char) c) || strchr("()=!<>,'\"", c) != NULL);
+}
+
+
+static void next_token(parser_t *parser)
+{
+	assert(parser);
+
+	const char *p = parser->next;
+	while (isspace((unsigned char) *p)) {
+		p ++;
+	}
+	parser->text[0] = 0;
+
+	if (*p == 0) {
+		parser->type = TOK_END;
+	}
+	else if (*p == '(' || *p == ')' || *p == ',') {
+		parser->type = (*p == '(') ? TOK_OPEN : ((*p == ')') ? TOK_CLOSE : TOK_COMMA);
+		p ++;
+	}
+	else if (*p == '=' || *p == '!' || *p == '<' || *p == '>') {
+		parser->type = TOK_COMPARE;
+		int equals = (p[1] == '=');
+		if (*p == '=') { parser->compare = CMP_IN; }
+		else if (*p == '!') {
+			if (equals == 0) {
+				fail(parser, "expected != at '%s'", p);
+			}
+			parser->compare = CMP_NOT_IN;
+		}
+		else if (*p == '<') { parser->compare = equals ? CMP_LE : CMP_LT; }
+		else { parser->compare = equals ? CMP_GE : CMP_GT; }
+		p += equals ? 2 : 1;
+	}
+	else if (*p == '"' || *p == '\'') {
+		char quote = *p++;
+		const char *end = strchr(p, quote);
+		if (end == NULL) {
+			fail(parser, "missing closing quote");
+			end = p + strlen(p);
+		}
+		else if (end - p >= TOKEN_MAX) {
+			fail(parser, "value is too long");
+		}
+		else {
+			memcpy(parser->text, p, end - p);
+			parser->text[end - p] = 0;
+		}
+		parser->type = TOK_STRING;
+		p = (*end) ? end + 1 : end;
+	}
+	else {
+		const char *start = p;
+		while (is_special(*p) == 0) {
+			p ++;
+		}
+		if (p - start >= TOKEN_MAX) {
+			fail(parser, "word is too long");
+		}
+		else {
+			memcpy(parser->text, start, p - start);
+			parser->text[p - start] = 0;
+		}
+		parser->type = TOK_WORD;
+	}
+	parser->next = p;
+}
+
+
+// whether the current token is the keyword (which is never in quotes).
+static int is_keyword(parser_t *parser, const char *keyword)
+{
+	assert(parser);
+	assert(keyword);
+	return(parser->type == TOK_WORD && strcasecmp(parser->text, keyword) == 0);
+}
+
+
+// a number, followed by one of the units (with what it is multiplied by in 'scales').  The first unit is "", for a number on its own.
+static int parse_number(parser_t *parser, const char *text, long long *value, const char **units, const long long *scales)
+{
+	assert(parser);
+	assert(text);
+	assert(value);
+
+	char *end;
+	if (isdigit((unsigned char) text[0]) == 0 && text[0] != '.') {
+		fail(parser, "expected a number, not '%s'", text);
+		return(-1);
+	}
+	double number = strtod(text, &end);
+	int i;
+	for (i=0; units[i]; i++) {
+		if (strcasecmp(end, units[i]) == 0) {
+			*value = (long long) (number * scales[i]);
+			return(0);
+		}
+	}
+	fail(parser, "unknown unit in '%s'", text);
+	return(-1);
+}
+
+
+// a user (or group) by name or number.
+static int parse_id(parser_t *parser, const char *text, int group, long long *value)
+{
+	assert(parser);
+	assert(text);
+	assert(value);
+
+	char *end;
+	long long id = strtoll(text, &end, 10);
+	if (text[0] && *end == 0) {
+		*value = id;
+		return(0);
+	}
+	if (group) {
+		struct group *gr = getgrnam(text);
+		if (gr) {
+			*value = gr->gr_gid;
+			return(0);
+		}
+		fail(parser, "unknown group '%s'", text);
+	}
+	else {
+		struct passwd *pw = getpwnam(text);
+		if (pw) {
+			*value = pw->pw_uid;
+			return(0);
+		}
+		fail(parser, "unknown user '%s'", text);
+	}
+	return(-1);
+}
+
+
+static int parse_value(parser_t *parser, int field)
+{
+	assert(parser);
+
+	if (parser->type == TOK_END) {
+		fail(parser, "expected a value at the end");
+		return(-1);
+	}
+	if (parser->type != TOK_WORD && parser->type != TOK_STRING) {
+		fail(parser, "expected a value at '%s'", parser->text[0] ? parser->text : parser->next);
+		return(-1);
+	}
+
+	static const char *sizeunits[] = { "", "b", "k", "kb", "kib", "m", "mb", "mib", "g", "gb", "gib", "t", "tb", "tib", NULL };
+	static const long long sizescales[] = { 1, 1, 1LL << 10, 1LL << 10, 1LL << 10, 1LL << 20, 1LL << 20, 1LL << 20,
+		1LL << 30, 1LL << 30, 1LL << 30, 1LL << 40, 1LL << 40, 1LL << 40 };
+	static const char *ageunits[] = { "", "ms", "s", "m", "h", "d", NULL };
+	static const long long agescales[] = { 1000000000LL, 1000000LL, 1000000000LL, 60 * 1000000000LL, 3600 * 1000000000LL, 86400 * 1000000000LL };
+
+	value_t *value = add_value(parser->cond);
+	int result = 0;
+	switch (field) {
+		case FIELD_NAME:
+			value->str = strdup(parser->text);
+			assert(value->str);
+			break;
+		case FIELD_EXT:
+			value->str = strdup(parser->text[0] == '.' ? parser->text + 1 : parser->text);
+			assert(value->str);
+			break;
+		case FIELD_SIZE:
+			result = parse_number(parser, parser->text, &value->num, sizeunits, sizescales);
+			break;
+		case FIELD_AGE:
+			result = parse_number(parser, parser->text, &value->num, ageunits, agescales);
+			break;
+		default:
+			result = parse_id(parser, parser->text, field == FIELD_GROUP, &value->num);
+			break;
+	}
+	next_token(parser);
+	return(result);
+}
+
+
+static int parse_test(parser_t *parser)
+{
+	assert(parser);
+
+	static const char *fields[] = { "name", "ext", "size", "owner", "group", "age", NULL };
+	int field;
+	for (field=0; fields[field]; field++) {
+		if (is_keyword(parser, fields[field])) {
+			break;
+		}
+	}
+	if (parser->type == TOK_END) {
+		fail(parser, "expected a test at the end");
+		return(-1);
+	}
+	if (fields[field] == NULL) {
+		fail(parser, "unknown field '%s'", parser->text[0] ? parser->text : parser->next);
+		return(-1);
+	}
+	next_token(parser);
+
+	int first = parser->cond->valuecount;
+	int compare;
+	if (parser->type == TOK_COMPARE) {
+		compare = parser->compare;
+		if (compare != CMP_IN && compare != CMP_NOT_IN && field != FIELD_SIZE && field != FIELD_AGE) {
+			fail(parser, "%s can only be compared with ==, != or in", fields[field]);
+			return(-1);
+		}
+		next_token(parser);
+		if (parse_value(parser, field) != 0) {
+			return(-1);
+		}
+	}
+	else {
+		compare = CMP_IN;
+		if (is_keyword(parser, "not")) {
+			compare = CMP_NOT_IN;
+			next_token(parser);
+		}
+		if (is_keyword(parser, "in") == 0) {
+			fail(parser, "expected a comparison after '%s'", fields[field]);
+			return(-1);
+		}
+		next_token(parser);
+		if (parser->type != TOK_OPEN) {
+			fail(parser, "expected a list after 'in'");
+			return(-1);
+		}
+		do {
+			next_token(parser);
+			if (parse_value(parser, field) != 0) {
+				return(-1);
+			}
+		} while (parser->type == TOK_COMMA);
+		if (parser->type != TOK_CLOSE) {
+			fail(parser, "expected ')' at the end of the list");
+			return(-1);
+		}
+		next_token(parser);
+	}
+
+	int count = parser->cond->valuecount - first;
+	if (count > UINT16_MAX) {
+		fail(parser, "too many values in the list");
+		return(-1);
+	}
+	emit(parser->cond, OP_TEST, field, compare, first, count);
+
+	if (field == FIELD_SIZE) { parser->cond->statmask |= STATX_SIZE; }
+	else if (field == FIELD_OWNER) { parser->cond->statmask |= STATX_UID; }
+	else if (field == FIELD_GROUP) { parser->cond->statmask |= STATX_GID; }
+	else if (field == FIELD_AGE) { parser->cond->statmask |= STATX_MTIME; }
+	return(0);
+}
+
+
+static int parse_or(parser_t *parser);
+
+static int parse_unary(parser_t *parser)
+{
+	assert(parser);
+
+	if (is_keyword(parser, "not")) {
+		next_token(parser);
+		if (parse_unary(parser) != 0) {
+			return(-1);
+		}
+		emit(parser->cond, OP_NOT, 0, 0, 0, 0);
+		return(0);
+	}
+	if (parser->type == TOK_OPEN) {
+		next_token(parser);
+		if (parse_or(parser) != 0) {
+			return(-1);
+		}
+		if (parser->type != TOK_CLOSE) {
+			fail(parser, "expected ')'");
+			return(-1);
+		}
+		next_token(parser);
+		return(0);
+	}
+	return(parse_test(parser));
+}
+
+
+static int parse_and(parser_t *parser)
+{
+	assert(parser);
+
+	if (parse_unary(parser) != 0) {
+		return(-1);
+	}
+	while (is_keyword(parser, "and")) {
+		// if the left side is false, the right side is not looked at.
+		int jump = emit(parser->cond, OP_JUMP_FALSE, 0, 0, 0, 0);
+		next_token(parser);
+		if (parse_unary(parser) != 0) {
+			return(-1);
+		}
+		parser->cond->code[jump].arg = parser->cond->codelen;
+	}
+	return(0);
+}
+
+
+static int parse_or(parser_t *parser)
+{
+	assert(parser);
+
+	if (parse_and(parser) != 0) {
+		return(-1);
+	}
+	while (is_keyword(parser, "or")) {
+		int jump = emit(parser->cond, OP_JUMP_TRUE, 0, 0, 0, 0);
+		next_token(parser);
+		if (parse_and(parser) != 0) {
+			return(-1);
+		}
+		parser->cond->code[jump].arg = parser->cond->codelen;
+	}
+	return(0);
+}
+
+
+extern int condition_add(CONDITION condptr, const char *expr, char *error, size_t errorlen)
+{
+	condition_t *cond = condptr;
+	assert(cond);
+	assert(expr);
+
+	parser_t parser;
+	memset(&parser, 0, sizeof(parser));
+	parser.cond = cond;
+	parser.next = expr;
+	parser.error = error;
+	parser.errorlen = errorlen;
+
+	int codelen = cond->codelen;
+	int valuecount = cond->valuecount;
+	unsigned int statmask = cond->statmask;
+
+	next_token(&parser);
+	if (parser.type == TOK_END) {
+		fail(&parser, "the condition is empty");
+	}
+	else if (parse_or(&parser) == 0 && parser.type != TOK_END) {
+		fail(&parser, "unexpected '%s'", parser.text[0] ? parser.text : parser.next);
+	}
+
+	if (parser.failed) {
+		// everything it added is taken back out.
+		while (cond->valuecount > valuecount) {
+			cond->valuecount --;
+			if (cond->values[cond->valuecount].str) { free(cond->values[cond->valuecount].str); }
+		}
+		cond->codelen = codelen;
+		cond->statmask = statmask;
+		return(-1);
+	}
+
+	cond->starts = realloc(cond->starts, (cond->count + 1) * sizeof(int));
+	assert(cond->starts);
+	cond->starts[cond->count ++] = codelen;
+	return(0);
+}
+
+
+// look at the file, the first time that a test needs to.  Returns -1 if it could not be.
+static int stat_file(file_t *file)
+{
+	assert(file);
+
+	if (file->stated == 0) {
+		file->stated = -1;
+		if (statx(AT_FDCWD, file->path, AT_STATX_DONT_SYNC, file->mask, &file->stx) == 0) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			file->now = ((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+			file->stated = 1;
+		}
+	}
+	return(file->stated);
+}
+
+
+// returns 1 if the test is true, 0 if it isn't, or -1 if the file could not be looked at.
+static int run_test(condition_t *cond, const instr_t *instr, file_t *file)
+{
+	assert(cond);
+	assert(instr);
+	assert(file);
+
+	const value_t *values = &cond->values[instr->arg];
+	int found = 0;
+	int i;
+
+	if (instr->field == FIELD_NAME || instr->field == FIELD_EXT) {
+		const char *name = strrchr(file->path, '/');
+		name = name ? name + 1 : file->path;
+		if (instr->field == FIELD_EXT) {
+			// a name that starts with a dot (and has no other) does not have an extension.
+			const char *dot = strrchr(name, '.');
+			name = (dot && dot != name) ? dot + 1 : "";
+		}
+		for (i=0; i < instr->count && found == 0; i++) {
+			found = (instr->field == FIELD_EXT) ? (strcasecmp(name, values[i].str) == 0) : (strcmp(name, values[i].str) == 0);
+		}
+		return(instr->compare == CMP_NOT_IN ? !found : found);
+	}
+
+	if (stat_file(file) < 0) {
+		return(-1);
+	}
+	long long number;
+	switch (instr->field) {
+		case FIELD_SIZE:  number = file->stx.stx_size; break;
+		case FIELD_OWNER: number = file->stx.stx_uid; break;
+		case FIELD_GROUP: number = file->stx.stx_gid; break;
+		default:
+			assert(instr->field == FIELD_AGE);
+			number = file->now - (((long long) file->stx.stx_mtime.tv_sec * 1000000000LL) + file->stx.stx_mtime.tv_nsec);
+			break;
+	}
+
+	switch (instr->compare) {
+		case CMP_LT: return(number < values[0].num);
+		case CMP_LE: return(number <= values[0].num);
+		case CMP_GT: return(number > values[0].num);
+		case CMP_GE: return(number >= values[0].num);
+	}
+	for (i=0; i < instr->count && found == 0; i++) {
+		found = (number == values[i].num);
+	}
+	return(instr->compare == CMP_NOT_IN ? !found : found);
+}
+
+
+extern int condition_match(CONDITION condptr, const char *path)
+{
+	condition_t *cond = condptr;
+	assert(cond);
+	assert(path);
+
+	file_t file;
+	file.path = path;
+	file.mask = cond->statmask;
+	file.stated = 0;
+
+	int c;
+	for (c=0; c < cond->count; c++) {
+		int end = (c + 1 < cond->count) ? cond->starts[c + 1] : cond->codelen;
+		int result = 0;
+		int pc = cond->starts[c];
+		while (pc < end) {
+			const instr_t *instr = &cond->code[pc];
+			switch (instr->op) {
+				case OP_TEST:
+					result = run_test(cond, instr, &file);
+					if (result < 0) {
+						return(-1);
+					}
+					pc ++;
+					break;
+				case OP_NOT:
+					result = !result;
+					pc ++;
+					break;
+				case OP_JUMP_FALSE:
+					pc = result ? pc + 1 : instr->arg;
+					break;
+				default:
+					assert(instr->op == OP_JUMP_TRUE);
+					pc = result ? instr->arg : pc + 1;
+					break;
+			}
+		}
+		if (result == 0) {
+			return(0);
+		}
+	}
+	return(1);
+}
+
+
+// fin - condition.c
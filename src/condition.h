@@ -0,0 +1,42 @@
+// condition.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Conditions on a file, such as "size > 1M and ext in (csv, json)".   No application specific code should be here.
+ * Each condition is compiled once into a short program, which is then run against the files.  The file is only looked at (with a
+ * single statx) if the program gets to a test that needs it, and then only for what the tests need.  The tests are done in the
+ * order they are written, and 'and' and 'or' skip the rest once the answer is known, so the cheap tests are best put first.
+ *
+ * A test is a field, a comparison and a value:
+ *   name    the name of the file (== != in)
+ *   ext     what comes after the last '.' in the name, ignoring case (== != in).  "ext == ''" is a file without one.
+ *   size    in bytes, or with K, M, G or T (eg, 1M is 1048576)
+ *   owner   a user name, or uid (== != in)
+ *   group   a group name, or gid (== != in)
+ *   age     the time since it was last modified, in seconds, or with ms, s, m, h or d (eg, 90s, 5m)
+ * The comparisons are == (or =), !=, <, <=, >, >=, 'in (a, b, ...)' and 'not in (a, b, ...)'.  Tests can be combined with 'and', 'or',
+ * 'not' and brackets.  A value with spaces (or brackets, etc) in it can be put in quotes.
+*/
+
+#ifndef __CONDITION_H
+#define __CONDITION_H
+
+#include <stddef.h>
+
+typedef void * CONDITION;
+
+CONDITION condition_new(void);
+void condition_free(CONDITION condition);
+
+// add a condition, which must be true (as well as any that were added before) for the file to match.  Returns -1 if it cannot be
+// compiled, with the reason in 'error'.
+int condition_add(CONDITION condition, const char *expr, char *error, size_t errorlen);
+
+// returns 1 if the file matches all the conditions, 0 if it doesn't, or -1 if it could not be looked at (eg, it has been removed).
+// Can be used by several threads at once.
+int condition_match(CONDITION condition, const char *path);
+
+
+#endif
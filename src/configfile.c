@@ -13,10 +13,12 @@
 #include "configfile.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -24,20 +26,42 @@
 
 
 
+// files up to this size are read rather than mapped.
+#define SMALL_CONFIG	16384
+
+
+// Everything for a config is in a single allocation (the arena): the list of pairs, the hash index, and the strings for the keys and values.
+// The strings are copied straight out of the mapped file, so there is no other allocation for each pair.
 typedef struct {
-	char *key;
-	char *value;
+	const char *key;
+	const char *value;
+	int next;			// the next pair in the same bucket of the index (in the order they are in the file), or -1.
 } config_pair_t;
 
 
 typedef struct {
 	int items;
 	config_pair_t *pairs;
+	int buckets;		// always a power of 2.
+	int *bucket;		// the first pair for each bucket, or -1.
 	char *path;
+	char *arena;
 } config_t;
 
 
 
+// the keys are case-insensitive, so the hash is of the lower-case form of the key (FNV-1a).
+static unsigned int key_hash(const char *key)
+{
+	unsigned int hash = 2166136261U;
+	while (*key) {
+		hash ^= (unsigned char) tolower((unsigned char) *key);
+		hash *= 16777619U;
+		key ++;
+	}
+	return(hash);
+}
+
 
 // free the resources for the current config that is loaded.
 extern void config_free(CONFIG configptr)
@@ -45,27 +69,98 @@ extern void config_free(CONFIG configptr)
 	config_t *config = configptr;
 	assert(config);
 	
-	if (config->pairs) {
-		assert(config->items >= 0);
+	if (config->arena) { free(config->arena); }
+	if (config->path) { free(config->path); }
+	
+	free(config);
+	config = NULL;
+}
+
+
+static int is_space(char c)
+{
+	return(c == ' ' || c == '\t' || c == '\r');
+}
+
+
+// copy 'len' characters into the string area of the arena, and return the NUL terminated copy.
+static const char * arena_string(char **strings, const char *str, size_t len)
+{
+	char *copy = *strings;
+	memcpy(copy, str, len);
+	copy[len] = 0;
+	*strings += len + 1;
+	return(copy);
+}
+
+
+// parse the contents of a config file, straight out of the buffer, into the arena.
+static void parse(config_t *config, const char *buffer, size_t length)
+{
+	assert(config);
+	assert(buffer);
+	assert(config->arena == NULL);
+	
+	// there cannot be more pairs than there are lines, so the size of everything is known before starting.  The strings can never need
+	// more space than the file itself (each line gives up at least the '=' and the newline for the two terminators).
+	int lines = 1;
+	const char *ptr = buffer;
+	const char *end = buffer + length;
+	while ((ptr = memchr(ptr, '\n', end - ptr)) != NULL) {
+		lines ++;
+		ptr ++;
+	}
+	
+	int buckets = 16;
+	while (buckets < lines * 2) { buckets *= 2; }
+	
+	config->arena = malloc((sizeof(config_pair_t) * lines) + (sizeof(int) * buckets) + length + 2);
+	assert(config->arena);
+	config->pairs = (config_pair_t *) config->arena;
+	config->bucket = (int *) (config->arena + (sizeof(config_pair_t) * lines));
+	config->buckets = buckets;
+	char *strings = (char *) (config->bucket + buckets);
+	
+	const char *line = buffer;
+	while (line < end) {
+		const char *eol = memchr(line, '\n', end - line);
+		if (eol == NULL) { eol = end; }
+		const char *next = eol + 1;
+		
+		// trim the whitespace from the beginning and end of the line.
+		while (line < eol && is_space(*line)) { line ++; }
+		while (eol > line && is_space(eol[-1])) { eol --; }
 		
-		while(config->items > 0) {
-			config->items --;
-			assert(config->pairs[config->items].key);
-			free(config->pairs[config->items].key);
-			config->pairs[config->items].key = NULL;
-			
-			assert(config->pairs[config->items].value);
-			free(config->pairs[config->items].value);
-			config->pairs[config->items].value = NULL;
+		// skip blank lines and comments.
+		if (line < eol && *line != '#') {
+			const char *equals = memchr(line, '=', eol - line);
+			if (equals) {
+				const char *keyend = equals;
+				while (keyend > line && is_space(keyend[-1])) { keyend --; }
+				const char *value = equals + 1;
+				while (value < eol && is_space(*value)) { value ++; }
+				
+				assert(config->items < lines);
+				config_pair_t *pair = &config->pairs[config->items];
+				pair->key = arena_string(&strings, line, keyend - line);
+				pair->value = arena_string(&strings, value, eol - value);
+				config->items ++;
+			}
 		}
 		
-		free(config->pairs);
+		line = next;
 	}
 	
-	if (config->path) { free(config->path); }
-	
-	free(config);
-	config = NULL;
+	// build the index.  The pairs are added backwards, so that each bucket ends up in the same order as the file.
+	int i;
+	for (i=0; i < buckets; i++) {
+		config->bucket[i] = -1;
+	}
+	for (i=config->items - 1; i >= 0; i--) {
+		int b = key_hash(config->pairs[i].key) & (buckets - 1);
+		config->pairs[i].next = config->bucket[b];
+		config->bucket[b] = i;
+	}
 }
 
 
@@ -98,81 +193,23 @@ extern CONFIG config_load(const char *path)
 		fstat(fd, &sb);
 		off_t file_length = sb.st_size;
 		
-		// read the entire file into a buffer (using mmap).
-		char *file_buffer = mmap(NULL, file_length, PROT_READ, MAP_PRIVATE, fd, 0);
-		if (file_buffer != MAP_FAILED) {
-			
-// 			// copy the data from the file to a new string, because it will get modified while we are parsing it.
-			assert(file_buffer);
-			char *buffer = strndup(file_buffer, file_length);
-			assert(buffer);
-			
-			// first parse, remove all comments and blank lines.
-			char *next_line = buffer;
-			while (next_line) {
-				char *line = strsep(&next_line, "\n");
-				int line_length = strlen(line);
-				
-				if (line_length > 0) {
-					// trim all whitespace from the beginning of the line.
-// 					printf("raw line: [%s]\n", line);
-					while(line_length > 0 && (line[0] == ' ' || line[0] == '\t' || line[0] == '\r')) { 
-						line ++; 
-						line_length --;
-					}
-					
-					if (line_length > 0) {
-// 						printf("after trim front: [%s]\n", line);
-						
-						if (line[0] != '#' ) {
-						
-							// trim all whitespace at the end of the line
-							assert(line_length > 0);
-							line_length--;
-							while(line_length > 0 && (line[line_length] == ' ' || line[line_length] == '\t' || line[0] == '\r')) {
-								line[line_length] = 0;
-								line_length --;
-							}
-// 							printf("after trim end: [%s]\n", line);
-							
-							// we now have a line that is trimmed.  
-							// second parse, split on '='
-							char *value=index(line, '=');
-							if (value) {
-								value[0] = 0;
-								value++;
-								
-								// trim leading spaces from values.
-								while(value[0] == ' ' || value[0] == '\t' || value[0] == '\r') {
-									value ++;
-								}
-								
-								// trim trailing spaces from values.
-								int len = strlen(value) - 1;
-								while(len > 0 && (value[len] == ' ' || value[len] == '\t')) {
-									value[len] = 0;
-									len --;
-								}
-								
-								// make space in the array and add the new pair to it.
-// 								printf("%s='%s'\n", line, value);
-								assert(config);
-								assert(config->items >= 0);
-								config->pairs = realloc(config->pairs, sizeof(config_pair_t) * (config->items+1));
-								assert(config->pairs);
-								
-								config->pairs[config->items].key = strdup(line);
-								config->pairs[config->items].value = strdup(value);
-								config->items++;
-							}
-						}
-					}
-				}
+		// Parse the file straight out of a buffer, nothing is changed in it, the keys and values are copied out into the arena.
+		// Most config files are small, and for those a single read onto the stack is much cheaper than setting up (and tearing down) 
+		// a mapping.  Anything bigger is mapped.
+		char small[SMALL_CONFIG];
+		if (file_length > 0 && file_length <= SMALL_CONFIG) {
+			ssize_t len = pread(fd, small, file_length, 0);
+			if (len > 0) {
+				parse(config, small, len);
+			}
+		}
+		else if (file_length > 0) {
+			char *file_buffer = mmap(NULL, file_length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (file_buffer != MAP_FAILED) {
+				assert(file_buffer);
+				parse(config, file_buffer, file_length);
+				munmap(file_buffer, file_length);
 			}
-			
-			// we have finished parsing the buffer, we can free it now.
-			free(buffer);
-			buffer =  NULL;
 		}
 		
 		// close the file
@@ -187,27 +224,41 @@ extern CONFIG config_load(const char *path)
 
 // Get a config value based on the key.  Will return a string.
 extern const char * config_get(CONFIG configptr, const char *key)
+{
+	return(config_get_nth(configptr, key, 0));
+}
+
+
+// A key can be in the config more than once.  Get the value of the nth one (starting at 0), or NULL if there are not that many.
+extern const char * config_get_nth(CONFIG configptr, const char *key, int n)
 {
 	config_t *config = configptr;
 	assert(config);
 	
 	assert(key);
-	const char *value = NULL;
+	assert(n >= 0);
 
-	int i;
-	for (i=0; i<config->items; i++) {
+	if (config->items == 0) {
+		return(NULL);
+	}
+
+	assert(config->bucket);
+	int i = config->bucket[key_hash(key) & (config->buckets - 1)];
+	while (i >= 0) {
+		assert(i < config->items);
 		assert(config->pairs[i].key);
 		assert(config->pairs[i].value);
 		
-// 		printf("checking: %s\n", config->pairs[i].key);
-		
 		if(strcasecmp(key, config->pairs[i].key) == 0) {
-			value = config->pairs[i].value;
-			i = config->items;
+			if (n == 0) {
+				return(config->pairs[i].value);
+			}
+			n --;
 		}
+		i = config->pairs[i].next;
 	}
 	
-	return(value);
+	return(NULL);
 }
 
 
@@ -20,6 +20,8 @@ typedef void * CONFIG;
 CONFIG config_load(const char *path);
 
 const char * config_get(CONFIG config, const char *key);
+// for keys that are in the config more than once.  'n' starts at 0.  Returns NULL when there are no more.
+const char * config_get_nth(CONFIG config, const char *key, int n);
 int config_get_bool(CONFIG config, const char *key);
 long long config_get_long(CONFIG config, const char *key);
 
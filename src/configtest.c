@@ -1,28 +1,128 @@
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "configfile.h"
 
-void main(void)
+
+// the keys that the daemon looks up in each config file, in roughly the order that it does.
+static const char *lookups[] = {
+	"MonitorPath", "MonitorPathRecursive", "MonitorFile", "FileClosedExec", "FileClosedWriteExec", "BatchExec",
+	"IncludePattern", "ExcludePattern", "DebounceMs", "DebounceMaxMs", "MaxConcurrent", "ActionTimeout", NULL
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + (ts.tv_nsec / 1000000000.0));
+}
+
+
+// Parse throughput benchmark.  A directory of generated config files (like a large /etc/fileknock.d) is loaded over and over,
+// looking up the same keys that the daemon does.
+// 'extra' is the number of other keys added to each file, to see how the lookups cope with big files.
+//   configtest bench [files] [rounds] [extra]
+static void bench(int files, int rounds, int extra)
+{
+	char dir[] = "/tmp/configtest.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	char path[256];
+	long long bytes = 0;
+	int i;
+	for (i=0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/%06d.conf", dir, i);
+		FILE *fp = fopen(path, "w");
+		assert(fp);
+		fprintf(fp, "# Generated config %d, monitoring the incoming directory of a single customer.\n", i);
+		fprintf(fp, "MonitorPath=/data/dropzone/customer-%06d/incoming\n", i);
+		fprintf(fp, "FileClosedWriteExec = /usr/local/bin/ingest.sh\n");
+		fprintf(fp, "\n");
+		fprintf(fp, "IncludePattern=*.csv\n");
+		fprintf(fp, "IncludePattern=*.json\n");
+		fprintf(fp, "ExcludePattern=*.part\n");
+		fprintf(fp, "DebounceMs=250\n");
+		fprintf(fp, "MaxConcurrent=2\n");
+		fprintf(fp, "ActionTimeout=120\n");
+		fprintf(fp, "RunUser=customer%06d\n", i);
+		int k;
+		for (k=0; k < extra; k++) {
+			fprintf(fp, "Setting%d=value %d\n", k, k);
+		}
+		bytes += ftell(fp);
+		fclose(fp);
+	}
+
+	long long found = 0;
+	double start = now();
+	int round;
+	for (round=0; round < rounds; round++) {
+		for (i=0; i < files; i++) {
+			snprintf(path, sizeof(path), "%s/%06d.conf", dir, i);
+			CONFIG config = config_load(path);
+			assert(config);
+			int k;
+			for (k=0; lookups[k]; k++) {
+				if (config_get(config, lookups[k])) { found ++; }
+			}
+			found += config_get_long(config, "DebounceMs") > 0;
+			config_free(config);
+		}
+	}
+	double elapsed = now() - start;
+
+	long long loads = (long long) files * rounds;
+	printf("%lld files loaded in %.3f seconds (%lld lookups found)\n", loads, elapsed, found);
+	printf("%.0f files/sec, %.1f MB/sec, %.2f us per file\n", loads / elapsed, ((bytes * rounds) / elapsed) / (1024.0 * 1024.0), (elapsed * 1000000.0) / loads);
+
+	for (i=0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/%06d.conf", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+
+int main(int argc, char **argv)
 {
 	CONFIG config;
-	
-	
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		int files = argc > 2 ? atoi(argv[2]) : 5000;
+		int rounds = argc > 3 ? atoi(argv[3]) : 20;
+		if (files <= 0) { files = 5000; }
+		int extra = argc > 4 ? atoi(argv[4]) : 0;
+		if (rounds <= 0) { rounds = 20; }
+		if (extra < 0) { extra = 0; }
+		bench(files, rounds, extra);
+		return(0);
+	}
+
 	config = config_load("test.conf");
 	if (config) {
 		printf("Config loaded.\n");
 		const char *writefile = config_get(config, "WriteFile");
 		if (writefile) { printf("Write File: '%s'\n", writefile);}
-		
+
 		int active = config_get_bool(config, "activate");
 		if (active != 0) {printf("Activate!\n");}
 		else { printf("Not Active!\n");}
 
 		// we are finished with the config file, so we can delete it.
 		config_free(config);
-		
+
 	}
 	else {
 		printf("Config FAILED.\n");
 	}
+	return(0);
 }
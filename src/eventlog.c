@@ -0,0 +1,173 @@
+// eventlog.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A compact binary log of timestamped records.   No application specific code should be here.
+ * See eventlog.h for details.
+*/
+
+
+#include "eventlog.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define EVENTLOG_MAGIC	"FKLOG001"
+#define MAX_RECORD		(16 * 1024 * 1024)
+
+
+typedef struct {
+	uint32_t type;
+	uint32_t len;
+	int64_t time;
+} record_t;
+
+
+typedef struct {
+	int fd;
+	FILE *fp;			// when reading.
+	long long start;	// when the log was created (monotonic nanoseconds).
+	uint64_t *buffer;	// the data of the last record read.  uint64_t so that it is aligned for any structures in the data.
+	size_t size;
+} eventlog_t;
+
+
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+}
+
+
+extern EVENTLOG eventlog_create(const char *path)
+{
+	assert(path);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return(NULL);
+	}
+	if (write(fd, EVENTLOG_MAGIC, strlen(EVENTLOG_MAGIC)) != (ssize_t) strlen(EVENTLOG_MAGIC)) {
+		close(fd);
+		return(NULL);
+	}
+
+	eventlog_t *log = calloc(1, sizeof(eventlog_t));
+	assert(log);
+	log->fd = fd;
+	log->start = now_ns();
+	return((EVENTLOG) log);
+}
+
+
+extern EVENTLOG eventlog_open(const char *path)
+{
+	assert(path);
+
+	FILE *fp = fopen(path, "re");
+	if (fp == NULL) {
+		return(NULL);
+	}
+	char magic[sizeof(EVENTLOG_MAGIC)];
+	if (fread(magic, 1, strlen(EVENTLOG_MAGIC), fp) != strlen(EVENTLOG_MAGIC) || memcmp(magic, EVENTLOG_MAGIC, strlen(EVENTLOG_MAGIC)) != 0) {
+		fclose(fp);
+		return(NULL);
+	}
+
+	eventlog_t *log = calloc(1, sizeof(eventlog_t));
+	assert(log);
+	log->fd = -1;
+	log->fp = fp;
+	return((EVENTLOG) log);
+}
+
+
+extern void eventlog_close(EVENTLOG logptr)
+{
+	eventlog_t *log = logptr;
+	assert(log);
+	if (log->fd >= 0) { close(log->fd); }
+	if (log->fp) { fclose(log->fp); }
+	if (log->buffer) { free(log->buffer); }
+	free(log);
+}
+
+
+extern int eventlog_write(EVENTLOG logptr, uint32_t type, const void *data, size_t len, const void *data2, size_t len2)
+{
+	eventlog_t *log = logptr;
+	assert(log);
+	assert(log->fd >= 0);
+	assert(data || len == 0);
+	assert(data2 || len2 == 0);
+
+	if (len + len2 > MAX_RECORD) {
+		return(-1);
+	}
+
+	record_t record;
+	record.type = type;
+	record.len = len + len2;
+	record.time = now_ns() - log->start;
+
+	struct iovec iov[3];
+	iov[0].iov_base = &record;
+	iov[0].iov_len = sizeof(record);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+	iov[2].iov_base = (void *) data2;
+	iov[2].iov_len = len2;
+
+	ssize_t total = sizeof(record) + len + len2;
+	return(writev(log->fd, iov, 3) == total ? 0 : -1);
+}
+
+
+extern int eventlog_read(EVENTLOG logptr, uint32_t *type, long long *time, const void **data, size_t *len)
+{
+	eventlog_t *log = logptr;
+	assert(log);
+	assert(log->fp);
+	assert(type && time && data && len);
+
+	record_t record;
+	size_t got = fread(&record, 1, sizeof(record), log->fp);
+	if (got == 0) {
+		return(0);
+	}
+	if (got != sizeof(record) || record.len > MAX_RECORD) {
+		return(-1);
+	}
+
+	// one extra byte is left at the end, so that a record of strings is always terminated.
+	if (record.len + 1 > log->size) {
+		log->size = record.len + 1;
+		free(log->buffer);
+		log->buffer = malloc(((log->size + 7) / 8) * 8);
+		assert(log->buffer);
+	}
+	if (record.len > 0 && fread(log->buffer, 1, record.len, log->fp) != record.len) {
+		return(-1);
+	}
+	((char *) log->buffer)[record.len] = 0;
+
+	*type = record.type;
+	*time = record.time;
+	*data = log->buffer;
+	*len = record.len;
+	return(1);
+}
+
+
+// fin - eventlog.c
@@ -0,0 +1,38 @@
+// eventlog.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A compact binary log of timestamped records, that can be written and then read back in the same order.   No application specific code should be here.
+ * The file starts with a magic string, followed by the records.  Each record is a header (the type, the length of the data, and the time in 
+ * nanoseconds since the log was created) followed by the data.  Each record is written with a single write(), so that a log is still 
+ * usable up to the last record if the process writing it is killed.
+*/
+
+#ifndef __EVENTLOG_H
+#define __EVENTLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void * EVENTLOG;
+
+// create a new log for writing (replacing the file if it is already there).  Returns NULL if it could not be created.
+EVENTLOG eventlog_create(const char *path);
+
+// open an existing log for reading.  Returns NULL if it could not be opened, or is not a log.
+EVENTLOG eventlog_open(const char *path);
+
+void eventlog_close(EVENTLOG log);
+
+// add a record to the log.  The data is made up of two parts (the second can be NULL), so that a header does not need to be copied in front 
+// of the data.  Returns 0 on success.
+int eventlog_write(EVENTLOG log, uint32_t type, const void *data, size_t len, const void *data2, size_t len2);
+
+// read the next record from the log.  Returns 1 if there was one, 0 at the end of the log, or -1 if the log is damaged.
+// 'data' is only valid until the next read.  It is aligned to 8 bytes.
+int eventlog_read(EVENTLOG log, uint32_t *type, long long *time, const void **data, size_t *len);
+
+
+#endif
@@ -0,0 +1,697 @@
+// eventsink.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Publishes records of events to the processes that are listening for them.   No application specific code should be here.
+ * See eventsink.h for details.
+*/
+
+
+#define _GNU_SOURCE		// for accept4()
+
+#include "eventsink.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// how often (in milliseconds) a FIFO is tried again when nothing has it open for reading, as there is no way to be told when something does.
+#define FIFO_RETRY_MS	100
+
+// The longest fields that a record can have, which are the longest path and name that the kernel gives.  Anything longer is dropped.
+#define EVENT_MAX		NAME_MAX
+#define FIELD_PATH_MAX	PATH_MAX
+#define FIELD_NAME_MAX	NAME_MAX
+
+// so the largest record is a JSON one with all of them that long, and every character escaped as \u00XX.
+#define RECORD_MAX		(sizeof(uint32_t) + 96 + ((EVENT_MAX + FIELD_PATH_MAX + FIELD_NAME_MAX) * 6))
+
+// what is read from a subscriber (which has nothing to say, but is read so that we know when it has gone) goes in here.
+#define DISCARD_SIZE	1024
+
+
+typedef struct {
+	int fd;
+	char *buf;			// the records that have not been written to it yet, from 'off' to 'len'.
+	size_t off;
+	size_t len;
+	size_t size;		// grows as needed, up to the buffer size of the sink.
+} subscriber_t;
+
+
+typedef struct {
+	char *spec;
+	const char *path;	// the part of the spec after the type.
+	int fifo;
+	int format;
+	int policy;
+	size_t buffer;
+
+	int listenfd;		// the socket that subscribers connect to (-1 for a FIFO).
+
+	// the records that have been published, and not taken by the thread yet.
+	pthread_mutex_t lock;
+	char *queue;
+	size_t queued;
+
+	pthread_t thread;
+	int wakefd;
+	atomic_int stop;
+	atomic_int subscribers;
+	atomic_llong sent;
+	atomic_llong dropped;
+
+	// only used by the thread.
+	subscriber_t *subs;
+	int subcount;
+	int subsize;
+	char *taken;		// the records that the thread took from the queue, which it swaps with the queue each time.
+} sink_t;
+
+
+
+static void wake(sink_t *sink)
+{
+	assert(sink);
+	uint64_t one = 1;
+	while (write(sink->wakefd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+
+static void add_subscriber(sink_t *sink, int fd)
+{
+	assert(sink);
+	assert(fd >= 0);
+
+	if (sink->subcount >= sink->subsize) {
+		sink->subsize = sink->subsize ? sink->subsize * 2 : 8;
+		sink->subs = realloc(sink->subs, sink->subsize * sizeof(subscriber_t));
+		assert(sink->subs);
+	}
+	subscriber_t *sub = &sink->subs[sink->subcount ++];
+	memset(sub, 0, sizeof(subscriber_t));
+	sub->fd = fd;
+	atomic_store(&sink->subscribers, sink->subcount);
+}
+
+
+// the subscriber is moved out of the list by putting the last one in its place.
+static void remove_subscriber(sink_t *sink, int index)
+{
+	assert(sink);
+	assert(index >= 0 && index < sink->subcount);
+
+	subscriber_t *sub = &sink->subs[index];
+	close(sub->fd);
+	if (sub->buf) { free(sub->buf); }
+	sink->subcount --;
+	if (index < sink->subcount) {
+		*sub = sink->subs[sink->subcount];
+	}
+	atomic_store(&sink->subscribers, sink->subcount);
+}
+
+
+// write as much of the buffer as the subscriber will take.  Returns -1 if it has gone.
+static int flush_subscriber(subscriber_t *sub)
+{
+	assert(sub);
+	while (sub->off < sub->len) {
+		ssize_t sent = write(sub->fd, sub->buf + sub->off, sub->len - sub->off);
+		if (sent < 0) {
+			if (errno == EINTR) { continue; }
+			if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+			return(-1);
+		}
+		sub->off += sent;
+	}
+	if (sub->off == sub->len) {
+		sub->off = sub->len = 0;
+	}
+	return(0);
+}
+
+
+// add a record to what is waiting for the subscriber.  Returns -1 if it does not fit.
+static int append_record(sink_t *sink, subscriber_t *sub, const char *record, size_t len)
+{
+	assert(sink);
+	assert(sub);
+	assert(record);
+
+	if (sub->len - sub->off + len > sink->buffer) {
+		return(-1);
+	}
+	if (sub->len + len > sub->size) {
+		if (sub->off > 0) {
+			memmove(sub->buf, sub->buf + sub->off, sub->len - sub->off);
+			sub->len -= sub->off;
+			sub->off = 0;
+		}
+		if (sub->len + len > sub->size) {
+			size_t size = sub->size ? sub->size : 4096;
+			while (size < sub->len + len) {
+				size *= 2;
+			}
+			if (size > sink->buffer) { size = sink->buffer; }
+			sub->buf = realloc(sub->buf, size);
+			assert(sub->buf);
+			sub->size = size;
+		}
+	}
+	memcpy(sub->buf + sub->len, record, len);
+	sub->len += len;
+	return(0);
+}
+
+
+// give the records that were taken from the queue to every subscriber.
+static void deliver(sink_t *sink, const char *records, size_t len)
+{
+	assert(sink);
+	assert(records || len == 0);
+
+	int i = 0;
+	while (i < sink->subcount) {
+		subscriber_t *sub = &sink->subs[i];
+		int gone = 0;
+		long long sent = 0, dropped = 0;
+		size_t pos = 0;
+		while (pos < len) {
+			uint32_t reclen;
+			memcpy(&reclen, records + pos, sizeof(reclen));
+			size_t size = sizeof(reclen) + reclen;
+			assert(pos + size <= len);
+
+			// a record that does not fit could fit once some of the buffer has been written.
+			if (append_record(sink, sub, records + pos, size) != 0) {
+				if (flush_subscriber(sub) != 0) {
+					gone = 1;
+					break;
+				}
+				if (append_record(sink, sub, records + pos, size) != 0) {
+					dropped ++;
+					if (sink->policy == EVENTSINK_DISCONNECT) {
+						gone = 1;
+						break;
+					}
+					pos += size;
+					continue;
+				}
+			}
+			sent ++;
+			pos += size;
+		}
+		atomic_fetch_add(&sink->sent, sent);
+		atomic_fetch_add(&sink->dropped, dropped);
+
+		if (gone || flush_subscriber(sub) != 0) {
+			remove_subscriber(sink, i);
+		}
+		else {
+			i ++;
+		}
+	}
+}
+
+
+// take what has been published, and give it to the subscribers.
+static void take_queue(sink_t *sink)
+{
+	assert(sink);
+
+	pthread_mutex_lock(&sink->lock);
+	char *records = sink->queue;
+	size_t len = sink->queued;
+	sink->queue = sink->taken;
+	sink->queued = 0;
+	pthread_mutex_unlock(&sink->lock);
+	sink->taken = records;
+
+	if (len > 0) {
+		deliver(sink, records, len);
+	}
+}
+
+
+static void accept_subscribers(sink_t *sink)
+{
+	assert(sink);
+	assert(sink->listenfd >= 0);
+
+	for (;;) {
+		int fd = accept4(sink->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR) { continue; }
+			// EAGAIN when there are no more.  Anything else is a connection that went wrong, which can be left for it to try again.
+			return;
+		}
+		add_subscriber(sink, fd);
+	}
+}
+
+
+// A FIFO can only be opened for writing (without waiting) once something has it open for reading.  There is only ever the one
+// subscriber, as all the readers of a FIFO share what is written to it.
+static void open_fifo(sink_t *sink)
+{
+	assert(sink);
+	assert(sink->fifo);
+	assert(sink->subcount == 0);
+
+	int fd = open(sink->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd >= 0) {
+		add_subscriber(sink, fd);
+	}
+}
+
+
+// a subscriber has nothing to say, but reading from it is how we find out that it has gone.  Returns -1 if it has.
+static int read_subscriber(subscriber_t *sub)
+{
+	assert(sub);
+	char discard[DISCARD_SIZE];
+	for (;;) {
+		ssize_t len = read(sub->fd, discard, sizeof(discard));
+		if (len > 0) { continue; }
+		if (len < 0 && errno == EINTR) { continue; }
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return(0); }
+		return(-1);
+	}
+}
+
+
+static void * sink_main(void *arg)
+{
+	sink_t *sink = arg;
+	assert(sink);
+
+	struct pollfd *pfds = NULL;
+	int pfdsize = 0;
+
+	for (;;) {
+		if (sink->fifo && sink->subcount == 0) {
+			open_fifo(sink);
+		}
+
+		// the wakeup, the listening socket, and then each subscriber.  A subscriber is only waited on for writing while it has something waiting.
+		int count = 2 + sink->subcount;
+		if (count > pfdsize) {
+			pfdsize = count * 2;
+			pfds = realloc(pfds, pfdsize * sizeof(struct pollfd));
+			assert(pfds);
+		}
+		pfds[0].fd = sink->wakefd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = sink->listenfd;
+		pfds[1].events = POLLIN;
+		int i;
+		for (i=0; i < sink->subcount; i++) {
+			pfds[2 + i].fd = sink->subs[i].fd;
+			pfds[2 + i].events = (sink->fifo ? 0 : POLLIN) | (sink->subs[i].len > sink->subs[i].off ? POLLOUT : 0);
+		}
+
+		int timeout = (sink->fifo && sink->subcount == 0) ? FIFO_RETRY_MS : -1;
+		if (poll(pfds, count, timeout) < 0) {
+			if (errno == EINTR) { continue; }
+			break;
+		}
+
+		// the subscribers are looked at before any are added or removed, so that they still match the poll list.  They are
+		// gone through backwards, as removing one moves the last one into its place.
+		for (i=sink->subcount - 1; i >= 0; i--) {
+			short revents = pfds[2 + i].revents;
+			int gone = 0;
+			if (revents & POLLIN) {
+				gone = (read_subscriber(&sink->subs[i]) != 0);
+			}
+			else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				gone = 1;
+			}
+			if (gone == 0 && (revents & POLLOUT)) {
+				gone = (flush_subscriber(&sink->subs[i]) != 0);
+			}
+			if (gone) {
+				remove_subscriber(sink, i);
+			}
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			uint64_t value;
+			while (read(sink->wakefd, &value, sizeof(value)) < 0 && errno == EINTR);
+		}
+		if (sink->listenfd >= 0 && (pfds[1].revents & POLLIN)) {
+			accept_subscribers(sink);
+		}
+		take_queue(sink);
+
+		if (atomic_load(&sink->stop)) {
+			break;
+		}
+	}
+
+	free(pfds);
+	return(NULL);
+}
+
+
+static int listen_socket(const char *path)
+{
+	assert(path);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	strcpy(addr.sun_path, path);
+
+	// a socket left behind from the last time is replaced, but nothing else is.
+	struct stat st;
+	if (lstat(path, &st) == 0) {
+		if (S_ISSOCK(st.st_mode) == 0) {
+			errno = EEXIST;
+			return(-1);
+		}
+		unlink(path);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return(-1);
+	}
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return(-1);
+	}
+	return(fd);
+}
+
+
+extern EVENTSINK eventsink_new(const char *spec, int format, int policy, long buffer)
+{
+	assert(spec);
+	assert(format == EVENTSINK_BINARY || format == EVENTSINK_JSON);
+	assert(policy == EVENTSINK_DROP || policy == EVENTSINK_DISCONNECT);
+
+	int fifo;
+	if (strncasecmp(spec, "unix:", 5) == 0) {
+		fifo = 0;
+	}
+	else if (strncasecmp(spec, "fifo:", 5) == 0) {
+		fifo = 1;
+	}
+	else {
+		errno = EINVAL;
+		return(NULL);
+	}
+	if (spec[5] != '/') {
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	sink_t *sink = calloc(1, sizeof(sink_t));
+	assert(sink);
+	sink->spec = strdup(spec);
+	assert(sink->spec);
+	sink->path = sink->spec + 5;
+	sink->fifo = fifo;
+	sink->format = format;
+	sink->policy = policy;
+	// it must at least be able to hold the largest record.
+	sink->buffer = buffer > (long) RECORD_MAX ? (size_t) buffer : RECORD_MAX;
+	sink->listenfd = -1;
+
+	if (fifo) {
+		// the FIFO is made if it is not there already, and is left there afterwards, as readers can be waiting on it.
+		struct stat st;
+		int e = 0;
+		if (stat(sink->path, &st) == 0) {
+			if (S_ISFIFO(st.st_mode) == 0) { e = EEXIST; }
+		}
+		else if (mkfifo(sink->path, 0660) != 0) {
+			e = errno;
+		}
+		if (e != 0) {
+			free(sink->spec);
+			free(sink);
+			errno = e;
+			return(NULL);
+		}
+	}
+	else {
+		sink->listenfd = listen_socket(sink->path);
+		if (sink->listenfd < 0) {
+			int e = errno;
+			free(sink->spec);
+			free(sink);
+			errno = e;
+			return(NULL);
+		}
+	}
+
+	sink->queue = malloc(sink->buffer);
+	sink->taken = malloc(sink->buffer);
+	assert(sink->queue && sink->taken);
+	pthread_mutex_init(&sink->lock, NULL);
+	atomic_init(&sink->stop, 0);
+	atomic_init(&sink->subscribers, 0);
+	atomic_init(&sink->sent, 0);
+	atomic_init(&sink->dropped, 0);
+
+	// the thread takes none of the signals (in particular SIGPIPE, when a subscriber goes away while it is being written to).
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	sink->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int started = (sink->wakefd >= 0 && pthread_create(&sink->thread, NULL, sink_main, sink) == 0);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (started == 0) {
+		int e = errno;
+		if (sink->wakefd >= 0) { close(sink->wakefd); }
+		if (sink->listenfd >= 0) {
+			close(sink->listenfd);
+			unlink(sink->path);
+		}
+		pthread_mutex_destroy(&sink->lock);
+		free(sink->queue);
+		free(sink->taken);
+		free(sink->spec);
+		free(sink);
+		errno = e;
+		return(NULL);
+	}
+	return((EVENTSINK) sink);
+}
+
+
+extern void eventsink_free(EVENTSINK sinkptr)
+{
+	sink_t *sink = sinkptr;
+	assert(sink);
+
+	atomic_store(&sink->stop, 1);
+	wake(sink);
+	pthread_join(sink->thread, NULL);
+
+	// the subscribers get whatever they will take without waiting.
+	while (sink->subcount > 0) {
+		flush_subscriber(&sink->subs[0]);
+		remove_subscriber(sink, 0);
+	}
+	if (sink->subs) { free(sink->subs); }
+	if (sink->listenfd >= 0) {
+		close(sink->listenfd);
+		unlink(sink->path);
+	}
+	close(sink->wakefd);
+	pthread_mutex_destroy(&sink->lock);
+	free(sink->queue);
+	free(sink->taken);
+	free(sink->spec);
+	free(sink);
+}
+
+
+extern int eventsink_format(const char *name)
+{
+	assert(name);
+	if (strcasecmp(name, "binary") == 0) { return(EVENTSINK_BINARY); }
+	if (strcasecmp(name, "json") == 0) { return(EVENTSINK_JSON); }
+	return(-1);
+}
+
+
+extern int eventsink_policy(const char *name)
+{
+	assert(name);
+	if (strcasecmp(name, "drop") == 0) { return(EVENTSINK_DROP); }
+	if (strcasecmp(name, "disconnect") == 0) { return(EVENTSINK_DISCONNECT); }
+	return(-1);
+}
+
+
+extern const char * eventsink_spec(EVENTSINK sinkptr)
+{
+	sink_t *sink = sinkptr;
+	assert(sink);
+	return(sink->spec);
+}
+
+
+// add a string to a JSON record, with the quotes.
+static char * json_string(char *out, const char *str, size_t len)
+{
+	assert(out);
+	assert(str);
+
+	*out++ = '"';
+	size_t i;
+	for (i=0; i < len; i++) {
+		unsigned char c = str[i];
+		if (c == '"' || c == '\\') {
+			*out++ = '\\';
+			*out++ = c;
+		}
+		else if (c < 0x20) {
+			out += sprintf(out, "\\u%04x", c);
+		}
+		else {
+			*out++ = c;
+		}
+	}
+	*out++ = '"';
+	return(out);
+}
+
+
+extern void eventsink_publish(EVENTSINK sinkptr, long long time, const char *event, const char *path, const char *name)
+{
+	sink_t *sink = sinkptr;
+	assert(sink);
+	assert(event);
+	assert(path);
+
+	// nothing is prepared for no one.
+	int subscribers = atomic_load(&sink->subscribers);
+	if (subscribers == 0) {
+		return;
+	}
+
+	size_t eventlen = strlen(event);
+	size_t pathlen = strlen(path);
+	size_t namelen = name ? strlen(name) : 0;
+	if (eventlen > EVENT_MAX || pathlen > FIELD_PATH_MAX || namelen > FIELD_NAME_MAX) {
+		atomic_fetch_add(&sink->dropped, subscribers);
+		return;
+	}
+
+	// every character could need escaping as \u00XX.  It is never more than RECORD_MAX (about 28KB).
+	size_t most = sizeof(uint32_t) + (sink->format == EVENTSINK_JSON ? 96 + ((eventlen + pathlen + namelen) * 6) : 16 + eventlen + pathlen + namelen);
+	char record[most];
+	size_t len;
+	if (sink->format == EVENTSINK_JSON) {
+		char *out = record + sizeof(uint32_t);
+		time_t secs = time / 1000000000LL;
+		struct tm tm;
+		gmtime_r(&secs, &tm);
+		out += sprintf(out, "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06dZ\",\"event\":",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int) ((time % 1000000000LL) / 1000));
+		out = json_string(out, event, eventlen);
+		out += sprintf(out, ",\"path\":");
+		out = json_string(out, path, pathlen);
+		out += sprintf(out, ",\"name\":");
+		out = json_string(out, name ? name : "", namelen);
+		*out++ = '}';
+		len = out - record;
+	}
+	else {
+		uint64_t stamp = time;
+		uint16_t lens[4] = { eventlen, pathlen, namelen, 0 };
+		char *out = record + sizeof(uint32_t);
+		memcpy(out, &stamp, sizeof(stamp));
+		out += sizeof(stamp);
+		memcpy(out, lens, sizeof(lens));
+		out += sizeof(lens);
+		memcpy(out, event, eventlen);
+		out += eventlen;
+		memcpy(out, path, pathlen);
+		out += pathlen;
+		if (namelen > 0) {
+			memcpy(out, name, namelen);
+			out += namelen;
+		}
+		len = out - record;
+	}
+	assert(len <= most);
+	uint32_t reclen = len - sizeof(uint32_t);
+	memcpy(record, &reclen, sizeof(reclen));
+
+	// if the thread has fallen so far behind that the queue is full, the record is missed by everyone.
+	pthread_mutex_lock(&sink->lock);
+	int added = 0, waswaiting = (sink->queued > 0);
+	if (sink->queued + len <= sink->buffer) {
+		memcpy(sink->queue + sink->queued, record, len);
+		sink->queued += len;
+		added = 1;
+	}
+	pthread_mutex_unlock(&sink->lock);
+
+	if (added == 0) {
+		atomic_fetch_add(&sink->dropped, subscribers);
+	}
+	else if (waswaiting == 0) {
+		// the thread only needs to be woken for the first record it has not taken yet.
+		wake(sink);
+	}
+}
+
+
+extern int eventsink_subscribers(EVENTSINK sinkptr)
+{
+	sink_t *sink = sinkptr;
+	assert(sink);
+	return(atomic_load(&sink->subscribers));
+}
+
+
+extern long long eventsink_sent(EVENTSINK sinkptr)
+{
+	sink_t *sink = sinkptr;
+	assert(sink);
+	return(atomic_load(&sink->sent));
+}
+
+
+extern long long eventsink_dropped(EVENTSINK sinkptr)
+{
+	sink_t *sink = sinkptr;
+	assert(sink);
+	return(atomic_load(&sink->dropped));
+}
+
+
+// fin - eventsink.c
@@ -0,0 +1,56 @@
+// eventsink.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Publishes records of events to the processes that are listening for them.   No application specific code should be here.
+ * A sink is either a unix socket (unix:/path), which any number of subscribers can connect to, or a FIFO (fifo:/path), which is
+ * written to whenever something has it open for reading.  A subscriber only gets the records published while it is connected.
+ *
+ * The records are written by a thread of the sink, and each subscriber has a buffer of its own, so a subscriber that is slow to
+ * read never holds up the caller or the other subscribers.  When a subscriber's buffer is full, the records are dropped for it (and
+ * counted), or it is disconnected (so that it knows it has missed some, and can connect again), depending on the policy.
+ *
+ * Every record starts with its length (uint32_t, not including the length itself), followed by either:
+ *   EVENTSINK_BINARY - the time (uint64_t nanoseconds since the epoch), then the lengths of the event, path and name (uint16_t each),
+ *                      a uint16_t that is zero, and then the event, path and name (not terminated).
+ *   EVENTSINK_JSON   - {"time":"2024-01-02T03:04:05.678901Z","event":"CLOSED_WRITE","path":"/data","name":"report.csv"}
+ * All in the byte order of the host.  An event with a path longer than PATH_MAX (or a name or event longer than NAME_MAX) is dropped.
+*/
+
+#ifndef __EVENTSINK_H
+#define __EVENTSINK_H
+
+typedef void * EVENTSINK;
+
+#define EVENTSINK_BINARY		0
+#define EVENTSINK_JSON			1
+
+#define EVENTSINK_DROP			0		// the records that do not fit in a subscriber's buffer are dropped.
+#define EVENTSINK_DISCONNECT	1		// a subscriber whose buffer is full is disconnected.
+
+// Create the socket (or FIFO) and start the thread.  A socket that is already there is replaced.  'buffer' is the most bytes that are
+// kept for each subscriber.  Returns NULL (with errno set) if it cannot be done.
+EVENTSINK eventsink_new(const char *spec, int format, int policy, long buffer);
+
+// Disconnect the subscribers (after giving them what they have been sent), and remove the socket.
+void eventsink_free(EVENTSINK sink);
+
+// Parse the name of a format (binary, json) or policy (drop, disconnect).  Returns -1 if it is not known.
+int eventsink_format(const char *name);
+int eventsink_policy(const char *name);
+
+// the spec it was created with.
+const char * eventsink_spec(EVENTSINK sink);
+
+// Send a record to everything subscribed.  'name' can be NULL.  Nothing is done if there are no subscribers.  Can be called from any thread.
+void eventsink_publish(EVENTSINK sink, long long time, const char *event, const char *path, const char *name);
+
+// the number of subscribers connected, the records that were given to them, and the ones they missed because they were too slow.
+int eventsink_subscribers(EVENTSINK sink);
+long long eventsink_sent(EVENTSINK sink);
+long long eventsink_dropped(EVENTSINK sink);
+
+
+#endif
@@ -0,0 +1,1493 @@
+// executor.c
+
+/*
+ * Part of the FileKnock Daemon
+ * by Clinton Webb (webb.clint@gmail.com)
+ *
+ * The executor runs the actions for the daemon.  See executor.h for details.
+ *
+ * Child processes are observed with a signalfd for SIGCHLD (which means SIGCHLD must be blocked), and reaped with waitpid().
+ * Each action is started in its own process group, so that if it needs to be killed, anything it has started is killed with it.
+ *
+ * Actions are started with posix_spawn(), which (on Linux) uses clone(CLONE_VM|CLONE_VFORK), so unlike fork() it does not need to copy
+ * the page tables of the daemon.  With a large number of watches, that copy is most of the time it takes to start an action.
+ * The argv and the static part of the environment for each action are built once (a template), so starting an action only needs 
+ * to fill in the details of the event.
+ *
+ * Optionally, a small helper process can do all the spawning.  It is forked early (before the watch table has grown), and is sent
+ * compact requests over a SOCK_SEQPACKET socket.  It replies with the pid of each action when it has started, and the status when
+ * it exits.  The event loop then never waits for a process to be created, it only writes a small message to the socket.
+*/
+
+
+#include "executor.h"
+#include "hashmap.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// When an action has run too long, it is asked to stop (SIGTERM).  If it is still running after this long, it is killed (SIGKILL).
+#define KILL_GRACE_MS	5000
+
+
+// The number of environment entries at the start of each template that are filled in for each event (FK_PATH, FK_FILE and FK_ACTION).
+#define EVENT_ENV	3
+
+
+typedef struct {
+	int id;				// used to refer to the template when talking to the helper.
+	int refs;			// the owner of the template, and each job that uses it.
+	char *exec;
+	char *argv[2];
+	char **envp;		// the first EVENT_ENV entries are left empty for the event, and it is terminated with a NULL.
+	int envcount;		// the number of entries in envp, not counting the NULL.
+} template_t;
+
+
+// A token bucket, which limits how often actions are started.  Tokens are added at 'rate' a second (up to 'burst' of them), and 
+// starting an action takes one.
+typedef struct {
+	double rate;		// 0 for no limit.
+	double burst;
+	double tokens;
+	long long last;		// when the tokens were last added (microseconds, monotonic).
+} bucket_t;
+
+
+struct group_t;
+struct executor_t;
+
+typedef struct job_t {
+	struct executor_t *executor;
+	struct group_t *group;
+	template_t *template;
+	char *path;
+	char *name;
+	const char *action;
+	char *hash;			// FK_HASH, or NULL if it isn't given to the action.
+	int input;			// the stdin for the action, or -1.
+
+	pid_t pid;			// 0 while the helper is still starting it.
+	uint32_t id;		// identifies the job when talking to the helper.
+	TIMER timer;		// the timeout for the action while it is running.
+	long long submitted;	// when the job was given to the executor, and when the action started (microseconds, monotonic).
+	long long started;
+	int killed;			// the action has already been sent a SIGTERM.
+
+	// all the queued jobs are in a list in the order they were submitted, and also in a list for their group.
+	struct job_t *prev, *next;
+	struct job_t *groupnext;
+} job_t;
+
+
+typedef struct group_t {
+	int refs;			// the owner of the group, and each job in it.
+	int max;
+	int running;
+	long timeout;
+	bucket_t bucket;
+
+	// the jobs waiting to be run for this group.
+	job_t *head, *tail;
+	int waiting;
+
+	// groups that have jobs waiting are in a list, which is gone through in turn, so that one busy group does not hold up the others.
+	struct group_t *readynext;
+	int ready;
+} group_t;
+
+
+typedef struct executor_t {
+	TIMERS timers;
+	int max;
+	int running;
+	int maxqueue;
+	int queued;
+	int policy;
+	long timeout;
+	bucket_t bucket;
+	int throttle;		// the percentage of the limits (on the number running, and the rate) that apply.  100 unless the system is busy.
+	TIMER ratetimer;	// set when the jobs waiting are held back by a rate, for when the next of them can be started.
+
+	job_t *oldest, *newest;
+	group_t *readyhead, *readytail;
+	int readycount;
+
+	HASHMAP children;	// the running jobs, keyed on pid.
+	int sigfd;
+	
+	posix_spawnattr_t attr;		// the same attributes are used for every action.
+	
+	template_t **templates;
+	int templatecount;
+	
+	int helper;			// the socket to the spawn helper, or -1 if the actions are spawned directly.
+	pid_t helperpid;
+	int blocked;		// the helper socket is full, so no more actions can be sent until it has caught up.
+	uint32_t nextid;
+	HASHMAP helperjobs;	// the jobs that have been sent to the helper, keyed on id.
+
+	int dryrun;			// the actions are not actually run (they are still queued, limited and counted the same way).
+	
+	LOGGER logger;		// NULL to write the messages to stdout and stderr directly (as the spawn helper does).
+	LOGLIMIT droplimit;	// a queue that is full would otherwise log every action it drops.
+
+	METRICS metrics;	// can be NULL.  The ids are only set if it isn't.
+	int m_spawned;
+	int m_dropped;
+	int m_deferred;
+	int m_failed;
+	int m_timedout;
+	int m_active;
+	int m_queued;
+	int m_latency;
+	int m_runtime;
+	int m_throttle;
+} executor_t;
+
+
+
+
+static long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long) ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000));
+}
+
+
+static void bucket_set(bucket_t *bucket, long rate, int burst)
+{
+	assert(bucket);
+	bucket->rate = rate > 0 ? rate : 0;
+	bucket->burst = burst > 0 ? burst : (rate > 0 ? rate : 1);
+	bucket->tokens = bucket->burst;
+	bucket->last = now_us();
+}
+
+
+// add the tokens for the time since they were last added (at 'percent' of the rate), and return non-zero if there is one to take.
+static int bucket_ready(bucket_t *bucket, int percent, long long now)
+{
+	assert(bucket);
+	if (bucket->rate == 0) {
+		return(1);
+	}
+	if (now > bucket->last) {
+		bucket->tokens += ((now - bucket->last) * bucket->rate * percent) / 100000000.0;
+		if (bucket->tokens > bucket->burst) { bucket->tokens = bucket->burst; }
+		bucket->last = now;
+	}
+	return(bucket->tokens >= 1.0);
+}
+
+
+// the milliseconds until there will be a token to take.
+static long bucket_wait(bucket_t *bucket, int percent)
+{
+	assert(bucket);
+	assert(bucket->rate > 0);
+	assert(percent > 0);
+	if (bucket->tokens >= 1.0) {
+		return(0);
+	}
+	return((long) (((1.0 - bucket->tokens) * 100000.0) / (bucket->rate * percent)) + 1);
+}
+
+
+static void bucket_take(bucket_t *bucket)
+{
+	assert(bucket);
+	if (bucket->rate > 0) {
+		bucket->tokens -= 1.0;
+	}
+}
+
+
+static void bucket_return(bucket_t *bucket)
+{
+	assert(bucket);
+	if (bucket->rate > 0) {
+		bucket->tokens += 1.0;
+	}
+}
+
+
+static void log_message(executor_t *executor, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void log_message(executor_t *executor, int level, const char *fmt, ...)
+{
+	assert(executor);
+	assert(fmt);
+	va_list args;
+	va_start(args, fmt);
+	if (executor->logger) {
+		logger_vwrite(executor->logger, level, fmt, args);
+	}
+	else {
+		FILE *out = level <= LOGGER_WARNING ? stderr : stdout;
+		vfprintf(out, fmt, args);
+		fputc('\n', out);
+	}
+	va_end(args);
+}
+
+
+static void log_dropped(executor_t *executor, const char *exec, const char *path)
+{
+	assert(executor);
+	if (executor->logger) {
+		logger_limited(executor->logger, &executor->droplimit, 10, LOGGER_WARNING, "Action queue is full, dropping action '%s' for '%s'", exec, path);
+	}
+	else {
+		fprintf(stderr, "Action queue is full, dropping action '%s' for '%s'\n", exec, path);
+	}
+}
+
+
+static void count(executor_t *executor, int id)
+{
+	assert(executor);
+	if (executor->metrics) {
+		metrics_add(executor->metrics, id, 1);
+	}
+}
+
+
+// the number of actions running and queued are kept up to date in the metrics.
+static void update_gauges(executor_t *executor)
+{
+	assert(executor);
+	if (executor->metrics) {
+		metrics_set(executor->metrics, executor->m_active, executor->running);
+		metrics_set(executor->metrics, executor->m_queued, executor->queued);
+	}
+}
+
+
+extern void executor_metrics(EXECUTOR executorptr, METRICS metrics)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	assert(metrics);
+	executor->metrics = metrics;
+	executor->m_spawned = metrics_counter(metrics, "actions.spawned");
+	executor->m_failed = metrics_counter(metrics, "actions.failed");
+	executor->m_dropped = metrics_counter(metrics, "actions.dropped");
+	executor->m_deferred = metrics_counter(metrics, "actions.deferred");
+	executor->m_timedout = metrics_counter(metrics, "actions.timedout");
+	executor->m_active = metrics_gauge(metrics, "actions.active");
+	executor->m_queued = metrics_gauge(metrics, "actions.queued");
+	executor->m_latency = metrics_histogram(metrics, "actions.spawn_latency_us");
+	executor->m_runtime = metrics_histogram(metrics, "actions.runtime_ms");
+	executor->m_throttle = metrics_gauge(metrics, "actions.throttle_pct");
+	metrics_set(metrics, executor->m_throttle, executor->throttle);
+}
+
+
+extern void executor_logger(EXECUTOR executorptr, LOGGER logger)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	executor->logger = logger;
+}
+
+
+extern void executor_dryrun(EXECUTOR executorptr)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	executor->dryrun = 1;
+}
+
+
+// returns non-zero if there are no actions running or waiting to run.
+extern int executor_idle(EXECUTOR executorptr)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	return(executor->running == 0 && executor->queued == 0);
+}
+
+
+extern int executor_policy(const char *name)
+{
+	assert(name);
+	if (strcasecmp(name, "drop-new") == 0 || strcasecmp(name, "dropnew") == 0) {
+		return(EXEC_DROP_NEW);
+	}
+	else if (strcasecmp(name, "drop-old") == 0 || strcasecmp(name, "dropold") == 0) {
+		return(EXEC_DROP_OLD);
+	}
+	return(-1);
+}
+
+
+extern EXECUTOR executor_new(TIMERS timers, int max, int maxqueue, int policy, long timeout)
+{
+	assert(timers);
+	assert(max >= 0);
+	assert(maxqueue >= 0);
+	assert(policy == EXEC_DROP_NEW || policy == EXEC_DROP_OLD);
+
+	executor_t *executor = calloc(1, sizeof(executor_t));
+	assert(executor);
+	executor->timers = timers;
+	executor->max = max;
+	executor->maxqueue = maxqueue;
+	executor->policy = policy;
+	executor->timeout = timeout;
+	executor->throttle = 100;
+	executor->children = hashmap_new();
+	assert(executor->children);
+	executor->helper = -1;
+	executor->helperjobs = hashmap_new();
+	assert(executor->helperjobs);
+
+	// SIGCHLD needs to be blocked for the signalfd to receive it.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	executor->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (executor->sigfd == -1) {
+		perror("signalfd");
+		exit(EXIT_FAILURE);
+	}
+	
+	// The actions should not inherit the signals that the daemon has blocked, and each one goes in its own process group, 
+	// so that it can be killed along with anything it starts.
+	sigset_t empty;
+	sigemptyset(&empty);
+	posix_spawnattr_init(&executor->attr);
+	posix_spawnattr_setsigmask(&executor->attr, &empty);
+	posix_spawnattr_setpgroup(&executor->attr, 0);
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP;
+#ifdef POSIX_SPAWN_USEVFORK
+	// older versions of glibc only avoid the fork when asked.
+	flags |= POSIX_SPAWN_USEVFORK;
+#endif
+	posix_spawnattr_setflags(&executor->attr, flags);
+
+	return((EXECUTOR) executor);
+}
+
+
+extern EXECGROUP executor_group(EXECUTOR executorptr, int max, long timeout)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+
+	group_t *group = calloc(1, sizeof(group_t));
+	assert(group);
+	group->refs = 1;
+	group->max = max > 0 ? max : 0;
+	group->timeout = timeout > 0 ? timeout : executor->timeout;
+	return((EXECGROUP) group);
+}
+
+
+extern void executor_group_rate(EXECUTOR executorptr, EXECGROUP groupptr, long rate, int burst)
+{
+	group_t *group = groupptr;
+	assert(executorptr);
+	assert(group);
+	bucket_set(&group->bucket, rate, burst);
+}
+
+
+static void group_release(group_t *group)
+{
+	assert(group);
+	assert(group->refs > 0);
+	group->refs --;
+	if (group->refs == 0) {
+		assert(group->head == NULL);
+		assert(group->running == 0);
+		assert(group->ready == 0);
+		free(group);
+	}
+}
+
+
+// The owner has finished with the group.  It is freed once the last of its actions has finished.
+extern void executor_group_release(EXECUTOR executorptr, EXECGROUP groupptr)
+{
+	assert(executorptr);
+	group_release(groupptr);
+}
+
+
+extern int executor_fd(EXECUTOR executorptr)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	return(executor->sigfd);
+}
+
+
+
+// The messages between the daemon and the spawn helper.  Each is a header followed by 'count' NUL terminated strings.
+#define HELPER_TEMPLATE		1		// daemon->helper: id, strings are the exec followed by the static environment.
+#define HELPER_SPAWN		2		// daemon->helper: id of the job, value is the template, strings are the path, name and action.
+#define HELPER_STARTED		3		// helper->daemon: id of the job, value is the pid (or -1 if it could not be started).
+#define HELPER_EXITED		4		// helper->daemon: id of the job, value is the status from waitpid().
+#define HELPER_FORGET		5		// daemon->helper: id of a template that will not be used again.
+
+#define HELPER_MSG_MAX		65536
+#define HELPER_MAX_STRINGS	1024
+
+typedef struct {
+	uint32_t type;
+	uint32_t id;
+	int32_t value;
+	uint32_t count;
+} helper_msg_t;
+
+
+// build a message in 'buf'.  Returns the length of the message, or -1 if it does not fit.
+static int helper_pack(char *buf, uint32_t type, uint32_t id, int32_t value, const char * const *strings, uint32_t count)
+{
+	assert(buf);
+	helper_msg_t *msg = (helper_msg_t *) buf;
+	msg->type = type;
+	msg->id = id;
+	msg->value = value;
+	msg->count = count;
+
+	size_t len = sizeof(helper_msg_t);
+	uint32_t i;
+	for (i=0; i < count; i++) {
+		assert(strings[i]);
+		size_t slen = strlen(strings[i]) + 1;
+		if (len + slen > HELPER_MSG_MAX) {
+			return(-1);
+		}
+		memcpy(buf + len, strings[i], slen);
+		len += slen;
+	}
+	return((int) len);
+}
+
+
+// split the strings out of a received message.  Returns the number of strings found.
+static uint32_t helper_unpack(char *buf, ssize_t len, char **strings, uint32_t max)
+{
+	assert(buf);
+	assert(len >= (ssize_t) sizeof(helper_msg_t));
+	helper_msg_t *msg = (helper_msg_t *) buf;
+
+	char *ptr = buf + sizeof(helper_msg_t);
+	char *end = buf + len;
+	uint32_t found = 0;
+	while (found < msg->count && found < max && ptr < end) {
+		char *nul = memchr(ptr, 0, end - ptr);
+		if (nul == NULL) {
+			break;
+		}
+		strings[found] = ptr;
+		found ++;
+		ptr = nul + 1;
+	}
+	return(found);
+}
+
+
+// send a message to the helper without blocking, along with a file descriptor if 'fd' is not -1.
+static ssize_t helper_send(int sock, char *buf, int len, int fd)
+{
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	char control[CMSG_SPACE(sizeof(int))];
+	if (fd >= 0) {
+		memset(control, 0, sizeof(control));
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	return(sendmsg(sock, &hdr, MSG_DONTWAIT));
+}
+
+
+// receive a message from the daemon, along with the file descriptor that was sent with it (or -1 if there wasn't one).
+static ssize_t helper_recv(int sock, char *buf, size_t size, int *fd)
+{
+	assert(fd);
+	*fd = -1;
+
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = size;
+
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+
+	ssize_t len = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+	if (len > 0) {
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	return(len);
+}
+
+
+// send a template to the helper, so that it can be referred to by its id.
+static void helper_template(executor_t *executor, template_t *template)
+{
+	assert(executor);
+	assert(executor->helper >= 0);
+	assert(template);
+
+	const char *strings[template->envcount - EVENT_ENV + 1];
+	strings[0] = template->exec;
+	int i;
+	for (i=EVENT_ENV; i < template->envcount; i++) {
+		strings[1 + i - EVENT_ENV] = template->envp[i];
+	}
+
+	char buf[HELPER_MSG_MAX];
+	int len = helper_pack(buf, HELPER_TEMPLATE, template->id, 0, strings, template->envcount - EVENT_ENV + 1);
+	if (len < 0 || send(executor->helper, buf, len, 0) != len) {
+		log_message(executor, LOGGER_ERROR, "Unable to send action '%s' to the spawn helper", template->exec);
+	}
+}
+
+
+static template_t * new_template(const char *exec, const char * const *env)
+{
+	assert(exec);
+
+	template_t *template = calloc(1, sizeof(template_t));
+	assert(template);
+	template->refs = 1;
+	template->exec = strdup(exec);
+	assert(template->exec);
+
+	// the action is given its own path as argv[0], which is what would be expected if it was run from a shell.
+	template->argv[0] = template->exec;
+	template->argv[1] = NULL;
+
+	int count = 0;
+	while (env && env[count]) { count ++; }
+
+	template->envcount = EVENT_ENV + count;
+	template->envp = calloc(template->envcount + 1, sizeof(char *));
+	assert(template->envp);
+	int i;
+	for (i=0; i < count; i++) {
+		template->envp[EVENT_ENV + i] = strdup(env[i]);
+		assert(template->envp[EVENT_ENV + i]);
+	}
+	template->envp[template->envcount] = NULL;
+
+	return(template);
+}
+
+
+static void free_template(template_t *template)
+{
+	assert(template);
+	int i;
+	for (i=EVENT_ENV; i < template->envcount; i++) {
+		free(template->envp[i]);
+	}
+	free(template->envp);
+	free(template->exec);
+	free(template);
+}
+
+
+static void template_release(executor_t *executor, template_t *template)
+{
+	assert(executor);
+	assert(template);
+	assert(template->refs > 0);
+
+	template->refs --;
+	if (template->refs == 0) {
+		assert(executor->templates[template->id] == template);
+		executor->templates[template->id] = NULL;
+
+		if (executor->helper >= 0) {
+			char buf[sizeof(helper_msg_t)];
+			int len = helper_pack(buf, HELPER_FORGET, template->id, 0, NULL, 0);
+			send(executor->helper, buf, len, 0);
+		}
+		free_template(template);
+	}
+}
+
+
+// The owner has finished with the template.  It is freed once the last of the actions using it has finished.
+extern void executor_template_release(EXECUTOR executorptr, EXECTEMPLATE templateptr)
+{
+	template_release(executorptr, templateptr);
+}
+
+
+extern EXECTEMPLATE executor_template(EXECUTOR executorptr, const char *exec, const char * const *env)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	assert(exec);
+
+	template_t *template = new_template(exec, env);
+	assert(template);
+
+	// the id of one that has been freed is used again, so that reloading the config files does not keep growing the list (and the 
+	// helper's copy of it).  Templates are only made when the config is loaded, so the list is just searched for a free one.
+	int id;
+	for (id=0; id < executor->templatecount && executor->templates[id]; id++);
+	if (id == executor->templatecount) {
+		executor->templates = realloc(executor->templates, sizeof(template_t *) * (executor->templatecount + 1));
+		assert(executor->templates);
+		executor->templatecount ++;
+	}
+	template->id = id;
+	executor->templates[id] = template;
+
+	if (executor->helper >= 0) {
+		helper_template(executor, template);
+	}
+
+	return((EXECTEMPLATE) template);
+}
+
+
+// start a process to perform the action.  Returns the pid, or -1 if it could not be started.
+// 'hash' is given to the action as FK_HASH (if it isn't NULL).
+// 'input' is a file descriptor that will be the stdin of the action (or -1 to leave stdin as it is).
+static pid_t spawn_action(executor_t *executor, template_t *template, const char *path, const char *name, const char *action, const char *hash, int input)
+{
+	assert(executor);
+	assert(template);
+	assert(path);
+	assert(action);
+
+	if (name == NULL) { name = path; }
+
+	// The environment is the template, with the entries for the event filled in.  Everything is on the stack, as posix_spawn() 
+	// has finished with it by the time it returns.
+	char fkpath[sizeof("FK_PATH=") + strlen(path)];
+	char fkfile[sizeof("FK_FILE=") + strlen(name)];
+	char fkaction[sizeof("FK_ACTION=") + strlen(action)];
+	char fkhash[sizeof("FK_HASH=") + (hash ? strlen(hash) : 0)];
+	
+	// FK_PATH is the directory that the file is in (for a recursive rule, this is the sub-directory), or the file itself if a file is being watched.
+	sprintf(fkpath, "FK_PATH=%s", path);
+	sprintf(fkfile, "FK_FILE=%s", name);
+	sprintf(fkaction, "FK_ACTION=%s", action);
+
+	char *envp[template->envcount + 2];
+	memcpy(envp, template->envp, sizeof(char *) * (template->envcount + 1));
+	envp[0] = fkpath;
+	envp[1] = fkfile;
+	envp[2] = fkaction;
+	if (hash) {
+		// it goes on the end, as the template has no room for it.
+		sprintf(fkhash, "FK_HASH=%s", hash);
+		envp[template->envcount] = fkhash;
+		envp[template->envcount + 1] = NULL;
+	}
+
+	posix_spawn_file_actions_t actions;
+	if (input >= 0) {
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+	}
+
+	pid_t pid = -1;
+	int result = posix_spawn(&pid, template->exec, input >= 0 ? &actions : NULL, &executor->attr, template->argv, envp);
+	if (input >= 0) {
+		posix_spawn_file_actions_destroy(&actions);
+	}
+	if (result != 0) {
+		log_message(executor, LOGGER_ERROR, "Unable to run action '%s', %s", template->exec, strerror(result));
+		return(-1);
+	}
+
+	return(pid);
+}
+
+
+static void free_job(job_t *job)
+{
+	assert(job);
+	assert(job->timer == NULL);
+	if (job->input >= 0) { close(job->input); }
+	template_release(job->executor, job->template);
+	group_release(job->group);
+	free(job->path);
+	if (job->name) { free(job->name); }
+	if (job->hash) { free(job->hash); }
+	free(job);
+}
+
+
+static void job_timeout(void *arg)
+{
+	job_t *job = arg;
+	assert(job);
+	assert(job->pid > 0);
+	assert(job->executor);
+
+	// the timer has been freed once it fires.
+	job->timer = NULL;
+
+	if (job->killed == 0) {
+		// ask it nicely first, and give it some time to clean up.
+		log_message(job->executor, LOGGER_WARNING, "Action '%s' (PID=%d) has run too long, stopping it.", job->template->exec, job->pid);
+		kill(-job->pid, SIGTERM);
+		job->killed = 1;
+		job->timer = timer_add(job->executor->timers, timers_now() + KILL_GRACE_MS, job_timeout, job);
+	}
+	else {
+		log_message(job->executor, LOGGER_WARNING, "Action '%s' (PID=%d) did not stop, killing it.", job->template->exec, job->pid);
+		kill(-job->pid, SIGKILL);
+	}
+}
+
+
+// The action for a job has been started (or failed to start, if 'pid' is not positive).
+static void job_started(executor_t *executor, job_t *job, pid_t pid)
+{
+	assert(executor);
+	assert(job);
+
+	if (pid <= 0) {
+		count(executor, executor->m_failed);
+		executor->running --;
+		job->group->running --;
+		assert(executor->running >= 0);
+		assert(job->group->running >= 0);
+		update_gauges(executor);
+		free_job(job);
+		return;
+	}
+
+	log_message(executor, LOGGER_INFO, "Action event triggered.  PID=%d, Action='%s'", pid, job->template->exec);
+
+	job->pid = pid;
+	job->started = now_us();
+	count(executor, executor->m_spawned);
+	if (executor->metrics) {
+		metrics_record(executor->metrics, executor->m_latency, job->started - job->submitted);
+	}
+	if (executor->helper < 0) {
+		hashmap_set(executor->children, &job->pid, sizeof(job->pid), job);
+	}
+
+	if (job->group->timeout > 0) {
+		job->timer = timer_add(executor->timers, timers_now() + job->group->timeout, job_timeout, job);
+	}
+}
+
+
+// The action for a job has exited.
+static void job_finished(executor_t *executor, job_t *job)
+{
+	assert(executor);
+	assert(job);
+
+	if (job->killed) {
+		count(executor, executor->m_timedout);
+	}
+	if (executor->metrics && job->started > 0) {
+		metrics_record(executor->metrics, executor->m_runtime, (now_us() - job->started) / 1000);
+	}
+
+	if (job->timer) {
+		timer_cancel(executor->timers, job->timer);
+		job->timer = NULL;
+	}
+
+	executor->running --;
+	job->group->running --;
+	assert(executor->running >= 0);
+	assert(job->group->running >= 0);
+	update_gauges(executor);
+	free_job(job);
+}
+
+
+// start a job that the limits have allowed to run.  Returns 0 if it could not be handed to the helper (because the socket is full), in which case the job has not been touched.
+static int start_job(executor_t *executor, job_t *job)
+{
+	assert(executor);
+	assert(job);
+	assert(job->group);
+
+	if (executor->dryrun) {
+		log_message(executor, LOGGER_INFO, "Action (dry run).  Action='%s', Path='%s', File='%s', Event='%s'%s%s", job->template->exec, job->path, job->name ? job->name : "", job->action, 
+			job->hash ? ", Hash=" : "", job->hash ? job->hash : "");
+		count(executor, executor->m_spawned);
+		free_job(job);
+		return(1);
+	}
+
+	if (executor->helper >= 0) {
+		// send it to the helper.  The socket is not allowed to block, as this is running in the event loop.
+		executor->nextid ++;
+		const char *strings[] = { job->path, job->name ? job->name : job->path, job->action, job->hash };
+		char buf[HELPER_MSG_MAX];
+		int len = helper_pack(buf, HELPER_SPAWN, executor->nextid, job->template->id, strings, job->hash ? 4 : 3);
+		if (len < 0) {
+			log_message(executor, LOGGER_ERROR, "Unable to run action '%s', the path is too long", job->template->exec);
+			count(executor, executor->m_failed);
+			free_job(job);
+			return(1);
+		}
+		if (helper_send(executor->helper, buf, len, job->input) != len) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				executor->blocked = 1;
+				return(0);
+			}
+			log_message(executor, LOGGER_ERROR, "send to spawn helper: %s", strerror(errno));
+			count(executor, executor->m_failed);
+			free_job(job);
+			return(1);
+		}
+
+		// the helper has its own copy of the input now.
+		if (job->input >= 0) {
+			close(job->input);
+			job->input = -1;
+		}
+
+		job->id = executor->nextid;
+		hashmap_set(executor->helperjobs, &job->id, sizeof(job->id), job);
+		executor->running ++;
+		job->group->running ++;
+		update_gauges(executor);
+		return(1);
+	}
+
+	executor->running ++;
+	job->group->running ++;
+	update_gauges(executor);
+	pid_t pid = spawn_action(executor, job->template, job->path, job->name, job->action, job->hash, job->input);
+
+	// the action has its own copy of the input now.
+	if (job->input >= 0) {
+		close(job->input);
+		job->input = -1;
+	}
+	job_started(executor, job, pid);
+	return(1);
+}
+
+
+static int group_can_run(group_t *group)
+{
+	assert(group);
+	return(group->max == 0 || group->running < group->max);
+}
+
+
+// whether the limit on the number of actions running (as reduced by the throttle) allows another one.
+static int executor_can_run(executor_t *executor)
+{
+	assert(executor);
+	int max = executor->max;
+	if (max > 0 && executor->throttle < 100) {
+		max = (max * executor->throttle) / 100;
+		if (max < 1) { max = 1; }
+	}
+	return(max == 0 || executor->running < max);
+}
+
+
+// whether the rates allow an action for the group to be started now.
+static int rate_allows(executor_t *executor, group_t *group, long long now)
+{
+	assert(executor);
+	assert(group);
+	return(bucket_ready(&executor->bucket, executor->throttle, now) && bucket_ready(&group->bucket, 100, now));
+}
+
+
+// start a job that the limits have allowed to run, taking the tokens for it.  Returns 0 (with the tokens given back) if it could not be started.
+static int start_limited_job(executor_t *executor, job_t *job)
+{
+	assert(executor);
+	assert(job);
+	
+	// the job (and its group) can be freed once it is started.
+	group_t *group = job->group;
+	bucket_take(&executor->bucket);
+	bucket_take(&group->bucket);
+	if (start_job(executor, job)) {
+		return(1);
+	}
+	bucket_return(&executor->bucket);
+	bucket_return(&group->bucket);
+	return(0);
+}
+
+
+// take a job out of the queue.  It must be at the head of its group's queue (which it will be, as they are taken in order).
+static void unqueue_job(executor_t *executor, job_t *job)
+{
+	assert(executor);
+	assert(job);
+	group_t *group = job->group;
+	assert(group->head == job);
+
+	group->head = job->groupnext;
+	if (group->head == NULL) { group->tail = NULL; }
+	group->waiting --;
+	job->groupnext = NULL;
+
+	if (job->prev) { job->prev->next = job->next; }
+	else { executor->oldest = job->next; }
+	if (job->next) { job->next->prev = job->prev; }
+	else { executor->newest = job->prev; }
+	job->prev = job->next = NULL;
+
+	executor->queued --;
+	assert(executor->queued >= 0);
+}
+
+
+// put a job back at the front of the queue (and its group's queue), because it could not be started after all.
+static void requeue_job(executor_t *executor, job_t *job)
+{
+	assert(executor);
+	assert(job);
+	group_t *group = job->group;
+	assert(group);
+
+	job->groupnext = group->head;
+	group->head = job;
+	if (group->tail == NULL) { group->tail = job; }
+	group->waiting ++;
+
+	job->prev = NULL;
+	job->next = executor->oldest;
+	if (executor->oldest) { executor->oldest->prev = job; }
+	else { executor->newest = job; }
+	executor->oldest = job;
+
+	executor->queued ++;
+}
+
+
+// add a group to the end of the list of groups that have jobs waiting.
+static void ready_group(executor_t *executor, group_t *group)
+{
+	assert(executor);
+	assert(group);
+	assert(group->ready == 0);
+
+	group->ready = 1;
+	group->readynext = NULL;
+	if (executor->readytail) { executor->readytail->readynext = group; }
+	else { executor->readyhead = group; }
+	executor->readytail = group;
+	executor->readycount ++;
+}
+
+
+// start as many of the queued jobs as the limits allow.
+static void arm_rate_timer(executor_t *executor);
+
+static void run_queue(executor_t *executor)
+{
+	assert(executor);
+
+	// go through the groups that have jobs waiting, in turn, starting one job from each, until either we run out of room, 
+	// or we have been through all of them without any being able to start anything.
+	long long now = now_us();
+	int progress = 1;
+	while (progress && executor->readyhead && executor_can_run(executor) && bucket_ready(&executor->bucket, executor->throttle, now)) {
+		progress = 0;
+		int count = executor->readycount;
+		while (count > 0 && executor->readyhead && executor_can_run(executor) && bucket_ready(&executor->bucket, executor->throttle, now)) {
+			count --;
+			
+			// take the group off the front of the list.
+			group_t *group = executor->readyhead;
+			executor->readyhead = group->readynext;
+			if (executor->readyhead == NULL) { executor->readytail = NULL; }
+			group->readynext = NULL;
+			group->ready = 0;
+			executor->readycount --;
+
+			if (group->head && group_can_run(group) && executor->blocked == 0 && bucket_ready(&group->bucket, 100, now)) {
+				job_t *job = group->head;
+				unqueue_job(executor, job);
+				if (start_limited_job(executor, job)) {
+					progress = 1;
+				}
+				else {
+					// the helper cannot take any more at the moment, so it goes back where it was.
+					requeue_job(executor, job);
+				}
+			}
+
+			// if the group still has jobs waiting, it goes to the back of the list.
+			if (group->head) {
+				ready_group(executor, group);
+			}
+		}
+	}
+	
+	arm_rate_timer(executor);
+}
+
+
+static void rate_timer_cb(void *arg)
+{
+	executor_t *executor = arg;
+	assert(executor);
+	executor->ratetimer = NULL;
+	run_queue(executor);
+}
+
+
+// When jobs are waiting only because of a rate, nothing else will happen to start them (unlike those waiting for another to finish), 
+// so the queue is looked at again when the first of them could start.
+static void arm_rate_timer(executor_t *executor)
+{
+	assert(executor);
+	if (executor->ratetimer || executor->readyhead == NULL || executor_can_run(executor) == 0 || executor->blocked) {
+		return;
+	}
+
+	long wait = -1;
+	if (executor->bucket.rate > 0 && executor->bucket.tokens < 1.0) {
+		wait = bucket_wait(&executor->bucket, executor->throttle);
+	}
+	else {
+		group_t *group;
+		for (group = executor->readyhead; group; group = group->readynext) {
+			if (group->head && group_can_run(group) && group->bucket.rate > 0 && group->bucket.tokens < 1.0) {
+				long w = bucket_wait(&group->bucket, 100);
+				if (wait < 0 || w < wait) { wait = w; }
+			}
+		}
+	}
+	if (wait >= 0) {
+		executor->ratetimer = timer_add(executor->timers, timers_now() + wait, rate_timer_cb, executor);
+		assert(executor->ratetimer);
+	}
+}
+
+
+extern void executor_rate(EXECUTOR executorptr, long rate, int burst)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	bucket_set(&executor->bucket, rate, burst);
+}
+
+
+extern void executor_throttle(EXECUTOR executorptr, int percent)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	if (percent < 1) { percent = 1; }
+	if (percent > 100) { percent = 100; }
+	if (percent == executor->throttle) {
+		return;
+	}
+
+	// the tokens so far were earned at the old rate.
+	bucket_ready(&executor->bucket, executor->throttle, now_us());
+	int faster = (percent > executor->throttle);
+	executor->throttle = percent;
+	if (executor->metrics) {
+		metrics_set(executor->metrics, executor->m_throttle, percent);
+	}
+
+	if (executor->ratetimer) {
+		timer_cancel(executor->timers, executor->ratetimer);
+		executor->ratetimer = NULL;
+	}
+	if (faster) {
+		run_queue(executor);
+	}
+	else {
+		arm_rate_timer(executor);
+	}
+}
+
+
+extern void executor_submit(EXECUTOR executorptr, EXECGROUP groupptr, EXECTEMPLATE templateptr, const char *path, const char *name, const char *action, const char *hash, int input)
+{
+	executor_t *executor = executorptr;
+	group_t *group = groupptr;
+	template_t *template = templateptr;
+	assert(executor);
+	assert(group);
+	assert(template);
+	assert(path);
+	assert(action);
+
+	job_t *job = calloc(1, sizeof(job_t));
+	assert(job);
+	job->executor = executor;
+	job->group = group;
+	job->template = template;
+	group->refs ++;
+	template->refs ++;
+	job->action = action;
+	job->input = input;
+	job->submitted = executor->metrics ? now_us() : 0;
+	job->path = strdup(path);
+	assert(job->path);
+	if (name) {
+		job->name = strdup(name);
+		assert(job->name);
+	}
+	if (hash) {
+		job->hash = strdup(hash);
+		assert(job->hash);
+	}
+
+	long long now = now_us();
+	int room = (group->waiting == 0 && group_can_run(group) && executor->blocked == 0);
+	if (room && executor_can_run(executor) && rate_allows(executor, group, now)) {
+		// nothing is in the way, so it can run straight away.
+		if (start_limited_job(executor, job)) {
+			return;
+		}
+	}
+	else if (rate_allows(executor, group, now) == 0 || (executor_can_run(executor) == 0 && (executor->max == 0 || executor->running < executor->max))) {
+		// it is held back by a rate, or because the system is busy (rather than only waiting for other actions to finish).
+		count(executor, executor->m_deferred);
+	}
+
+	if (executor->queued >= executor->maxqueue) {
+		if (executor->policy == EXEC_DROP_OLD && executor->oldest) {
+			job_t *oldest = executor->oldest;
+			log_dropped(executor, oldest->template->exec, oldest->path);
+			unqueue_job(executor, oldest);
+			free_job(oldest);
+			count(executor, executor->m_dropped);
+		}
+		else {
+			log_dropped(executor, template->exec, path);
+			free_job(job);
+			count(executor, executor->m_dropped);
+			return;
+		}
+	}
+
+	// add it to the end of the queue, and the queue for its group.
+	job->prev = executor->newest;
+	if (executor->newest) { executor->newest->next = job; }
+	else { executor->oldest = job; }
+	executor->newest = job;
+
+	if (group->tail) { group->tail->groupnext = job; }
+	else { group->head = job; }
+	group->tail = job;
+	group->waiting ++;
+	executor->queued ++;
+
+	if (group->ready == 0) {
+		ready_group(executor, group);
+	}
+	update_gauges(executor);
+	arm_rate_timer(executor);
+}
+
+
+// The main loop of the spawn helper process.  It never returns.
+static void helper_main(executor_t *executor, int sock)
+{
+	assert(executor);
+	assert(sock >= 0);
+
+	// the templates are sent to us with their ids, and are kept in the same positions as the daemon has them.
+	template_t **templates = NULL;
+	int templatecount = 0;
+
+	// the running actions, keyed on pid, with the job id as the value.
+	HASHMAP children = hashmap_new();
+	assert(children);
+
+	struct pollfd fds[2];
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = executor->sigfd;
+	fds[1].events = POLLIN;
+
+	char buf[HELPER_MSG_MAX];
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) { continue; }
+			perror("spawn helper poll");
+			_exit(EXIT_FAILURE);
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			int input = -1;
+			ssize_t len = helper_recv(sock, buf, sizeof(buf), &input);
+			if (len <= 0) {
+				// the daemon has gone away, so there is nothing more for us to do.
+				_exit(EXIT_SUCCESS);
+			}
+			if (len >= (ssize_t) sizeof(helper_msg_t)) {
+				helper_msg_t *msg = (helper_msg_t *) buf;
+				char *strings[HELPER_MAX_STRINGS + 1];
+
+				if (msg->type == HELPER_TEMPLATE) {
+					uint32_t count = helper_unpack(buf, len, strings, HELPER_MAX_STRINGS);
+					if (count >= 1) {
+						strings[count] = NULL;
+						template_t *template = new_template(strings[0], (const char * const *) &strings[1]);
+						template->id = msg->id;
+						if ((int) msg->id >= templatecount) {
+							templates = realloc(templates, sizeof(template_t *) * (msg->id + 1));
+							assert(templates);
+							while (templatecount <= (int) msg->id) { templates[templatecount++] = NULL; }
+						}
+						// ids are used again once the daemon has freed them (which it will have told us about first).
+						if (templates[msg->id]) { free_template(templates[msg->id]); }
+						templates[msg->id] = template;
+					}
+				}
+				else if (msg->type == HELPER_FORGET) {
+					if ((int) msg->id < templatecount && templates[msg->id]) {
+						free_template(templates[msg->id]);
+						templates[msg->id] = NULL;
+					}
+				}
+				else if (msg->type == HELPER_SPAWN) {
+					pid_t pid = -1;
+					uint32_t count = helper_unpack(buf, len, strings, 4);
+					if (count >= 3 && msg->value >= 0 && msg->value < templatecount && templates[msg->value]) {
+						pid = spawn_action(executor, templates[msg->value], strings[0], strings[1], strings[2], count > 3 ? strings[3] : NULL, input);
+					}
+					if (pid > 0) {
+						uint32_t *id = malloc(sizeof(uint32_t));
+						assert(id);
+						*id = msg->id;
+						hashmap_set(children, &pid, sizeof(pid), id);
+					}
+					int rlen = helper_pack(buf, HELPER_STARTED, msg->id, pid, NULL, 0);
+					send(sock, buf, rlen, 0);
+				}
+			}
+			
+			if (input >= 0) {
+				close(input);
+			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			struct signalfd_siginfo info;
+			while (read(executor->sigfd, &info, sizeof(info)) == sizeof(info)) {
+			}
+
+			int status;
+			pid_t pid;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				uint32_t *id = hashmap_remove(children, &pid, sizeof(pid));
+				if (id) {
+					int rlen = helper_pack(buf, HELPER_EXITED, *id, status, NULL, 0);
+					send(sock, buf, rlen, 0);
+					free(id);
+				}
+			}
+		}
+	}
+}
+
+
+// Start the spawn helper.  This should be done as early as possible, because the helper starts as a copy of the daemon.
+extern int executor_helper(EXECUTOR executorptr)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	assert(executor->helper < 0);
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+		log_message(executor, LOGGER_ERROR, "socketpair: %s", strerror(errno));
+		return(-1);
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		log_message(executor, LOGGER_ERROR, "fork: %s", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return(-1);
+	}
+	else if (pid == 0) {
+		// the thread that writes out the log is not in this process.
+		executor->logger = NULL;
+		close(sv[0]);
+		helper_main(executor, sv[1]);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(sv[1]);
+	executor->helper = sv[0];
+	executor->helperpid = pid;
+
+	// if any actions were prepared before the helper was started, it needs to know about them.
+	int i;
+	for (i=0; i < executor->templatecount; i++) {
+		if (executor->templates[i]) {
+			helper_template(executor, executor->templates[i]);
+		}
+	}
+
+	return(0);
+}
+
+
+extern int executor_helper_fd(EXECUTOR executorptr)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+	return(executor->helper);
+}
+
+
+static void helper_lost_job(void *value, void *arg)
+{
+	job_t *job = value;
+	executor_t *executor = arg;
+	assert(job);
+	assert(executor);
+	job_finished(executor, job);
+}
+
+
+// The helper has gone away.  The actions it was looking after cannot be tracked any more, so they are treated as finished, and from now on, actions are spawned directly.
+static void helper_lost(executor_t *executor)
+{
+	assert(executor);
+	log_message(executor, LOGGER_WARNING, "The spawn helper has exited, actions will be started by the daemon from now on.");
+
+	close(executor->helper);
+	executor->helper = -1;
+	executor->helperpid = 0;
+	executor->blocked = 0;
+
+	hashmap_foreach(executor->helperjobs, helper_lost_job, executor);
+	hashmap_free(executor->helperjobs);
+	executor->helperjobs = hashmap_new();
+	assert(executor->helperjobs);
+
+	run_queue(executor);
+}
+
+
+// The helper has sent us messages about the actions it has started or that have exited.
+extern void executor_helper_read(EXECUTOR executorptr)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+
+	if (executor->helper < 0) {
+		return;
+	}
+
+	char buf[HELPER_MSG_MAX];
+	for (;;) {
+		ssize_t len = recv(executor->helper, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (len <= 0) {
+			helper_lost(executor);
+			return;
+		}
+		if (len < (ssize_t) sizeof(helper_msg_t)) {
+			continue;
+		}
+
+		helper_msg_t *msg = (helper_msg_t *) buf;
+		if (msg->type == HELPER_STARTED) {
+			job_t *job = hashmap_get(executor->helperjobs, &msg->id, sizeof(msg->id));
+			if (job) {
+				if (msg->value <= 0) {
+					hashmap_remove(executor->helperjobs, &msg->id, sizeof(msg->id));
+				}
+				job_started(executor, job, msg->value);
+			}
+		}
+		else if (msg->type == HELPER_EXITED) {
+			job_t *job = hashmap_remove(executor->helperjobs, &msg->id, sizeof(msg->id));
+			if (job) {
+				job_finished(executor, job);
+			}
+		}
+	}
+
+	// the helper has made progress, so it should have room for more.
+	executor->blocked = 0;
+	run_queue(executor);
+}
+
+
+// Child processes have exited.  Reap them all, and start any queued jobs that now have room to run.
+extern void executor_reap(EXECUTOR executorptr)
+{
+	executor_t *executor = executorptr;
+	assert(executor);
+
+	// the signals are combined, so there is no point looking at what they say.  We just need to empty the signalfd.
+	struct signalfd_siginfo info;
+	while (read(executor->sigfd, &info, sizeof(info)) == sizeof(info)) {
+	}
+
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		job_t *job = hashmap_remove(executor->children, &pid, sizeof(pid));
+		if (job) {
+			job_finished(executor, job);
+		}
+		else if (executor->helper >= 0 && pid == executor->helperpid) {
+			helper_lost(executor);
+		}
+	}
+
+	run_queue(executor);
+}
+
+
+// fin - executor.c
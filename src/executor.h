@@ -0,0 +1,94 @@
+// executor.h
+
+/*
+ * Part of the FileKnock Daemon
+ * by Clinton Webb (webb.clint@gmail.com)
+ *
+ * The executor runs the actions for the daemon.  It limits how many actions can be running at the same time, and how often they start
+ * (both in total, and for each group of actions), queues the actions that cannot be started yet, reaps the
+ * child processes when they exit, and kills any that run for too long.
+*/
+
+#ifndef __EXECUTOR_H
+#define __EXECUTOR_H
+
+#include "logger.h"
+#include "metrics.h"
+#include "timers.h"
+
+typedef void * EXECUTOR;
+typedef void * EXECGROUP;
+typedef void * EXECTEMPLATE;
+
+// What to do when an action needs to be queued, but the queue is full.
+#define EXEC_DROP_NEW	0		// the new action is discarded.
+#define EXEC_DROP_OLD	1		// the oldest action in the queue is discarded to make room.
+
+// 'max' is the number of actions that can be running at the same time (0 for no limit).
+// 'maxqueue' is the number of actions that can be waiting to be started.
+// 'timeout' is the number of milliseconds an action can run before it is killed (0 for no limit).
+EXECUTOR executor_new(TIMERS timers, int max, int maxqueue, int policy, long timeout);
+
+// Keep counts of the actions spawned, failed, dropped, deferred (held back by a rate, or because the system is busy) and timed out, 
+// the number active and queued, the throttle, and histograms of the time from being submitted until the action has started, and how 
+// long the actions run for.
+void executor_metrics(EXECUTOR executor, METRICS metrics);
+
+// Write the messages about the actions to the logger, rather than to stdout and stderr.
+void executor_logger(EXECUTOR executor, LOGGER logger);
+
+// Do not actually run the actions.  They still go through the queue and the limits, and are counted as spawned, but are only printed.
+void executor_dryrun(EXECUTOR executor);
+
+// returns non-zero if there are no actions running or waiting to run.
+int executor_idle(EXECUTOR executor);
+
+// Limit how often actions are started, to 'rate' a second (0 for no limit).  Up to 'burst' can be started at once after a quiet 
+// spell (if 0, a second's worth).  The actions that are held back wait in the queue.
+void executor_rate(EXECUTOR executor, long rate, int burst);
+
+// Slow down the starting of actions while the system is busy.  Only 'percent' (1 to 100) of the limits on the number running 
+// and the rate apply, until it is set back to 100.
+void executor_throttle(EXECUTOR executor, int percent);
+
+// Parse the name of an overflow policy.  Returns -1 if it is not a known policy.
+int executor_policy(const char *name);
+
+// Create a group of actions, that has its own limit on the number running at once (0 for no limit).
+// If 'timeout' is 0, the timeout for the executor is used.
+EXECGROUP executor_group(EXECUTOR executor, int max, long timeout);
+
+// Limit how often the actions in a group are started, the same as executor_rate().
+void executor_group_rate(EXECUTOR executor, EXECGROUP group, long rate, int burst);
+
+// The owner of a group has finished with it.  Any actions in the group that are queued or running carry on, and it is freed when they have finished.
+void executor_group_release(EXECUTOR executor, EXECGROUP group);
+
+// Prepare an action to be run.  The argv and the static part of the environment are built once here, so that starting the action 
+// only needs to fill in the details of the event (FK_PATH, FK_FILE and FK_ACTION).
+// 'env' is a NULL terminated list of "NAME=value" strings that are given to every run of the action (can be NULL).
+EXECTEMPLATE executor_template(EXECUTOR executor, const char *exec, const char * const *env);
+
+// The owner of a template has finished with it.  As with groups, it is freed once the actions using it have finished.
+void executor_template_release(EXECUTOR executor, EXECTEMPLATE template);
+
+// Submit an action to be run.  It will be started straight away if the limits allow, otherwise it is queued.
+// 'action' is the name of the event, and must be a string that will be around for as long as the executor (ie, a constant).
+// 'hash' is the hash of the contents of the file, which is given to the action as FK_HASH (NULL if it isn't known).
+// 'input' is a file descriptor that will be given to the action as its stdin (or -1 for none).  The executor takes ownership of it, and closes it.
+void executor_submit(EXECUTOR executor, EXECGROUP group, EXECTEMPLATE template, const char *path, const char *name, const char *action, const char *hash, int input);
+
+// The file descriptor that becomes readable when child processes have exited.  When it does, executor_reap() should be called.
+int executor_fd(EXECUTOR executor);
+void executor_reap(EXECUTOR executor);
+
+// Start a helper process that will do all the spawning of actions.  It starts as a copy of the daemon, so it should be started
+// before the daemon has grown (ie, before the config is loaded).  Returns 0 if the helper was started.
+int executor_helper(EXECUTOR executor);
+
+// The socket to the helper (or -1 if there is no helper).  When it is readable, executor_helper_read() should be called.
+int executor_helper_fd(EXECUTOR executor);
+void executor_helper_read(EXECUTOR executor);
+
+
+#endif
@@ -0,0 +1,294 @@
+// fanwatch.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Watching whole filesystems with fanotify(7).   No application specific code should be here.
+ * See fanwatch.h for details.
+*/
+
+
+#define _GNU_SOURCE		// for open_by_handle_at()
+
+#include "fanwatch.h"
+#include "hashmap.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+
+// the most filesystems that can be marked.
+#define MAX_FILESYSTEMS		32
+
+// the paths of this many directories are remembered, after that they are all forgotten and looked up again as they are needed.
+#define MAX_CACHED_DIRS		65536
+
+#define DELETED_SUFFIX		" (deleted)"
+
+
+typedef struct {
+	fsid_t fsid;
+	int fd;				// anything on the filesystem, for open_by_handle_at() (which does not accept O_PATH).
+	int whole;			// the whole filesystem is marked (rather than only the mount).
+} filesystem_t;
+
+
+typedef struct {
+	int fd;
+	uint32_t mask;		// all the events that have been asked for.
+	filesystem_t fs[MAX_FILESYSTEMS];
+	int fscount;
+	HASHMAP dirs;		// the path of each directory that has had an event, keyed on the fsid and handle.
+	char buffer[65536] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+} fanwatch_t;
+
+
+
+extern FANWATCH fanwatch_new(void)
+{
+	int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_QUEUE | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+	if (fd == -1) {
+		return(NULL);
+	}
+
+	fanwatch_t *fw = calloc(1, sizeof(fanwatch_t));
+	assert(fw);
+	fw->fd = fd;
+	fw->dirs = hashmap_new();
+	assert(fw->dirs);
+	return((FANWATCH) fw);
+}
+
+
+static void free_dir(void *value, void *arg)
+{
+	free(value);
+}
+
+
+static void clear_dirs(fanwatch_t *fw)
+{
+	assert(fw);
+	assert(fw->dirs);
+	hashmap_foreach(fw->dirs, free_dir, NULL);
+	hashmap_free(fw->dirs);
+	fw->dirs = hashmap_new();
+	assert(fw->dirs);
+}
+
+
+extern void fanwatch_free(FANWATCH fwptr)
+{
+	fanwatch_t *fw = fwptr;
+	assert(fw);
+
+	while (fw->fscount > 0) {
+		fw->fscount --;
+		close(fw->fs[fw->fscount].fd);
+	}
+	hashmap_foreach(fw->dirs, free_dir, NULL);
+	hashmap_free(fw->dirs);
+	close(fw->fd);
+	free(fw);
+}
+
+
+extern int fanwatch_fd(FANWATCH fwptr)
+{
+	fanwatch_t *fw = fwptr;
+	assert(fw);
+	return(fw->fd);
+}
+
+
+static filesystem_t * find_filesystem(fanwatch_t *fw, const void *fsid)
+{
+	assert(fw);
+	assert(fsid);
+	int i;
+	for (i=0; i < fw->fscount; i++) {
+		if (memcmp(&fw->fs[i].fsid, fsid, sizeof(fsid_t)) == 0) {
+			return(&fw->fs[i]);
+		}
+	}
+	return(NULL);
+}
+
+
+extern int fanwatch_add(FANWATCH fwptr, const char *path, uint32_t mask)
+{
+	fanwatch_t *fw = fwptr;
+	assert(fw);
+	assert(path);
+	assert(mask != 0);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return(-1);
+	}
+	struct statfs sfs;
+	if (fstatfs(fd, &sfs) != 0) {
+		close(fd);
+		return(-1);
+	}
+
+	filesystem_t *fs = find_filesystem(fw, &sfs.f_fsid);
+	if (fs == NULL && fw->fscount >= MAX_FILESYSTEMS) {
+		close(fd);
+		errno = ENOSPC;
+		return(-1);
+	}
+
+	// directories being moved are watched as well, so that the paths that have been remembered for them can be forgotten.
+	// That can only be done for a whole filesystem.
+	int whole = 1;
+	if (fanotify_mark(fw->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask | FAN_MOVED_FROM | FAN_ONDIR, AT_FDCWD, path) != 0) {
+		if (fs && fs->whole) {
+			close(fd);
+			return(-1);
+		}
+		whole = 0;
+		if (fanotify_mark(fw->fd, FAN_MARK_ADD | FAN_MARK_MOUNT, mask, AT_FDCWD, path) != 0) {
+			close(fd);
+			return(-1);
+		}
+	}
+
+	fw->mask |= mask;
+	if (fs) {
+		close(fd);
+	}
+	else {
+		fs = &fw->fs[fw->fscount ++];
+		memcpy(&fs->fsid, &sfs.f_fsid, sizeof(fsid_t));
+		fs->fd = fd;
+		fs->whole = whole;
+	}
+	return(0);
+}
+
+
+// return the path of the directory for a handle, looking it up if it isn't already known.  Returns NULL if it no longer exists.
+static const char * dir_path(fanwatch_t *fw, struct fanotify_event_info_fid *fid)
+{
+	assert(fw);
+	assert(fid);
+
+	struct file_handle *handle = (struct file_handle *) fid->handle;
+	size_t keylen = sizeof(fid->fsid) + sizeof(handle->handle_type) + handle->handle_bytes;
+	char key[keylen];
+	memcpy(key, &fid->fsid, sizeof(fid->fsid));
+	memcpy(key + sizeof(fid->fsid), &handle->handle_type, sizeof(handle->handle_type));
+	memcpy(key + sizeof(fid->fsid) + sizeof(handle->handle_type), handle->f_handle, handle->handle_bytes);
+
+	char *path = hashmap_get(fw->dirs, key, keylen);
+	if (path) {
+		return(path);
+	}
+
+	filesystem_t *fs = find_filesystem(fw, &fid->fsid);
+	if (fs == NULL) {
+		return(NULL);
+	}
+
+	int fd = open_by_handle_at(fs->fd, handle, O_PATH | O_CLOEXEC);
+	if (fd == -1) {
+		return(NULL);
+	}
+	char link[64];
+	char buf[PATH_MAX];
+	sprintf(link, "/proc/self/fd/%d", fd);
+	ssize_t len = readlink(link, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) {
+		return(NULL);
+	}
+	buf[len] = 0;
+
+	size_t suffixlen = strlen(DELETED_SUFFIX);
+	if ((size_t) len > suffixlen && strcmp(buf + len - suffixlen, DELETED_SUFFIX) == 0) {
+		return(NULL);
+	}
+
+	if (hashmap_count(fw->dirs) >= MAX_CACHED_DIRS) {
+		clear_dirs(fw);
+	}
+	path = strdup(buf);
+	assert(path);
+	hashmap_set(fw->dirs, key, keylen, path);
+	return(path);
+}
+
+
+extern int fanwatch_read(FANWATCH fwptr, fanwatch_cb cb, void *arg)
+{
+	fanwatch_t *fw = fwptr;
+	assert(fw);
+	assert(cb);
+
+	int events = 0;
+	for (;;) {
+		ssize_t len = read(fw->fd, fw->buffer, sizeof(fw->buffer));
+		if (len == -1) {
+			if (errno == EAGAIN) {
+				break;
+			}
+			return(-1);
+		}
+
+		struct fanotify_event_metadata *meta;
+		for (meta = (struct fanotify_event_metadata *) fw->buffer; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+			assert(meta->vers == FANOTIFY_METADATA_VERSION);
+			events ++;
+
+			if (meta->mask & FAN_Q_OVERFLOW) {
+				cb(NULL, NULL, FAN_Q_OVERFLOW, arg);
+				continue;
+			}
+
+			if (meta->mask & FAN_ONDIR) {
+				// a directory has moved, so any of the paths we know could now be wrong.
+				if (meta->mask & FAN_MOVED_FROM) {
+					clear_dirs(fw);
+				}
+				continue;
+			}
+
+			uint32_t mask = meta->mask & fw->mask;
+			if (mask == 0) {
+				continue;
+			}
+
+			struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *) (meta + 1);
+			if ((char *) fid + sizeof(*fid) > (char *) meta + meta->event_len || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+				continue;
+			}
+
+			const char *dir = dir_path(fw, fid);
+			if (dir == NULL) {
+				continue;
+			}
+
+			struct file_handle *handle = (struct file_handle *) fid->handle;
+			const char *name = (const char *) handle->f_handle + handle->handle_bytes;
+			if (strcmp(name, ".") == 0) {
+				name = NULL;
+			}
+
+			cb(dir, name, mask, arg);
+		}
+	}
+	return(events);
+}
+
+
+// fin - fanwatch.c
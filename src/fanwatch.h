@@ -0,0 +1,44 @@
+// fanwatch.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Watching whole filesystems with fanotify(7).   No application specific code should be here.
+ * Rather than a watch for each directory (as inotify needs), a single mark covers everything on a filesystem, so there
+ * is no limit on the size of the trees.  The events are for the whole filesystem though, so it is up to the caller to
+ * ignore the ones it is not interested in.
+ *
+ * Each event identifies the directory by a file handle, which is turned into a path (and cached), so the process needs
+ * CAP_SYS_ADMIN (for fanotify itself) and CAP_DAC_READ_SEARCH (to open the handles).
+*/
+
+#ifndef __FANWATCH_H
+#define __FANWATCH_H
+
+#include <stdint.h>
+
+typedef void * FANWATCH;
+
+// called for each event.  'dir' is the directory the file is in, and 'name' is the file (NULL if the event is for the directory itself).
+// The mask uses the FAN_* values, the ones for closing files have the same values as IN_CLOSE_WRITE and IN_CLOSE_NOWRITE.
+// If events have been lost, it is called with a NULL 'dir' and a mask of FAN_Q_OVERFLOW.
+typedef void (*fanwatch_cb)(const char *dir, const char *name, uint32_t mask, void *arg);
+
+// returns NULL (with errno set) if fanotify is not available, or we do not have the privileges for it.
+FANWATCH fanwatch_new(void);
+void fanwatch_free(FANWATCH fw);
+
+// the file-descriptor that becomes readable when there are events.
+int fanwatch_fd(FANWATCH fw);
+
+// get the events in 'mask' for the filesystem that 'path' is on.  If the filesystem cannot be marked, the mount is marked instead
+// (which only covers what is visible through that mount, and does not tell us about directories being moved).
+// Adding the same filesystem again only adds to the events.  Returns 0 on success, or -1 with errno set.
+int fanwatch_add(FANWATCH fw, const char *path, uint32_t mask);
+
+// read all the events that are waiting, calling 'cb' for each one.  Returns the number of events, or -1 with errno set.
+int fanwatch_read(FANWATCH fw, fanwatch_cb cb, void *arg);
+
+
+#endif
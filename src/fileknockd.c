@@ -15,468 +15,3693 @@
 */
 
 
+#define _GNU_SOURCE		// for memfd_create()
+
 #include <assert.h>
 #include <dirent.h> 
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
-#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "condition.h"
 #include "configfile.h"
+#include "eventlog.h"
+#include "eventsink.h"
+#include "executor.h"
+#include "fanwatch.h"
+#include "fileop.h"
+#include "fingerprint.h"
+#include "filter.h"
+#include "hashmap.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pathtrie.h"
+#include "pressure.h"
+#include "timers.h"
+#include "treewalk.h"
+#include "uring.h"
+#include "workers.h"
+#include "wdindex.h"
+
+typedef struct batch_t batch_t;
+struct watch_t;
+
+
+// A sink is shared by all the rules that publish to it, and stays open (with its subscribers still connected) while the config files are reloaded.
+typedef struct {
+	EVENTSINK sink;
+	int refs;
+} sink_t;
 
+// A rule is what is described by a config file (ie, the path being monitored, and the actions to perform).
+// A single rule can result in many watches, for example when a whole tree is being monitored.
 typedef struct {
-	int wd;
 	const char *path;
 	const char *file;
+	int recursive;		// all the directories below 'path' are also watched.
+	uint32_t mask;		// the inotify events that the actions of this rule need.
 	const char *closedExec;
 	const char *closedWriteExec;
+	long debounce;		// milliseconds that a file must be quiet before the actions are performed.   0 to perform them straight away.
+	long debouncemax;	// the longest that the actions for a file can be held back, even if it is never quiet.
+	EXECGROUP group;	// the actions for the rule are limited together by the executor.
+	EXECTEMPLATE closedTemplate;		// the prepared argv and environment for each of the actions.
+	EXECTEMPLATE closedWriteTemplate;
+	FILEOP closedOp;	// built-in actions, which are done on the file action threads rather than by starting a process.
+	FILEOP closedWriteOp;
+	sink_t *sink;		// the events are published to the subscribers of this, rather than starting a process for each (NULL if they aren't).
+	const char *batchExec;
+	EXECTEMPLATE batchTemplate;
+	batch_t *batch;		// the events collected for the next run of the batch action.
+	FILTER filter;		// the names of the files that the actions are performed for (NULL for all of them).
+	CONDITION condition;	// what else must be true of a file (eg, its size) for the actions to be performed (NULL if there is nothing).
+	int contentonly;	// the actions are only performed if the contents of the file have changed since they were last performed.
+	uint32_t allclosed;	// the actions are only performed once everything that had the file open has closed it.  These are the closes the actions want.
+	int confirmclosed;	// ... and the file has not been written to since the last close was read.
+	int refs;			// the config file that the rule came from, and anything that is holding on to events for it.
+	struct watch_t *watches;	// all the watches for this rule.
+	int monitored;		// with fanotify, there are no watches, the rule is in the trie instead.
+} rule_t;
+
+
+// The kernel only has one watch for each directory (or file), no matter how many times it is added, and adding it again replaces the 
+// events it was watching for.  So there is one of these for each, which is shared by all the rules watching it, and the kernel is 
+// given the events that all of them need.
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+} kwatchkey_t;
+
+typedef struct {
+	kwatchkey_t key;
+	int wd;
+	uint32_t mask;		// what the kernel has been asked for.
+	int refs;			// the number of watches sharing it.
+} kwatch_t;
+
+
+// A watch is a rule's use of an inotify watch on a directory (or file).
+typedef struct watch_t {
+	int wd;
+	const char *path;	// the directory or file being watched.  For recursive rules this can be any directory in the tree.
+	rule_t *rule;
+	uint32_t mask;		// the events this watch needs from the kernel.
+	kwatch_t *kwatch;	// NULL when replaying, as there is no kernel watch.
+	int index;			// position of this watch in the main list, so that it can be removed without searching for it.
+	struct watch_t *ruleprev, *rulenext;	// the list of watches for the rule.
+	HASHMAP snapshot;	// the files in the directory when it was last rescanned (NULL until it has been).
 } watch_t;
 
 
+// What a rescan found for a file, so that the next rescan can tell whether it has changed since.
+typedef struct {
+	off_t size;
+	long long mtime;	// nanoseconds since the epoch.
+} snapentry_t;
+
+
+// When watching a tree, we also need to know when directories are created, moved or removed, so that the watches can be kept in sync with the tree.
+#define RECURSIVE_MASK	(IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+
+
+
+// The directories that the config files are loaded from.
+#define MAX_CONFIG_DIRS		8
+
+typedef struct {
+	int wd;
+	char *path;
+} configdir_t;
+
+
+// A config file can describe a rule of each kind.
+#define RULE_PATH		0
+#define RULE_TREE		1
+#define RULE_FILE		2
+#define RULE_KINDS		3
+
+typedef struct {
+	char *path;
+	rule_t *rules[RULE_KINDS];
+} configfile_t;
 
 
 typedef struct {
 	
 	int infd;	// INOTIFY API File-descriptor.  This is used to access the INOTIFY API.
 	
+	FANWATCH fanwatch;	// when using fanotify instead of inotify, whole filesystems are watched, rather than each directory.
+	PATHTRIE monitors;	// with fanotify, the rules are found from the path of each event.  File rules are kept under the directory the file is in.
+	
 	watch_t **watches;
 	int watchcount;
+	int watchsize;		// the allocated size of the list.  A recursive rule can add a very large number of watches, so the list grows by doubling.
+	
+	WDINDEX wdindex;	// lookup of the watches subscribed to each watch-descriptor, so that events do not need to scan the whole list.
+	HASHMAP kwatches;	// the kernel watches, keyed on the device and inode of what they are watching.
+	
+	TIMERS timers;
+	int timerfd;		// armed for when the next timer expires, so that the main loop wakes up for it.
+	
+	HASHMAP pending;	// events waiting for the debounce window of a file to pass.
+	
+	WORKERS dispatchers;	// when there are dispatcher threads, the events are filtered and debounced on them, rather than here.
+	HASHMAP *dispatchpending;	// the events waiting for their debounce window on each dispatcher (only used on its thread).
+	int dispatched;		// the events that have been given to the dispatchers, and not handed back yet.
+	
+	WORKERS fileworkers;	// the threads that do the built-in actions.  Started when the first rule that has one is loaded.
+	int fileactions;	// the built-in actions that have been given to them, and not handed back yet.
+	int dryrun;			// the actions are only printed (see --dry-run).
+	
+	HASHMAP sinks;		// the event sinks that are open, keyed on their spec (eg, unix:/run/fileknock.sock).
+	int sinkformat;		// the settings for all of them.
+	int sinkpolicy;
+	long sinkbuffer;
+	
+	FINGERPRINTS *fingerprints;	// what the contents of the files were, for the rules that only act on changes.  One for each dispatcher (or just one for the main thread).
+	
+	HASHMAP openfiles;	// the files that are open, for the rules that wait for them to be closed by everything.  Keyed on a hash of the rule and the path.
+	long maxopenfiles;	// the most files that are kept track of, so that opens that are never closed cannot use up all the memory.
+	long long readtime;	// when the events being processed were read (nanoseconds since the epoch), or 0 if it is not known.
+	
+	EXECUTOR executor;	// runs the actions.
+	
+	CONFIG config;		// the settings for the daemon as a whole (fileknockd.conf).  Can be NULL if there isn't one.
+	
+	int cfgfd;			// a separate inotify instance that watches the config directories, so that changes to them can be applied while running.
+	configdir_t cfgdirs[MAX_CONFIG_DIRS];
+	int cfgdircount;
+	HASHMAP cfgfiles;	// the rules that came from each config file, keyed on the path of the file.
+	
+	LOGGER logger;		// everything is logged through this, so that a slow reader of the output never holds up the events.
+	LOGLIMIT watchlimit;	// for the watches that could not be added.
+	
+	METRICS metrics;
+	int m_events;		// the ids of the metrics updated by the event loop.
+	int m_matched;
+	int m_dropped;
+	int m_overflow;
+	int m_per_read;
+	int m_per_wakeup;
+	int m_rescans;
+	int m_rescan_found;
+	int m_rescan_us;
+	int m_read_buffer;
+	int m_watches;
+	int m_kwatches;
+	int m_fileops;
+	int m_fileops_failed;
+	int m_fileops_dropped;
+	int m_unchanged;
+	int m_unmet;
+	int m_stillopen;
+	int m_openfiles;
+	int m_pressure[2];
+	int m_log_dropped;
+	int m_sink_subscribers;
+	int m_sink_published;
+	int m_sink_dropped;
+	
+	char *readbuf;		// events are read into this.  It grows while reads are filling it, and shrinks again once they aren't.
+	size_t readsize;
+	int smallreads;		// the number of reads in a row that used only a small part of the buffer.
+	
+	long long drained;	// when the inotify queue was last found to be empty (nanoseconds since the epoch).  The events for any change before then have been read.
+	long long rescancutoff;	// when the queue overflows, any file changed after this could have lost its events.
+	TIMER rescantimer;	// set when a rescan is needed because the queue overflowed.
+	long long lastrescan;
+	long rescaninterval;	// the least time (in milliseconds) between rescans, so that a queue that keeps overflowing does not have us rescanning constantly.
+	int rescanthreads;
+	const char *statsfile;	// where the metrics are written to every 'statsinterval' milliseconds (NULL if they aren't).
+	long statsinterval;
+	
+	PRESSURE pressure[2];	// the cpu and io pressure, when the actions are slowed down while the system is busy.
+	int pressurecount;
+	int pressurethreshold;	// the percentage of the time stalled that counts as busy.
+	long pressureinterval;	// how often (in milliseconds) the pressure is looked at.
+	int throttle;		// the percentage of the limits on the actions that apply.
+	int sigfd;			// SIGUSR1, which dumps the metrics.
+	
+	EVENTLOG record;	// everything read from inotify is written to this log (see --record).
+	EVENTLOG replay;	// the events are read from this log instead of inotify (see --replay).
+	int replayfast;		// the log is replayed as fast as possible, rather than at the speed it was recorded.
+	long long replaystart;	// when the replay started (milliseconds, the same clock as the timers).
+	long long replaydue;	// when the next record is due to be processed, or -1 when the replay has finished.
+	int replayheld;		// the next record has been read, but is not due yet.
+	uint32_t heldtype;
+	long long heldtime;
+	const void *helddata;
+	size_t heldlen;
 } maindata_t;
 
 
+// The types of records in a recording.  As well as the raw events, the watches being added and removed are recorded, so that the watch 
+// table can be rebuilt exactly when replaying, without needing the same files (or the same watch-descriptors from the kernel).
+#define REC_EVENTS		1		// the buffer from a read() of the inotify fd.
+#define REC_WATCH		2		// a watch was added, followed by the target of the rule, and the path of the watch.
+#define REC_UNWATCH		3		// a watch was removed, followed by the target of the rule.
+#define REC_TRIGGER		4		// an event that did not come from inotify (eg, for files found in a new directory), followed by the target of the rule, and the name of the file.
+
+typedef struct {
+	int32_t wd;
+	uint32_t mask;
+	int32_t recursive;
+	int32_t reserved;
+} recwatch_t;
+
+
+// The events for a rule with a BatchExec action are collected here, and are given to a single run of the action on its stdin.
+struct batch_t {
+	maindata_t *data;
+	rule_t *rule;
+	int max;			// the number of events that will cause the batch to be run straight away.
+	long latency;		// the longest (in milliseconds) that an event can wait for the batch to be run.
+	char separator;		// what the records (and the fields within them) are terminated with.  '\n' or '\0'.
+	char *buffer;
+	size_t length;
+	size_t size;
+	int count;			// the number of events in the buffer.
+	TIMER timer;		// set when the first event is added to the batch.
+};
+
+
+
+
+// The settings for the daemon as a whole are in a single config file (fileknockd.conf), which is looked for in the same places as the config directories.
+// The first one found is used.
+static CONFIG load_daemon_config(const char **path)
+{
+	assert(path);
+	const char *paths[] = {
+		"/etc/fileknockd.conf",
+		"/opt/fileknock/etc/fileknockd.conf",
+		"/usr/local/etc/fileknockd.conf",
+		"./fileknockd.conf",
+		NULL
+	};
+	
+	int i;
+	for (i=0; paths[i]; i++) {
+		if (access(paths[i], R_OK) == 0) {
+			CONFIG config = config_load(paths[i]);
+			if (config) {
+				*path = paths[i];
+				return(config);
+			}
+		}
+	}
+	return(NULL);
+}
+
+
+// get a setting for the daemon, or the default if it is not set.
+static const char * setting_get(maindata_t *data, const char *key, const char *def)
+{
+	assert(data);
+	assert(key);
+	const char *value = data->config ? config_get(data->config, key) : NULL;
+	return(value ? value : def);
+}
+
+
+static long long setting_long(maindata_t *data, const char *key, long long def)
+{
+	assert(data);
+	assert(key);
+	return((data->config && config_get(data->config, key)) ? config_get_long(data->config, key) : def);
+}
+
+
+
+
+// add a record about a watch to the recording.
+static void record_watch(maindata_t *data, uint32_t type, rule_t *rule, int wd, uint32_t mask, const char *str)
+{
+	assert(data);
+	assert(data->record);
+	assert(rule);
+	
+	const char *target = rule->path ? rule->path : rule->file;
+	size_t targetlen = strlen(target) + 1;
+	size_t strlength = str ? strlen(str) + 1 : 0;
+	
+	char buf[sizeof(recwatch_t) + targetlen + strlength];
+	recwatch_t *rec = (recwatch_t *) buf;
+	memset(rec, 0, sizeof(recwatch_t));
+	rec->wd = wd;
+	rec->mask = mask;
+	rec->recursive = rule->recursive;
+	memcpy(buf + sizeof(recwatch_t), target, targetlen);
+	if (str) {
+		memcpy(buf + sizeof(recwatch_t) + targetlen, str, strlength);
+	}
+	eventlog_write(data->record, type, buf, sizeof(buf), NULL, 0);
+}
 
 
-static watch_t * new_watch(maindata_t *data)
+// create a new watch for a rule, and add it to the list and the index.  The inotify watch must have already been added, and 'wd' is the descriptor for it.
+static watch_t * new_watch(maindata_t *data, rule_t *rule, int wd, const char *path)
 {
 	watch_t *watch = NULL;
 	
+	assert(data);
+	assert(rule);
+	assert(wd >= 0);
+	assert(path);
+	
 	assert((data->watchcount == 0 && data->watches == NULL) || (data->watchcount > 0 && data->watches));
-	data->watches = realloc(data->watches, sizeof(watch_t*)*(data->watchcount + 1));
-	assert(data->watches);
+	if (data->watchcount >= data->watchsize) {
+		data->watchsize = data->watchsize > 0 ? data->watchsize * 2 : 64;
+		data->watches = realloc(data->watches, sizeof(watch_t*) * data->watchsize);
+		assert(data->watches);
+	}
 	watch = calloc(1, sizeof(watch_t));
 	assert(watch);
 
-	assert(watch->path == NULL);
-	assert(watch->file == NULL);
+	watch->wd = wd;
+	watch->rule = rule;
+	watch->path = strdup(path);
+	assert(watch->path);
 	
-	watch->wd = -1;
+	watch->rulenext = rule->watches;
+	if (rule->watches) { rule->watches->ruleprev = watch; }
+	rule->watches = watch;
 	
+	watch->index = data->watchcount;
 	data->watches[data->watchcount] = watch;
 	assert(data->watches[data->watchcount]);
 
 	data->watchcount ++;
 	assert(data->watchcount > 0);
+	metrics_set(data->metrics, data->m_watches, data->watchcount);
+
+	// add it to the index so that events for this watch-descriptor can find it directly.
+	assert(data->wdindex);
+	wdindex_add(data->wdindex, watch->wd, watch);
+	
+	if (data->record) {
+		record_watch(data, REC_WATCH, rule, wd, 0, path);
+	}
 
 	return(watch);
 }
 
 
-static void add_watch(maindata_t *data, watch_t *watch, CONFIG config)
+static void free_snapentry(void *value, void *arg)
+{
+	free(value);
+}
+
+
+static void free_snapshot(HASHMAP snapshot)
+{
+	assert(snapshot);
+	hashmap_foreach(snapshot, free_snapentry, NULL);
+	hashmap_free(snapshot);
+}
+
+
+// return the watch that the rule has on a watch-descriptor, if it has one.
+static watch_t * find_watch(maindata_t *data, rule_t *rule, int wd)
 {
 	assert(data);
-	assert(watch);
-	
-	assert(watch->closedExec == NULL);
-	assert(watch->closedWriteExec == NULL);
-						
-	// We will look at the events the config wants to trigger on, and we will build a mode mask.  
-	// After we have checked all the options, we will add it to the  INOTIFY watch list.
-	int mode=0;
+	assert(rule);
 	
-	// now that we know we are watching a path, we need to check for any actions that may be resulting from it.
-	const char * closedexec = config_get(config, "FileClosedExec");
-	if (closedexec) {
-		// there is an action to be performed if the file is closed.
-		watch->closedExec = strdup(closedexec);
-		mode |= IN_CLOSE;
+	int count = 0;
+	watch_t **matches = (watch_t **) wdindex_get(data->wdindex, wd, &count);
+	int i;
+	for (i=0; i < count; i++) {
+		assert(matches[i]);
+		if (matches[i]->rule == rule) {
+			return(matches[i]);
+		}
 	}
+	return(NULL);
+}
+
+
+// A tree that is being removed while it is being added (or one that is over the limit) can fail for every directory in it, so the 
+// messages are limited.
+static void watch_failed(LOGGER logger, LOGLIMIT *limit, const char *path, int e)
+{
+	assert(logger);
+	assert(limit);
+	assert(path);
 	
-	const char * closedwriteexec = config_get(config, "FileClosedWriteExec");
-	if (closedwriteexec) {
-		// there is an action to be performed if the file is closed.
-		watch->closedWriteExec = strdup(closedwriteexec);
-		mode |= IN_CLOSE_WRITE;
+	if (e == ENOENT) {
+		logger_limited(logger, limit, 10, LOGGER_WARNING, "Cannot watch '%s', %s", path, strerror(e));
+	}
+	else if (e == ENOSPC) {
+		logger_limited(logger, limit, 10, LOGGER_WARNING, "Cannot watch '%s', the inotify watch limit has been reached (see /proc/sys/fs/inotify/max_user_watches)", path);
 	}
+	else {
+		logger_limited(logger, limit, 10, LOGGER_ERROR, "Cannot watch '%s', unexpected failure: %s", path, strerror(e));
+	}
+}
+
+
+
+// Give the kernel the events that all the watches sharing its watch need.  'path' is any of the paths it is watching.
+static void update_kwatch(maindata_t *data, kwatch_t *kwatch, const char *path)
+{
+	assert(data);
+	assert(kwatch);
+	assert(kwatch->refs > 0);
+	assert(path);
 	
-	if (mode != 0) {
-		// we have finished checking the different options, now we need to add to the watch descriptors.
-		assert(watch->wd == -1);
-		assert(data->infd > 0);
-		
-		assert(watch->path || watch->file);
-		
-		if (watch->path) {
-			assert(watch->file == NULL);
-			watch->wd = inotify_add_watch(data->infd, watch->path, mode);
+	uint32_t mask = 0;
+	int count = 0;
+	watch_t **matches = (watch_t **) wdindex_get(data->wdindex, kwatch->wd, &count);
+	int i;
+	for (i=0; i < count; i++) {
+		assert(matches[i]);
+		if (matches[i]->kwatch == kwatch) {
+			mask |= matches[i]->mask;
 		}
-		else if (watch->file) {
-			assert(watch->path == NULL);
-			watch->wd = inotify_add_watch(data->infd, watch->file, mode);			
+	}
+	
+	if (mask != 0 && mask != kwatch->mask) {
+		int wd = inotify_add_watch(data->infd, path, mask);
+		if (wd == -1) {
+			watch_failed(data->logger, &data->watchlimit, path, errno);
 		}
-		else {
-			// should have been at least path or file watch
-			assert(0);
+		else if (wd == kwatch->wd) {
+			kwatch->mask = mask;
 		}
+	}
+}
 
 
-		if (watch->wd == -1) {
-			int e = errno;
-			if (e == ENOENT) {
-				fprintf(stderr, "Cannot watch '%s', %s\n", watch->path ? watch->path : watch->file, strerror(e));
-			}
-			else {
-				perror("Unexpected failure");
-			}
-			
-			// since we couldn't watch it, we should remove this entry.
+// let go of a kernel watch.  When nothing is using it, it is removed (if 'rmwatch' is set, otherwise the kernel has already removed it).
+static void release_kwatch(maindata_t *data, kwatch_t *kwatch, const char *path, int rmwatch)
+{
+	assert(data);
+	assert(kwatch);
+	assert(kwatch->refs > 0);
+	
+	kwatch->refs --;
+	if (kwatch->refs > 0) {
+		// the others might not need all the events that it has.
+		if (rmwatch) {
+			update_kwatch(data, kwatch, path);
 		}
+		return;
 	}
 	
-	if (watch->wd == -1) {
-		// the watch was not set, we should remove this entry.
-		assert(0);
+	if (rmwatch) {
+		inotify_rm_watch(data->infd, kwatch->wd);
 	}
 	
-	assert(data->watchcount > 0);
-
+	// a newer watch for the same inode could have replaced this one in the registry.
+	if (hashmap_get(data->kwatches, &kwatch->key, sizeof(kwatch->key)) == kwatch) {
+		hashmap_remove(data->kwatches, &kwatch->key, sizeof(kwatch->key));
+	}
+	free(kwatch);
+	metrics_set(data->metrics, data->m_kwatches, hashmap_count(data->kwatches));
 }
 
 
-// This function will load all config files found in the specified path.
-// The config details will be examined to determine the actions that need to happen, and are added to a master config structure.
-static void process_config_dir(maindata_t *data, const char *configpath)
+// Add a watch for a rule on a directory (or file), sharing the kernel's watch with any other rules that are watching the same one.
+// 'created' is set if the rule was not already watching it.  Returns NULL if it cannot be watched.
+static watch_t * add_watch(maindata_t *data, rule_t *rule, const char *path, dev_t dev, ino_t ino, int *created)
 {
 	assert(data);
-	assert(configpath);
-
-	// make sure that we already have a reference to the INOTIFY API.
-	assert(data->infd >= 0);
+	assert(rule);
+	assert(path);
 	
-	size_t pathlen = strlen(configpath);
-	assert(pathlen > 0);
+	if (created) { *created = 0; }
+	uint32_t mask = rule->mask | (rule->recursive ? RECURSIVE_MASK : 0);
 	
-	// open the directory.
-	DIR *d = opendir(configpath);
-	if (d) {
-		struct dirent *dir;
-		
-		while ((dir = readdir(d)) != NULL)
-		{
-			assert(dir);
-			assert(dir->d_name);
-			
-			// if the filename does NOT start with a '.', then we will process it.
-			// Note this means config files can be disabled by putting '.' in front of the filename as per standard practice.
-			if (dir->d_name[0] != '.') {
-				// build the filepath to the config file.
-				char *filepath = malloc(pathlen + 1 + strlen(dir->d_name) + 2);
-				assert(filepath);
-				sprintf(filepath, "%s/%s", configpath, dir->d_name);
-				assert(filepath);
-				assert(strlen(filepath) > 0);
-				printf("Config file: %s\n", filepath);
-				
-				CONFIG config = config_load(filepath);
-				if (config) {
-					// now that we have found a config file, and loaded it, we need to examine its properties to determine what we need to put in the master config structure.
-
-					const char * pathcheck = config_get(config, "MonitorPath");
-					if (pathcheck) {
-						// we have found a config file that is monitoring a path.
-						printf("Path Monitor: %s\n", pathcheck);
-
-						watch_t *watch = new_watch(data);
-						assert(watch);
-						
-						assert(watch->path == NULL);
-						watch->path = strdup(pathcheck);
-						assert(watch->path);
-
-						add_watch(data, watch, config);
-					}
-
-					const char * filecheck = config_get(config, "MonitorFile");
-					if (filecheck) {
-						// we have found a config file that is monitoring a path.
-						printf("File Monitor: %s\n", filecheck);
-
-						watch_t *watch = new_watch(data);
-						assert(watch);
-						
-						assert(watch->file == NULL);
-						watch->file = strdup(filecheck);
-						assert(watch->file);
-
-						add_watch(data, watch, config);
-					}
-					
-					config_free(config);
-					config = NULL;
-				}
-				
-			}
+	kwatchkey_t key;
+	memset(&key, 0, sizeof(key));
+	key.dev = dev;
+	key.ino = ino;
+	
+	kwatch_t *kwatch = hashmap_get(data->kwatches, &key, sizeof(key));
+	if (kwatch == NULL) {
+		int wd = inotify_add_watch(data->infd, path, mask);
+		if (wd == -1) {
+			watch_failed(data->logger, &data->watchlimit, path, errno);
+			return(NULL);
 		}
-
-		closedir(d);
+		
+		kwatch = calloc(1, sizeof(kwatch_t));
+		assert(kwatch);
+		kwatch->key = key;
+		kwatch->wd = wd;
+		kwatch->mask = mask;
+		hashmap_set(data->kwatches, &key, sizeof(key), kwatch);
+		metrics_set(data->metrics, data->m_kwatches, hashmap_count(data->kwatches));
+	}
+	
+	watch_t *watch = find_watch(data, rule, kwatch->wd);
+	if (watch == NULL) {
+		watch = new_watch(data, rule, kwatch->wd, path);
+		assert(watch);
+		watch->mask = mask;
+		watch->kwatch = kwatch;
+		kwatch->refs ++;
+		if (created) { *created = 1; }
 	}
+	
+	update_kwatch(data, kwatch, path);
+	return(watch);
 }
 
 
-
-static char ** add_envp(char * const *envp, int *envpcount, const char * fmt, ...)
+// remove a watch from the list and the index, and free it.  
+// If 'rmwatch' is set, and nothing else is subscribed to the watch-descriptor, then the inotify watch is removed as well.
+static void remove_watch(maindata_t *data, watch_t *watch, int rmwatch)
 {
-	int size = 0;
-	va_list ap;
-
-	assert(envpcount);
-	assert((envp == NULL && *envpcount == 0) || (envp && *envpcount > 0));
-	assert(fmt);
+	assert(data);
+	assert(watch);
+	assert(watch->index >= 0 && watch->index < data->watchcount);
+	assert(data->watches[watch->index] == watch);
 	
-	// Determine required size 
-	va_start(ap, fmt);
-	size = vsnprintf(NULL, size, fmt, ap);
-	va_end(ap);
-
-	// if there is an error in formatting, then return without adding anything.
-	if (size < 0) { return envp;}
-
-	// For the trailing NULL to terminate the string.
-	size++;
+	if (data->record) {
+		record_watch(data, REC_UNWATCH, watch->rule, watch->wd, 0, NULL);
+	}
 	
-	// allocate the memory
-	assert(size > 0);
-	char *p = malloc(size);
-	assert(p);
-
-	va_start(ap, fmt);
-	size = vsnprintf(p, size, fmt, ap);
-	assert(size >= 0);
-	va_end(ap);
-
-	// now we need to add the new string to the envp array.  Note that the last element in the array needs to be NULL.
-	char ** newenv = realloc(envp, (((*envpcount) + 2) * (sizeof(char *))));
-	assert(newenv);
+	wdindex_remove(data->wdindex, watch->wd, watch);
+	if (watch->kwatch) {
+		release_kwatch(data, watch->kwatch, watch->path, rmwatch);
+		watch->kwatch = NULL;
+	}
+	
+	assert(watch->rule);
+	if (watch->ruleprev) { watch->ruleprev->rulenext = watch->rulenext; }
+	else { watch->rule->watches = watch->rulenext; }
+	if (watch->rulenext) { watch->rulenext->ruleprev = watch->ruleprev; }
 	
-	newenv[(*envpcount)] = p;
-	(*envpcount) ++;
-	newenv[(*envpcount)] = (char *) NULL;
+	// move the last watch in the list into the hole left by this one.
+	data->watchcount --;
+	if (watch->index < data->watchcount) {
+		data->watches[watch->index] = data->watches[data->watchcount];
+		data->watches[watch->index]->index = watch->index;
+	}
+	data->watches[data->watchcount] = NULL;
+	metrics_set(data->metrics, data->m_watches, data->watchcount);
+	
+	if (watch->snapshot) {
+		free_snapshot(watch->snapshot);
+		watch->snapshot = NULL;
+	}
 	
-	return newenv;
+	free((void *) watch->path);
+	watch->path = NULL;
+	free(watch);
 }
 
 
+// When adding the watches for a tree, the worker threads of the walk add the inotify watches themselves (the kernel API is thread-safe).
+// The results are collected here, and are added to the list of watches once the walk has finished.
+typedef struct {
+	int infd;
+	HASHMAP kwatches;	// only looked at during the walk, it isn't changed until afterwards.
+	LOGGER logger;
+	
+	pthread_mutex_t lock;
+	LOGLIMIT limit;
+	kwatchkey_t *keys;
+	char **paths;
+	int count;
+	int size;
+} subtree_t;
 
 
-// Read all available inotify events and process them.
-static void handle_events(maindata_t *data)
+static void subtree_failed(subtree_t *subtree, const char *path, int e)
 {
-	/* NOTE: Some systems cannot read integer variables if they are not
-		properly aligned. On other systems, incorrect alignment may
-		decrease performance. Hence, the buffer used for reading from
-		the inotify file descriptor should have the same alignment as
-		struct inotify_event. */
+	assert(subtree);
+	pthread_mutex_lock(&subtree->lock);
+	watch_failed(subtree->logger, &subtree->limit, path, e);
+	pthread_mutex_unlock(&subtree->lock);
+}
 
-	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
-	const struct inotify_event *event;
 
-	assert(data);
+static int subtree_dir(const char *path, void *arg)
+{
+	subtree_t *subtree = arg;
+	assert(subtree);
+	assert(path);
 	
-	// Loop while events can be read from inotify file descriptor.
-	// note, code inside will force a break from the loop when there is nothing more to process.
-	for (;;) {
-
-		// Read some events.
-		assert(data->infd);
-		ssize_t len = read(data->infd, buf, sizeof(buf));
-		if (len == -1 && errno != EAGAIN) {
-			perror("read");
-			exit(EXIT_FAILURE);
+	struct stat sb;
+	if (lstat(path, &sb) != 0) {
+		subtree_failed(subtree, path, errno);
+		return(0);
+	}
+	kwatchkey_t key;
+	memset(&key, 0, sizeof(key));
+	key.dev = sb.st_dev;
+	key.ino = sb.st_ino;
+	
+	// The watch is added BEFORE the directory is listed.  Any directory created after the listing will then generate an event, so nothing can slip through the gap.
+	// Only the events needed to follow the tree are asked for at this point.  Listing a directory opens and closes it, and if the close events were
+	// also being watched, a large tree would flood the inotify queue with our own events.
+	// If another rule is already watching the directory, the events are added to what it has, and if it already has them, nothing needs to be done.
+	kwatch_t *kwatch = hashmap_get(subtree->kwatches, &key, sizeof(key));
+	if (kwatch == NULL || (kwatch->mask & RECURSIVE_MASK) != RECURSIVE_MASK) {
+		if (inotify_add_watch(subtree->infd, path, RECURSIVE_MASK | IN_MASK_ADD) == -1) {
+			subtree_failed(subtree, path, errno);
+			return(0);
 		}
+	}
+	
+	char *copy = strdup(path);
+	assert(copy);
+	
+	pthread_mutex_lock(&subtree->lock);
+	if (subtree->count >= subtree->size) {
+		subtree->size = subtree->size > 0 ? subtree->size * 2 : 64;
+		subtree->keys = realloc(subtree->keys, sizeof(kwatchkey_t) * subtree->size);
+		assert(subtree->keys);
+		subtree->paths = realloc(subtree->paths, sizeof(char *) * subtree->size);
+		assert(subtree->paths);
+	}
+	subtree->keys[subtree->count] = key;
+	subtree->paths[subtree->count] = copy;
+	subtree->count ++;
+	pthread_mutex_unlock(&subtree->lock);
+	
+	return(1);
+}
 
-		// If the nonblocking read() found no events to read, then it returns -1 with errno set to EAGAIN. In that case, we exit the loop.
-		if (len <= 0) {
-			assert(errno == EAGAIN);
-			break;
-		}
 
-		// Loop over all events in the buffer
-		char *ptr;
-		for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+static void trigger_actions(maindata_t *data, watch_t *watch, uint32_t mask, const char *name);
+static long long realtime_ns(void);
 
-			event = (const struct inotify_event *) ptr;
-			assert(event);
-			
-			assert(event->wd >= 0);
 
-			if (data->watches) {
-				assert(data->watchcount > 0);
+// perform the actions for a file that changed without us getting the event for it.  These are recorded, as the replay cannot look for them itself.
+static void synthesize_close(maindata_t *data, watch_t *watch, const char *name)
+{
+	assert(data);
+	assert(watch);
+	if (data->record) {
+		record_watch(data, REC_TRIGGER, watch->rule, watch->wd, IN_CLOSE_WRITE, name ? name : "");
+	}
+	data->readtime = data->replay ? 0 : realtime_ns();
+	trigger_actions(data, watch, IN_CLOSE_WRITE, name);
+}
+
+
+// Add watches for a directory and all the directories below it.  
+// If 'isnew' is set, the directory has just been created (or moved into the tree), and files could have been created in it before our watch was in place.  
+// Close events are generated for any files already in those directories, so that the actions still fire for them.
+static void add_subtree(maindata_t *data, rule_t *rule, const char *path, int isnew)
+{
+	assert(data);
+	assert(rule);
+	assert(rule->recursive);
+	assert(path);
 	
-				// iterate through the list of watches, to find any watch-descriptors that match.
-				int i;
-				for (i=0; i < data->watchcount; i++) {
-					assert(data->watches[i]);
-					watch_t *watch = data->watches[i];
-					assert(watch);
-					
-					assert(watch->wd >= 0);
-					assert(watch->path || watch->file);
-					
-					if (watch->wd == event->wd) {
-						// we found a match.  We dont stop here, because it is possible for multiple matches in the list of watches.
-						
-// 			if (event->mask & IN_OPEN)			printf("IN_OPEN: ");
-// 			if (event->mask & IN_CLOSE_NOWRITE)	printf("IN_CLOSE_NOWRITE: ");
-// 			if (event->mask & IN_CLOSE_WRITE)	printf("IN_CLOSE_WRITE: ");
-		
-						if (((event->mask & IN_CLOSE_WRITE) || (event->mask & IN_CLOSE_NOWRITE)) && watch->closedExec) {
-							// action is triggered whenever a file is closed for either reading or writing.
-							
-							pid_t pid = fork();
-							if (pid == 0) {
-								
-								char ** envp = NULL;
-								int envp_count = 0;
-								
-								if (watch->path) {
-									assert(watch->path);
-									assert(watch->file == NULL);
-// 									fprintf(stderr, "Adding ENV: FK_PATH=%s\n", watch->path);
-									envp = add_envp(envp, &envp_count, "FK_PATH=%s", watch->path);
-									assert(envp_count > 0);
-									assert(envp);
-									assert(event->len > 0);
-									assert(event->name);
-// 									fprintf(stderr, "Adding ENV: FK_FILE=%s\n", event->name);
-									envp = add_envp(envp, &envp_count, "FK_FILE=%s", event->name);
-									assert(envp_count > 1);
-									assert(envp);
-								}
-								else if (watch->file) {
-									assert(watch->file);
-									assert(watch->path == NULL);
-// 									fprintf(stderr, "Adding ENV: FK_PATH=%s\n", watch->file);
-									envp = add_envp(envp, &envp_count, "FK_PATH=%s", watch->file);
-									assert(envp_count > 0);
-									assert(envp);
-									assert(event->len > 0);
-									assert(event->name);
-// 									fprintf(stderr, "Adding ENV: FK_FILE=%s\n", event->name);
-									envp = add_envp(envp, &envp_count, "FK_FILE=%s", event->name);
-									assert(envp_count > 1);
-									assert(envp);
-								}
-								else {
-									// should have been one or the other.
-									assert(0);
-								}
-
-// 								int result = execle("/bin/sh", "sh", "-c", watch->closedExec , (char *) NULL, (char * const *) envp );
-								int result = execve(watch->closedExec , (char *) NULL, (char * const *) envp );
-
-								// if successful, the forked process will be replaced by the functionality specified above.
-								
-							}
-							else if (pid < 0) {
-								// An error happened when the fork was attempted.
-								assert(0);
-							}
-							else {
-								// This is the parent process.
-								printf("Action event triggered.  PID=%d, Action='%s'\n", pid, watch->closedExec);
-							}
-							
-							
-						}
-						
-						if ((event->mask & IN_CLOSE_WRITE) && watch->closedWriteExec) {
-							// action is triggered whenever a file is closed for writing.
-// 							pid_t pid = spawn_action(event, watch->closedExec);
-// 							printf("Action event triggered.  PID=%d, Action='%s'\n", pid, watch->closedExec)
-						}
-						
-						if (watch->path) { 
-							printf("%s/", watch->path);
-						}
-						else {
-							assert(watch->file);
-							printf("%s", watch->file);
-						}
-//						assert(event->mask & IN_ISDIR);
-						
-						if (event->len)
-							printf("%s\n", event->name);
-						else 
-							printf("\n");
-						
+	subtree_t subtree;
+	memset(&subtree, 0, sizeof(subtree));
+	subtree.infd = data->infd;
+	subtree.kwatches = data->kwatches;
+	subtree.logger = data->logger;
+	pthread_mutex_init(&subtree.lock, NULL);
+	
+	// Directories created while running are normally small, so there is no point starting threads for them.  At startup, the tree could be huge.
+	treewalk(path, isnew ? 1 : 0, subtree_dir, NULL, &subtree);
+	
+	// Now that the walk has finished, the watches can be given the events that the rule actually needs.  
+	// Anything closed in the tree while it was being walked will be missed, except for new directories, where the files found below are checked.
+	int i;
+	for (i=0; i < subtree.count; i++) {
+		int created = 0;
+		watch_t *watch = add_watch(data, rule, subtree.paths[i], subtree.keys[i].dev, subtree.keys[i].ino, &created);
+		if (watch && created && isnew) {
+			// now that the watch is in place, look for any files that were created before it was.
+			DIR *d = opendir(watch->path);
+			if (d) {
+				struct dirent *dir;
+				while ((dir = readdir(d)) != NULL) {
+					if (dir->d_type == DT_REG) {
+						synthesize_close(data, watch, dir->d_name);
 					}
 				}
+				closedir(d);
 			}
 		}
+		free(subtree.paths[i]);
 	}
+	
+	if (subtree.keys) { free(subtree.keys); }
+	if (subtree.paths) { free(subtree.paths); }
+	pthread_mutex_destroy(&subtree.lock);
+	
+	logger_write(data->logger, LOGGER_INFO, "Watching %d directories under: %s", subtree.count, path);
 }
 
 
-
-int main(void)
+// A directory has been moved out of the tree.  The kernel will keep watching it in its new location, so the watches for it, and everything below it, need to be removed.
+static void remove_subtree(maindata_t *data, rule_t *rule, const char *path)
 {
-	// we create a structure that will contain all the major config that we need to use.
-	maindata_t *data = calloc(1, sizeof(maindata_t));
-	assert(data->watchcount == 0);
-	assert(data->watches == NULL);
-
-	// Create interface to the inotify kernel API;
-	assert(data->infd == 0);
-	data->infd = inotify_init1(IN_NONBLOCK);
-	if (data->infd == -1) {
-		perror("inotify_init1");
+	assert(data);
+	assert(rule);
+	assert(path);
+	
+	size_t pathlen = strlen(path);
+	
+	// This is not a common operation, so we simply go through the watches for the rule.
+	watch_t *watch = rule->watches;
+	while (watch) {
+		watch_t *next = watch->rulenext;
+		assert(watch->rule == rule);
+		if (strncmp(watch->path, path, pathlen) == 0 && (watch->path[pathlen] == 0 || watch->path[pathlen] == '/')) {
+			remove_watch(data, watch, 1);
+		}
+		watch = next;
+	}
+}
+
+
+static void batch_flush(batch_t *batch);
+static void reset_open_files(maindata_t *data);
+
+
+// Find the sink that events are published to, opening it if no other rule has.  Returns NULL if it cannot be opened.
+static sink_t * get_sink(maindata_t *data, const char *spec)
+{
+	assert(data);
+	assert(data->sinks);
+	assert(spec);
+	
+	sink_t *sink = hashmap_get(data->sinks, spec, strlen(spec));
+	if (sink == NULL) {
+		EVENTSINK eventsink = eventsink_new(spec, data->sinkformat, data->sinkpolicy, data->sinkbuffer);
+		if (eventsink == NULL) {
+			logger_write(data->logger, LOGGER_ERROR, "Unable to open the event sink '%s', %s", spec, strerror(errno));
+			return(NULL);
+		}
+		logger_write(data->logger, LOGGER_INFO, "Event sink: %s", spec);
+		sink = calloc(1, sizeof(sink_t));
+		assert(sink);
+		sink->sink = eventsink;
+		hashmap_set(data->sinks, eventsink_spec(eventsink), strlen(spec), sink);
+	}
+	sink->refs ++;
+	return(sink);
+}
+
+
+// the subscribers are disconnected (and the socket removed) once no rule publishes to the sink.
+static void release_sink(maindata_t *data, sink_t *sink)
+{
+	assert(data);
+	assert(sink);
+	assert(sink->refs > 0);
+	
+	sink->refs --;
+	if (sink->refs == 0) {
+		const char *spec = eventsink_spec(sink->sink);
+		void *removed = hashmap_remove(data->sinks, spec, strlen(spec));
+		assert(removed == sink);
+		eventsink_free(sink->sink);
+		free(sink);
+	}
+}
+
+
+// let go of a reference to a rule, and free it when it is no longer used.
+static void release_rule(maindata_t *data, rule_t *rule)
+{
+	assert(data);
+	assert(rule);
+	assert(rule->refs > 0);
+	
+	rule->refs --;
+	if (rule->refs > 0) {
+		return;
+	}
+	
+	assert(rule->watches == NULL);
+	if (rule->batch) {
+		// events that were held back by a debounce window can still have been added after the rule was retired.
+		batch_flush(rule->batch);
+		assert(rule->batch->timer == NULL);
+		if (rule->batch->buffer) { free(rule->batch->buffer); }
+		free(rule->batch);
+	}
+	if (rule->filter) { filter_free(rule->filter); }
+	if (rule->condition) { condition_free(rule->condition); }
+	if (rule->allclosed) {
+		// the files are only known by a hash that includes the address of the rule, which a new rule could be given.
+		reset_open_files(data);
+	}
+	
+	// anything still queued or running in the executor keeps its own hold on these.
+	if (rule->closedTemplate) { executor_template_release(data->executor, rule->closedTemplate); }
+	if (rule->closedWriteTemplate) { executor_template_release(data->executor, rule->closedWriteTemplate); }
+	if (rule->batchTemplate) { executor_template_release(data->executor, rule->batchTemplate); }
+	if (rule->closedOp) { fileop_free(rule->closedOp); }
+	if (rule->closedWriteOp) { fileop_free(rule->closedWriteOp); }
+	if (rule->sink) { release_sink(data, rule->sink); }
+	if (rule->group) { executor_group_release(data->executor, rule->group); }
+	
+	if (rule->path) { free((void *) rule->path); }
+	if (rule->file) { free((void *) rule->file); }
+	if (rule->closedExec) { free((void *) rule->closedExec); }
+	if (rule->closedWriteExec) { free((void *) rule->closedWriteExec); }
+	if (rule->batchExec) { free((void *) rule->batchExec); }
+	free(rule);
+}
+
+
+// A built-in action for a file, which is given to one of the file action threads.  A reference is held on the rule until it is handed back.
+typedef struct {
+	rule_t *rule;
+	FILEOP op;
+	char *path;			// the full path of the file.
+	int error;			// the errno if the action failed (0 if it didn't).
+} fileaction_t;
+
+
+// the number of built-in actions that can be waiting for each of the threads.
+#define FILE_ACTION_QUEUE	4096
+
+
+// runs on one of the file action threads.
+static void fileaction_cb(WORKERS workers, int worker, void *item, void *arg)
+{
+	fileaction_t *action = item;
+	maindata_t *data = arg;
+	assert(action);
+	assert(data);
+	
+	if (fileop_run(action->op, action->path) != 0) {
+		action->error = errno;
+		metrics_add(data->metrics, data->m_fileops_failed, 1);
+	}
+	else {
+		metrics_add(data->metrics, data->m_fileops, 1);
+	}
+	workers_done(workers, worker, action);
+}
+
+
+// parse a built-in action, starting the threads for them if they haven't been already.  Returns NULL if it cannot be used.
+static FILEOP new_fileop(maindata_t *data, const char *spec)
+{
+	assert(data);
+	assert(spec);
+	
+	FILEOP op = fileop_new(spec);
+	if (op == NULL) {
+		logger_write(data->logger, LOGGER_WARNING, "Invalid action '%s'", spec);
+		return(NULL);
+	}
+	
+	if (data->fileworkers == NULL) {
+		int threads = setting_long(data, "FileActionThreads", 2);
+		if (threads <= 0) { threads = 1; }
+		data->fileworkers = workers_new(threads, FILE_ACTION_QUEUE, fileaction_cb, data);
+		if (data->fileworkers == NULL) {
+			logger_write(data->logger, LOGGER_ERROR, "Unable to start the threads for the built-in actions, '%s' will not be done", spec);
+			fileop_free(op);
+			return(NULL);
+		}
+	}
+	return(op);
+}
+
+
+// create a rule from the config.  The watches for it are added separately (see watch_rule()).  Returns NULL if the rule has no actions.
+static rule_t * new_rule(maindata_t *data, CONFIG config, const char *path, const char *file, int recursive)
+{
+	assert(data);
+	assert(config);
+	assert(path || file);
+	
+	rule_t *rule = calloc(1, sizeof(rule_t));
+	assert(rule);
+	rule->refs = 1;
+	
+	if (path) {
+		rule->path = strdup(path);
+		assert(rule->path);
+	}
+	else {
+		rule->file = strdup(file);
+		assert(rule->file);
+	}
+	rule->recursive = recursive;
+						
+	// We will look at the events the config wants to trigger on, and we will build a mode mask.  
+	// After we have checked all the options, we will add it to the  INOTIFY watch list.
+	uint32_t mode=0;
+	
+	// now that we know we are watching a path, we need to check for any actions that may be resulting from it.
+	const char * closedexec = config_get(config, "FileClosedExec");
+	if (closedexec) {
+		// there is an action to be performed if the file is closed.
+		rule->closedExec = strdup(closedexec);
+		mode |= IN_CLOSE;
+	}
+	
+	const char * closedwriteexec = config_get(config, "FileClosedWriteExec");
+	if (closedwriteexec) {
+		// there is an action to be performed if the file is closed.
+		rule->closedWriteExec = strdup(closedwriteexec);
+		mode |= IN_CLOSE_WRITE;
+	}
+	
+	// the built-in actions (eg, copy:/dir) are done without starting a process.
+	const char *closedaction = config_get(config, "FileClosedAction");
+	if (closedaction) {
+		rule->closedOp = new_fileop(data, closedaction);
+		if (rule->closedOp) { mode |= IN_CLOSE; }
+	}
+	
+	const char *closedwriteaction = config_get(config, "FileClosedWriteAction");
+	if (closedwriteaction) {
+		rule->closedWriteOp = new_fileop(data, closedwriteaction);
+		if (rule->closedWriteOp) { mode |= IN_CLOSE_WRITE; }
+	}
+	
+	// the events can be given to processes that are already running, rather than starting one for each.
+	const char *eventsink = config_get(config, "EventSink");
+	if (eventsink) {
+		rule->sink = get_sink(data, eventsink);
+		if (rule->sink) { mode |= IN_CLOSE; }
+	}
+	
+	const char * batchexec = config_get(config, "BatchExec");
+	if (batchexec) {
+		// there is an action that is given all the files that have been closed since it last ran.
+		rule->batchExec = strdup(batchexec);
+		mode |= IN_CLOSE;
+		
+		batch_t *batch = calloc(1, sizeof(batch_t));
+		assert(batch);
+		batch->data = data;
+		batch->rule = rule;
+		batch->max = config_get_long(config, "BatchMaxEvents");
+		if (batch->max <= 0) { batch->max = 1000; }
+		batch->latency = config_get_long(config, "BatchMaxLatencyMs");
+		if (batch->latency <= 0) { batch->latency = 1000; }
+		const char *format = config_get(config, "BatchFormat");
+		if (format && strcasecmp(format, "nul") == 0) {
+			batch->separator = '\0';
+		}
+		else {
+			if (format && strcasecmp(format, "line") != 0) {
+				logger_write(data->logger, LOGGER_WARNING, "Unknown BatchFormat '%s', using 'line'", format);
+			}
+			batch->separator = '\n';
+		}
+		rule->batch = batch;
+	}
+	
+	// Only files with names that match the patterns will trigger the actions.  They are compiled now, so that each event does not need to 
+	// be checked against every pattern in turn.
+	int i;
+	const char *pattern;
+	for (i=0; (pattern = config_get_nth(config, "IncludePattern", i)) != NULL; i++) {
+		if (rule->filter == NULL) { rule->filter = filter_new(); }
+		if (filter_include(rule->filter, pattern) != 0) {
+			logger_write(data->logger, LOGGER_ERROR, "Invalid IncludePattern '%s', no files will match it", pattern);
+		}
+	}
+	for (i=0; (pattern = config_get_nth(config, "ExcludePattern", i)) != NULL; i++) {
+		if (rule->filter == NULL) { rule->filter = filter_new(); }
+		if (filter_exclude(rule->filter, pattern) != 0) {
+			logger_write(data->logger, LOGGER_WARNING, "Invalid ExcludePattern '%s'", pattern);
+		}
+	}
+	
+	// The conditions on the files (eg, "size > 1M and owner == fxpuser") are compiled now, and are checked just before the actions 
+	// would be performed.  The file is only looked at if the conditions need it.  If one cannot be compiled (eg, a user that does not 
+	// exist), the rule is not used at all, as without the condition it would act on files that it was meant to leave alone.
+	const char *expr;
+	for (i=0; (expr = config_get_nth(config, "Condition", i)) != NULL; i++) {
+		if (rule->condition == NULL) { rule->condition = condition_new(); }
+		char error[128];
+		if (condition_add(rule->condition, expr, error, sizeof(error)) != 0) {
+			logger_write(data->logger, LOGGER_ERROR, "Invalid Condition '%s' for '%s', %s.  No actions will be performed for it.", expr, rule->path ? rule->path : rule->file, error);
+			release_rule(data, rule);
+			return(NULL);
+		}
+	}
+	
+	rule->mask = mode;
+	
+	// closing a file (even after writing to it) does not mean that it is any different, so the contents can be checked first.
+	rule->contentonly = config_get_bool(config, "FireOnContentChangeOnly");
+	
+	// A file that several processes write to (or that is opened and closed several times while it is being written) is only acted on 
+	// once all of them have closed it.  The opens need to be watched as well, to know how many there are.
+	// Every close is needed to count them, even if the actions only want the ones after writing.
+	if (config_get_bool(config, "FireWhenAllWritersClosed") && (mode & IN_CLOSE)) {
+		rule->allclosed = mode & IN_CLOSE;
+		rule->confirmclosed = config_get_bool(config, "ConfirmWritersClosed");
+		rule->mask |= IN_OPEN | IN_CLOSE;
+	}
+	
+	// Events for the same file can be collected together, so that the actions are only performed once the file has been quiet for a while.
+	// If the file never goes quiet, the actions are still performed once the maximum is reached (10 times the window if not specified).
+	rule->debounce = config_get_long(config, "DebounceMs");
+	if (rule->debounce < 0) { rule->debounce = 0; }
+	rule->debouncemax = config_get_long(config, "DebounceMaxMs");
+	if (rule->debouncemax <= 0) { rule->debouncemax = rule->debounce * 10; }
+	
+	// the number of actions that can be running for this rule at the same time, and how long (in seconds) they can run for.  
+	// If not specified, only the limits for the whole daemon apply.
+	assert(data->executor);
+	rule->group = executor_group(data->executor, config_get_long(config, "MaxConcurrent"), config_get_long(config, "ActionTimeout") * 1000);
+	assert(rule->group);
+	
+	// and how many can be started each second, so that a flood of files in this path cannot start actions faster than that.  Up to
+	// 'Burst' can be started at once (a second's worth if not specified), and the rest wait in the queue.
+	if (config_get_long(config, "MaxActionsPerSec") > 0) {
+		executor_group_rate(data->executor, rule->group, config_get_long(config, "MaxActionsPerSec"), config_get_long(config, "Burst"));
+	}
+	
+	// Everything about running the actions that does not depend on the event is prepared now, rather than each time they are run.
+	// The actions are given the path that the rule is monitoring (FK_MONITOR), and the PATH that the daemon has, so that scripts can find their tools.
+	char *monitor = malloc(strlen("FK_MONITOR=") + strlen(rule->path ? rule->path : rule->file) + 1);
+	assert(monitor);
+	sprintf(monitor, "FK_MONITOR=%s", rule->path ? rule->path : rule->file);
+	
+	const char *envpath = getenv("PATH");
+	char *pathenv = malloc(strlen("PATH=") + strlen(envpath ? envpath : "/usr/bin:/bin") + 1);
+	assert(pathenv);
+	sprintf(pathenv, "PATH=%s", envpath ? envpath : "/usr/bin:/bin");
+	
+	const char *env[] = { monitor, pathenv, NULL };
+	if (rule->closedExec) {
+		rule->closedTemplate = executor_template(data->executor, rule->closedExec, env);
+	}
+	if (rule->closedWriteExec) {
+		rule->closedWriteTemplate = executor_template(data->executor, rule->closedWriteExec, env);
+	}
+	if (rule->batchExec) {
+		rule->batchTemplate = executor_template(data->executor, rule->batchExec, env);
+	}
+	free(monitor);
+	free(pathenv);
+	
+	if (mode == 0) {
+		logger_write(data->logger, LOGGER_ERROR, "No actions specified for '%s'", rule->path ? rule->path : rule->file);
+		release_rule(data, rule);
+		rule = NULL;
+	}
+	
+	return(rule);
+}
+
+
+// With fanotify, the rules are kept in the trie under the path that the events for them will have.  For a file, that is the directory it is in.
+static void monitor_dir(rule_t *rule, char *dir)
+{
+	assert(rule);
+	assert(dir);
+	
+	strcpy(dir, rule->path ? rule->path : rule->file);
+	if (rule->file) {
+		char *slash = strrchr(dir, '/');
+		if (slash) {
+			slash[slash == dir ? 1 : 0] = 0;
+		}
+	}
+}
+
+
+static void monitor_rule(maindata_t *data, rule_t *rule, int add)
+{
+	assert(data);
+	assert(data->monitors);
+	assert(rule);
+	
+	char dir[strlen(rule->path ? rule->path : rule->file) + 1];
+	monitor_dir(rule, dir);
+	if (add) {
+		pathtrie_add(data->monitors, dir, rule);
+	}
+	else {
+		int removed = pathtrie_remove(data->monitors, dir, rule);
+		assert(removed == 0);
+	}
+}
+
+
+// add the watches for a rule.
+static void watch_rule(maindata_t *data, rule_t *rule)
+{
+	assert(data);
+	assert(rule);
+	assert(rule->mask != 0);
+	assert(data->infd > 0);
+	
+	if (data->replay) {
+		// the watches are added as they are found in the recording.
+		return;
+	}
+	
+	if (data->fanwatch) {
+		// the filesystem is watched as a whole, and the events for this rule are picked out by their path.
+		// As it does not need to be watched itself, a file does not need to exist yet.
+		char dir[strlen(rule->path ? rule->path : rule->file) + 1];
+		monitor_dir(rule, dir);
+		if (fanwatch_add(data->fanwatch, dir, rule->mask) != 0) {
+			watch_failed(data->logger, &data->watchlimit, dir, errno);
+			return;
+		}
+		monitor_rule(data, rule, 1);
+		rule->monitored = 1;
+		return;
+	}
+	
+	if (rule->recursive) {
+		assert(rule->path);
+		add_subtree(data, rule, rule->path, 0);
+	}
+	else {
+		const char *target = rule->path ? rule->path : rule->file;
+		struct stat sb;
+		if (stat(target, &sb) != 0) {
+			watch_failed(data->logger, &data->watchlimit, target, errno);
+		}
+		else {
+			add_watch(data, rule, target, sb.st_dev, sb.st_ino, NULL);
+		}
+	}
+}
+
+
+// remove all the watches for a rule.
+static void unwatch_rule(maindata_t *data, rule_t *rule)
+{
+	assert(data);
+	assert(rule);
+	if (rule->monitored) {
+		monitor_rule(data, rule, 0);
+		rule->monitored = 0;
+	}
+	while (rule->watches) {
+		remove_watch(data, rule->watches, 1);
+	}
+}
+
+
+// The rule has been replaced with one for the same path, so it can take over the watches, rather than them all being removed and added again.
+// If the new rule needs different events, the watches are updated in place.  The old rule might not have been able to watch everything 
+// (the path might not have been there when it was loaded), so anything it is missing is added.
+static void move_watches(maindata_t *data, rule_t *from, rule_t *to)
+{
+	assert(data);
+	assert(from);
+	assert(to);
+	assert(from->recursive == to->recursive);
+	assert(to->watches == NULL);
+	
+	if (from->monitored == 0 && from->watches == NULL) {
+		// there is nothing to take over.
+		watch_rule(data, to);
+		return;
+	}
+	
+	if (from->monitored) {
+		// the filesystem mark only needs to change if there are new events.
+		char dir[strlen(to->path ? to->path : to->file) + 1];
+		monitor_dir(to, dir);
+		if ((to->mask & ~from->mask) && fanwatch_add(data->fanwatch, dir, to->mask) != 0) {
+			watch_failed(data->logger, &data->watchlimit, dir, errno);
+		}
+		monitor_rule(data, from, 0);
+		from->monitored = 0;
+		monitor_rule(data, to, 1);
+		to->monitored = 1;
+		return;
+	}
+	
+	uint32_t mask = to->mask | (to->recursive ? RECURSIVE_MASK : 0);
+	watch_t *watch;
+	for (watch = from->watches; watch; watch = watch->rulenext) {
+		watch->rule = to;
+		watch->mask = mask;
+		if (from->mask != to->mask && watch->kwatch) {
+			update_kwatch(data, watch->kwatch, watch->path);
+		}
+	}
+	to->watches = from->watches;
+	from->watches = NULL;
+	
+	if (to->recursive) {
+		// the directories that are already watched are skipped, so only the ones that could not be watched before are added.
+		assert(to->path);
+		add_subtree(data, to, to->path, 0);
+	}
+}
+
+
+// The config for a rule has gone away (or has been replaced).  Anything it has waiting in a batch is run now, and it is freed once nothing else is holding on to it.
+static void retire_rule(maindata_t *data, rule_t *rule)
+{
+	assert(data);
+	assert(rule);
+	
+	unwatch_rule(data, rule);
+	if (rule->batch) {
+		batch_flush(rule->batch);
+	}
+	release_rule(data, rule);
+}
+
+
+// Load (or reload) a config file, and apply the rules in it.  If the file was already loaded, only the differences are applied to the watches:
+//   - a rule for a path that is no longer in the file has its watches removed.
+//   - a rule for a new path has its watches added.
+//   - a rule for the same path takes over the watches of the old one (which are only updated if it needs different events).  Any
+//     watches that the old one could not add (eg, the path did not exist yet) are tried again, and a tree is walked for new directories.
+// If the file cannot be loaded (ie, it has been removed), all its rules are removed.
+static void load_config_file(maindata_t *data, const char *filepath)
+{
+	assert(data);
+	assert(filepath);
+	assert(data->cfgfiles);
+	
+	rule_t *rules[RULE_KINDS] = { NULL, NULL, NULL };
+	
+	CONFIG config = access(filepath, R_OK) == 0 ? config_load(filepath) : NULL;
+	if (config) {
+		// now that we have found a config file, and loaded it, we need to examine its properties to determine what we need to put in the master config structure.
+
+		const char * pathcheck = config_get(config, "MonitorPath");
+		if (pathcheck) {
+			// we have found a config file that is monitoring a path.
+			logger_write(data->logger, LOGGER_INFO, "Path Monitor: %s", pathcheck);
+			rules[RULE_PATH] = new_rule(data, config, pathcheck, NULL, 0);
+		}
+
+		const char * treecheck = config_get(config, "MonitorPathRecursive");
+		if (treecheck) {
+			// we have found a config file that is monitoring a path, and everything below it.
+			logger_write(data->logger, LOGGER_INFO, "Recursive Path Monitor: %s", treecheck);
+			rules[RULE_TREE] = new_rule(data, config, treecheck, NULL, 1);
+		}
+
+		const char * filecheck = config_get(config, "MonitorFile");
+		if (filecheck) {
+			// we have found a config file that is monitoring a path.
+			logger_write(data->logger, LOGGER_INFO, "File Monitor: %s", filecheck);
+			rules[RULE_FILE] = new_rule(data, config, NULL, filecheck, 0);
+		}
+		
+		config_free(config);
+		config = NULL;
+	}
+	
+	configfile_t *cfgfile = hashmap_get(data->cfgfiles, filepath, strlen(filepath));
+	if (cfgfile == NULL) {
+		if (rules[RULE_PATH] == NULL && rules[RULE_TREE] == NULL && rules[RULE_FILE] == NULL) {
+			// nothing was loaded before, and there is nothing now.
+			return;
+		}
+		cfgfile = calloc(1, sizeof(configfile_t));
+		assert(cfgfile);
+		cfgfile->path = strdup(filepath);
+		assert(cfgfile->path);
+		hashmap_set(data->cfgfiles, cfgfile->path, strlen(cfgfile->path), cfgfile);
+	}
+	
+	int kind;
+	for (kind=0; kind < RULE_KINDS; kind++) {
+		rule_t *old = cfgfile->rules[kind];
+		rule_t *rule = rules[kind];
+		
+		if (old && rule && strcmp(old->path ? old->path : old->file, rule->path ? rule->path : rule->file) == 0) {
+			move_watches(data, old, rule);
+		}
+		else if (rule) {
+			watch_rule(data, rule);
+		}
+		
+		if (old) {
+			retire_rule(data, old);
+		}
+		cfgfile->rules[kind] = rule;
+	}
+	
+	if (rules[RULE_PATH] == NULL && rules[RULE_TREE] == NULL && rules[RULE_FILE] == NULL) {
+		hashmap_remove(data->cfgfiles, cfgfile->path, strlen(cfgfile->path));
+		free(cfgfile->path);
+		free(cfgfile);
+	}
+}
+
+
+// This function will load all config files found in the specified path.
+// The config details will be examined to determine the actions that need to happen, and are added to a master config structure.
+static void process_config_dir(maindata_t *data, const char *configpath)
+{
+	assert(data);
+	assert(configpath);
+
+	// make sure that we already have a reference to the INOTIFY API.
+	assert(data->infd >= 0);
+	
+	size_t pathlen = strlen(configpath);
+	assert(pathlen > 0);
+	
+	// open the directory.
+	DIR *d = opendir(configpath);
+	if (d) {
+		struct dirent *dir;
+		
+		while ((dir = readdir(d)) != NULL)
+		{
+			assert(dir);
+			assert(dir->d_name);
+			
+			// if the filename does NOT start with a '.', then we will process it.
+			// Note this means config files can be disabled by putting '.' in front of the filename as per standard practice.
+			if (dir->d_name[0] != '.') {
+				// build the filepath to the config file.
+				char *filepath = malloc(pathlen + 1 + strlen(dir->d_name) + 2);
+				assert(filepath);
+				sprintf(filepath, "%s/%s", configpath, dir->d_name);
+				assert(filepath);
+				assert(strlen(filepath) > 0);
+				logger_write(data->logger, LOGGER_INFO, "Config file: %s", filepath);
+				load_config_file(data, filepath);
+				free(filepath);
+			}
+		}
+
+		closedir(d);
+		
+		// watch the directory, so that any changes to the config files in it are applied straight away.
+		if (data->cfgdircount < MAX_CONFIG_DIRS) {
+			int wd = inotify_add_watch(data->cfgfd, configpath, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR);
+			if (wd == -1) {
+				watch_failed(data->logger, &data->watchlimit, configpath, errno);
+			}
+			else {
+				data->cfgdirs[data->cfgdircount].wd = wd;
+				data->cfgdirs[data->cfgdircount].path = strdup(configpath);
+				assert(data->cfgdirs[data->cfgdircount].path);
+				data->cfgdircount ++;
+			}
+		}
+	}
+}
+
+
+
+// Give all the events collected for a rule to a single run of the batch action.
+// The records are written to a memfd rather than a pipe, so that the daemon never has to wait for the action to read them, no matter how many there are.
+static void batch_flush(batch_t *batch)
+{
+	assert(batch);
+	assert(batch->data);
+	assert(batch->rule);
+	
+	maindata_t *data = batch->data;
+	rule_t *rule = batch->rule;
+	
+	if (batch->timer) {
+		timer_cancel(data->timers, batch->timer);
+		batch->timer = NULL;
+	}
+	
+	if (batch->count == 0) {
+		return;
+	}
+	
+	int fd = memfd_create("fileknock-batch", MFD_CLOEXEC);
+	if (fd < 0) {
+		logger_write(data->logger, LOGGER_ERROR, "Unable to create the input for batch action '%s', %s", rule->batchExec, strerror(errno));
+	}
+	else {
+		size_t done = 0;
+		while (done < batch->length) {
+			ssize_t written = write(fd, batch->buffer + done, batch->length - done);
+			if (written < 0) {
+				if (errno == EINTR) { continue; }
+				break;
+			}
+			done += written;
+		}
+		
+		if (done < batch->length || lseek(fd, 0, SEEK_SET) != 0) {
+			logger_write(data->logger, LOGGER_ERROR, "Unable to write the input for batch action '%s', %s", rule->batchExec, strerror(errno));
+			close(fd);
+		}
+		else {
+			logger_write(data->logger, LOGGER_INFO, "Batch of %d events for %s", batch->count, rule->path ? rule->path : rule->file);
+			executor_submit(data->executor, rule->group, rule->batchTemplate, rule->path ? rule->path : rule->file, NULL, "BATCH", NULL, fd);
+		}
+	}
+	
+	batch->length = 0;
+	batch->count = 0;
+}
+
+
+static void batch_timeout(void *arg)
+{
+	batch_t *batch = arg;
+	assert(batch);
+	
+	// the timer has already been freed.
+	batch->timer = NULL;
+	batch_flush(batch);
+}
+
+
+// add a field to the batch buffer, followed by the separator.
+static void batch_append(batch_t *batch, const char *field, char separator)
+{
+	assert(batch);
+	assert(field);
+	
+	size_t len = strlen(field);
+	if (batch->length + len + 1 > batch->size) {
+		while (batch->length + len + 1 > batch->size) {
+			batch->size = batch->size ? batch->size * 2 : 4096;
+		}
+		batch->buffer = realloc(batch->buffer, batch->size);
+		assert(batch->buffer);
+	}
+	memcpy(batch->buffer + batch->length, field, len);
+	batch->buffer[batch->length + len] = separator;
+	batch->length += len + 1;
+}
+
+
+// add an event to the batch for a rule.  Each record is the path, the file, the action and the time (seconds since the epoch) of the event.
+// For the 'line' format the fields are separated by tabs and the record ends with a newline.  For the 'nul' format, every field ends with a NUL.
+static void batch_event(batch_t *batch, const char *path, const char *name, const char *action)
+{
+	assert(batch);
+	assert(path);
+	assert(action);
+	
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	char stamp[32];
+	snprintf(stamp, sizeof(stamp), "%lld.%09ld", (long long) ts.tv_sec, ts.tv_nsec);
+	
+	char fieldsep = batch->separator == '\n' ? '\t' : '\0';
+	batch_append(batch, path, fieldsep);
+	batch_append(batch, name ? name : "", fieldsep);
+	batch_append(batch, action, fieldsep);
+	batch_append(batch, stamp, batch->separator);
+	batch->count ++;
+	
+	if (batch->count >= batch->max) {
+		batch_flush(batch);
+	}
+	else if (batch->timer == NULL) {
+		batch->timer = timer_add(batch->data->timers, timers_now() + batch->latency, batch_timeout, batch);
+	}
+}
+
+
+// take back the built-in actions that have been done.
+static void handle_file_actions(maindata_t *data)
+{
+	assert(data);
+	assert(data->fileworkers);
+	
+	fileaction_t *action;
+	while ((action = workers_next(data->fileworkers)) != NULL) {
+		assert(data->fileactions > 0);
+		data->fileactions --;
+		
+		if (action->error) {
+			static LOGLIMIT limit = LOGLIMIT_INIT;
+			logger_limited(data->logger, &limit, 10, LOGGER_ERROR, "Unable to perform action '%s' for '%s', %s", fileop_spec(action->op), action->path, strerror(action->error));
+		}
+		release_rule(data, action->rule);
+		free(action->path);
+		free(action);
+	}
+}
+
+
+// give a built-in action to one of the threads.  The actions for a file always go to the same one, so they are done in order.
+static void file_action(maindata_t *data, rule_t *rule, FILEOP op, const char *path, const char *name, const char *event)
+{
+	assert(data);
+	assert(data->fileworkers);
+	assert(rule);
+	assert(op);
+	assert(path);
+	
+	if (data->dryrun) {
+		logger_write(data->logger, LOGGER_INFO, "Action (dry run).  Action='%s', Path='%s', File='%s', Event='%s'", fileop_spec(op), path, name ? name : "", event);
+		return;
+	}
+	
+	fileaction_t *action = calloc(1, sizeof(fileaction_t));
+	assert(action);
+	action->rule = rule;
+	rule->refs ++;
+	action->op = op;
+	action->path = malloc(strlen(path) + 1 + (name ? strlen(name) : 0) + 1);
+	assert(action->path);
+	if (name) {
+		sprintf(action->path, "%s/%s", path, name);
+	}
+	else {
+		strcpy(action->path, path);
+	}
+	
+	int worker = (int) (hashmap_hash(action->path, strlen(action->path)) % workers_count(data->fileworkers));
+	if (workers_push(data->fileworkers, worker, action) != 0) {
+		// the thread is full, and it could be waiting for us to take back the actions it has done.
+		handle_file_actions(data);
+		if (workers_push(data->fileworkers, worker, action) != 0) {
+			// it is still busy (eg, copying a large file).  As with the actions the executor runs, it is dropped rather than holding up the events.
+			static LOGLIMIT limit = LOGLIMIT_INIT;
+			logger_limited(data->logger, &limit, 10, LOGGER_WARNING, "Built-in action queue is full, dropping action '%s' for '%s'", fileop_spec(op), action->path);
+			metrics_add(data->metrics, data->m_fileops_dropped, 1);
+			release_rule(data, action->rule);
+			free(action->path);
+			free(action);
+			return;
+		}
+	}
+	data->fileactions ++;
+}
+
+
+// Perform the actions of a rule for a file.  
+// 'path' is the directory that was being watched, and 'name' is the file within it.  If it is a file that is being watched, then there is no name.
+// 'hash' is the hash of the contents of the file (NULL if it wasn't needed).
+static void run_actions(maindata_t *data, rule_t *rule, const char *path, const char *name, uint32_t mask, const char *hash)
+{
+	assert(data);
+	assert(rule);
+	assert(path);
+	assert(rule->path || rule->file);
+	
+// 	if (mask & IN_OPEN)			printf("IN_OPEN: ");
+// 	if (mask & IN_CLOSE_NOWRITE)	printf("IN_CLOSE_NOWRITE: ");
+// 	if (mask & IN_CLOSE_WRITE)	printf("IN_CLOSE_WRITE: ");
+	
+	// FK_ACTION tells the action what happened to the file.
+	const char *action = (mask & IN_CLOSE_WRITE) ? "CLOSED_WRITE" : "CLOSED";
+	
+	if (((mask & IN_CLOSE_WRITE) || (mask & IN_CLOSE_NOWRITE)) && rule->closedExec) {
+		// action is triggered whenever a file is closed for either reading or writing.
+		executor_submit(data->executor, rule->group, rule->closedTemplate, path, name, action, hash, -1);
+	}
+	
+	if ((mask & IN_CLOSE_WRITE) && rule->closedWriteExec) {
+		// action is triggered whenever a file is closed for writing.
+		executor_submit(data->executor, rule->group, rule->closedWriteTemplate, path, name, action, hash, -1);
+	}
+	
+	if (((mask & IN_CLOSE_WRITE) || (mask & IN_CLOSE_NOWRITE)) && rule->closedOp) {
+		file_action(data, rule, rule->closedOp, path, name, action);
+	}
+	
+	if ((mask & IN_CLOSE_WRITE) && rule->closedWriteOp) {
+		file_action(data, rule, rule->closedWriteOp, path, name, action);
+	}
+	
+	if (((mask & IN_CLOSE_WRITE) || (mask & IN_CLOSE_NOWRITE)) && rule->sink) {
+		if (data->dryrun) {
+			logger_write(data->logger, LOGGER_INFO, "Publish (dry run).  Sink='%s', Path='%s', File='%s', Event='%s'", eventsink_spec(rule->sink->sink), path, name ? name : "", action);
+		}
+		else {
+			eventsink_publish(rule->sink->sink, realtime_ns(), action, path, name);
+		}
+	}
+	
+	if (((mask & IN_CLOSE_WRITE) || (mask & IN_CLOSE_NOWRITE)) && rule->batch) {
+		// the event is held until there are enough of them (or they have waited long enough), and then they are all given to one run of the action.
+		batch_event(rule->batch, path, name, action);
+	}
+	
+	if (name) {
+		logger_write(data->logger, LOGGER_INFO, "%s/%s", path, name);
+	}
+	else {
+		logger_write(data->logger, LOGGER_INFO, "%s", path);
+	}
+}
+
+
+
+// the length of the hash of a file's contents, as text (16 hex digits).
+#define HASH_TEXT		17
+
+// the number of events that can be waiting for each dispatcher thread (and waiting to be taken back from it).
+#define DISPATCH_QUEUE	4096
+
+// With dispatcher threads, an event is given to one of them, and it is handed back to the main thread once it has been filtered and 
+// debounced.  A reference is held on the rule until then.
+typedef struct {
+	rule_t *rule;
+	char *path;
+	char *name;
+	uint32_t mask;
+	int fire;				// set by the dispatcher when the actions are to be performed (otherwise it was filtered out, merged with another, or unchanged).
+	char hash[HASH_TEXT];	// the hash of the contents, if the rule needed it.
+} dispatch_t;
+
+
+// When a rule has a debounce window, the events for a file are collected here until the file has been quiet for the window.
+typedef struct {
+	maindata_t *data;
+	int worker;				// the dispatcher that it is on (-1 for the main thread).
+	dispatch_t *dispatch;	// on a dispatcher, the first event is held, and handed back when the window has passed.
+	rule_t *rule;
+	char *path;
+	char *name;
+	uint32_t mask;			// all the events that have been collected.
+	long long first;		// when the first event was collected.
+	TIMER timer;
+	char *key;
+	size_t keylen;
+} pending_t;
+
+
+static HASHMAP pending_map(maindata_t *data, int worker)
+{
+	assert(data);
+	return(worker < 0 ? data->pending : data->dispatchpending[worker]);
+}
+
+
+static TIMERS pending_timers(maindata_t *data, int worker)
+{
+	assert(data);
+	return(worker < 0 ? data->timers : workers_timers(data->dispatchers, worker));
+}
+
+
+// For a rule that only acts on changes, check whether the contents of the file are different from when it was last checked (for the rule).
+// Returns 0 if they are the same.  'hash' is set to the hash of the contents as text (or is empty if it was not needed).
+// 'worker' is the dispatcher this is running on (-1 for the main thread).  A file always goes to the same dispatcher, so each has its own cache.
+static int content_changed(maindata_t *data, int worker, rule_t *rule, const char *path, const char *name, char *hash)
+{
+	assert(data);
+	assert(rule);
+	assert(path);
+	assert(hash);
+	
+	hash[0] = 0;
+	if (rule->contentonly == 0) {
+		return(1);
+	}
+	
+	size_t pathlen = strlen(path);
+	size_t namelen = name ? strlen(name) : 0;
+	char key[sizeof(rule) + pathlen + 1 + namelen + 1];
+	memcpy(key, &rule, sizeof(rule));
+	char *full = key + sizeof(rule);
+	if (name) {
+		sprintf(full, "%s/%s", path, name);
+	}
+	else {
+		strcpy(full, path);
+	}
+	
+	uint64_t value;
+	int changed = fingerprints_check(data->fingerprints[worker < 0 ? 0 : worker], key, sizeof(rule) + strlen(full), full, &value);
+	if (changed < 0) {
+		// it could not be read (eg, it has already been removed), so we cannot tell.  The actions are performed, as they would have been without the check.
+		return(1);
+	}
+	snprintf(hash, HASH_TEXT, "%016llx", (unsigned long long) value);
+	if (changed == 0) {
+		metrics_add(data->metrics, data->m_unchanged, 1);
+	}
+	return(changed);
+}
+
+
+// Whether the actions are to be performed for a file, now that its events have been through the debounce window (if there is one).
+// The conditions of the rule must be true (a file that cannot be looked at any more is not acted on), and for the rules that only act 
+// on changes, the contents must have changed.  The conditions are checked first, as they are cheaper than reading the file.
+static int should_fire(maindata_t *data, int worker, rule_t *rule, const char *path, const char *name, char *hash)
+{
+	assert(data);
+	assert(rule);
+	assert(path);
+	assert(hash);
+	
+	if (rule->condition) {
+		char full[strlen(path) + 1 + (name ? strlen(name) : 0) + 1];
+		if (name) { sprintf(full, "%s/%s", path, name); }
+		else { strcpy(full, path); }
+		if (condition_match(rule->condition, full) <= 0) {
+			hash[0] = 0;
+			metrics_add(data->metrics, data->m_unmet, 1);
+			return(0);
+		}
+	}
+	return(content_changed(data, worker, rule, path, name, hash));
+}
+
+
+static void pending_fire(void *arg)
+{
+	pending_t *pending = arg;
+	assert(pending);
+	
+	maindata_t *data = pending->data;
+	assert(data);
+	
+	// the timer has already been freed.
+	pending->timer = NULL;
+	
+	void *removed = hashmap_remove(pending_map(data, pending->worker), pending->key, pending->keylen);
+	assert(removed == pending);
+	
+	char hash[HASH_TEXT];
+	int changed = should_fire(data, pending->worker, pending->rule, pending->path, pending->name, hash);
+	
+	if (pending->dispatch) {
+		// the actions are performed on the main thread.
+		pending->dispatch->mask = pending->mask;
+		pending->dispatch->fire = changed;
+		strcpy(pending->dispatch->hash, hash);
+		workers_done(data->dispatchers, pending->worker, pending->dispatch);
+	}
+	else {
+		if (changed) {
+			run_actions(data, pending->rule, pending->path, pending->name, pending->mask, hash[0] ? hash : NULL);
+		}
+		release_rule(data, pending->rule);
+	}
+	
+	free(pending->key);
+	free(pending->path);
+	if (pending->name) { free(pending->name); }
+	free(pending);
+}
+
+
+// collect an event for a rule that has a debounce window.  The actions will be performed when no events have been received for the file
+// for the length of the window, or when the maximum latency is reached, whichever comes first.
+// 'worker' is the dispatcher this is running on (-1 for the main thread).  Returns the new entry if there were no events waiting for the 
+// file yet (the caller is to give it a reference on the rule, or the event), or NULL if the event was added to the ones waiting.
+static pending_t * debounce_event(maindata_t *data, int worker, rule_t *rule, const char *path, const char *name, uint32_t mask)
+{
+	assert(data);
+	assert(rule);
+	assert(rule->debounce > 0);
+	assert(path);
+	
+	// the key is the rule, and the full path of the file.
+	size_t pathlen = strlen(path);
+	size_t namelen = name ? strlen(name) : 0;
+	size_t keylen = sizeof(rule) + pathlen + 1 + namelen;
+	char *key = malloc(keylen);
+	assert(key);
+	memcpy(key, &rule, sizeof(rule));
+	memcpy(key + sizeof(rule), path, pathlen);
+	key[sizeof(rule) + pathlen] = '/';
+	if (namelen > 0) {
+		memcpy(key + sizeof(rule) + pathlen + 1, name, namelen);
+	}
+	
+	long long now = timers_now();
+	HASHMAP map = pending_map(data, worker);
+	TIMERS timers = pending_timers(data, worker);
+	
+	pending_t *pending = hashmap_get(map, key, keylen);
+	if (pending) {
+		// there are already events waiting for this file, so push back when it will fire (but not past the maximum latency).
+		free(key);
+		pending->mask |= mask;
+		
+		long long when = now + rule->debounce;
+		if (rule->debouncemax > 0 && when > pending->first + rule->debouncemax) {
+			when = pending->first + rule->debouncemax;
+		}
+		timer_move(timers, pending->timer, when);
+		return(NULL);
+	}
+	else {
+		pending = calloc(1, sizeof(pending_t));
+		assert(pending);
+		pending->data = data;
+		pending->worker = worker;
+		pending->rule = rule;
+		pending->path = strdup(path);
+		assert(pending->path);
+		if (name) {
+			pending->name = strdup(name);
+			assert(pending->name);
+		}
+		pending->mask = mask;
+		pending->first = now;
+		pending->key = key;
+		pending->keylen = keylen;
+		pending->timer = timer_add(timers, now + rule->debounce, pending_fire, pending);
+		
+		hashmap_set(map, key, keylen, pending);
+		return(pending);
+	}
+}
+
+
+// events for files that the rule is not interested in are dropped before anything else is done with them.  Returns 0 if it is dropped.
+static int accept_event(maindata_t *data, rule_t *rule, const char *name)
+{
+	assert(data);
+	assert(rule);
+	
+	if (name && rule->filter && filter_match(rule->filter, name) == 0) {
+		metrics_add(data->metrics, data->m_dropped, 1);
+		return(0);
+	}
+	metrics_add(data->metrics, data->m_matched, 1);
+	return(1);
+}
+
+
+// An event that has been given to a dispatcher.  It is running on the dispatcher's thread, so it only filters and debounces the event.  
+// The event is handed back to the main thread for the actions to be performed (or for the reference on the rule to be released).
+static void dispatch_cb(WORKERS workers, int worker, void *item, void *arg)
+{
+	dispatch_t *dispatch = item;
+	maindata_t *data = arg;
+	assert(dispatch);
+	assert(data);
+	
+	rule_t *rule = dispatch->rule;
+	assert(rule);
+	
+	if (accept_event(data, rule, dispatch->name)) {
+		if (rule->debounce > 0) {
+			pending_t *pending = debounce_event(data, worker, rule, dispatch->path, dispatch->name, dispatch->mask);
+			if (pending) {
+				// it is held until the window has passed.
+				pending->dispatch = dispatch;
+				return;
+			}
+		}
+		else {
+			dispatch->fire = should_fire(data, worker, rule, dispatch->path, dispatch->name, dispatch->hash);
+		}
+	}
+	
+	workers_done(workers, worker, dispatch);
+}
+
+
+// take back the events that the dispatchers have finished with, and perform the actions for them.
+static void handle_dispatched(maindata_t *data)
+{
+	assert(data);
+	assert(data->dispatchers);
+	
+	dispatch_t *dispatch;
+	while ((dispatch = workers_next(data->dispatchers)) != NULL) {
+		assert(data->dispatched > 0);
+		data->dispatched --;
+		
+		if (dispatch->fire) {
+			run_actions(data, dispatch->rule, dispatch->path, dispatch->name, dispatch->mask, dispatch->hash[0] ? dispatch->hash : NULL);
+		}
+		release_rule(data, dispatch->rule);
+		
+		free(dispatch->path);
+		if (dispatch->name) { free(dispatch->name); }
+		free(dispatch);
+	}
+}
+
+
+// give an event to a dispatcher.  The events for a file always go to the same one, so that they are kept in order.
+static void dispatch_event(maindata_t *data, rule_t *rule, const char *path, uint32_t mask, const char *name)
+{
+	assert(data);
+	assert(data->dispatchers);
+	assert(rule);
+	assert(path);
+	
+	dispatch_t *dispatch = calloc(1, sizeof(dispatch_t));
+	assert(dispatch);
+	dispatch->rule = rule;
+	rule->refs ++;
+	dispatch->path = strdup(path);
+	assert(dispatch->path);
+	if (name) {
+		dispatch->name = strdup(name);
+		assert(dispatch->name);
+	}
+	dispatch->mask = mask;
+	
+	unsigned long long hash = hashmap_hash(path, strlen(path));
+	if (name) {
+		hash = (hash * 31) ^ hashmap_hash(name, strlen(name));
+	}
+	int worker = (int) (hash % workers_count(data->dispatchers));
+	
+	while (workers_push(data->dispatchers, worker, dispatch) != 0) {
+		// the dispatcher is full, and it could be waiting for us to take back the events it has finished with.
+		handle_dispatched(data);
+		sched_yield();
+	}
+	data->dispatched ++;
+}
+
+
+// A file that is open, for the rules that wait for everything to close it.
+typedef struct {
+	int opens;			// the opens that have not been closed yet.
+	uint32_t closes;	// the close events since it was first opened.
+} openfile_t;
+
+
+static void free_openfile_cb(void *value, void *arg)
+{
+	free(value);
+}
+
+
+// forget about all the files that are open.  Used when events have been lost, as the counts can no longer be trusted.
+static void reset_open_files(maindata_t *data)
+{
+	assert(data);
+	if (data->openfiles && hashmap_count(data->openfiles) > 0) {
+		hashmap_foreach(data->openfiles, free_openfile_cb, NULL);
+		hashmap_free(data->openfiles);
+		data->openfiles = hashmap_new();
+		assert(data->openfiles);
+		metrics_set(data->metrics, data->m_openfiles, 0);
+	}
+}
+
+
+// Whether anything has the file open for writing.  A read lease cannot be taken on a file while it is, and the kernel knows for certain.
+// Returns 1 if it is, 0 if it isn't, or -1 if it cannot be told (leases are only allowed on our own files, or with CAP_LEASE, and not all
+// filesystems have them).  Opening the file causes events of its own, but only an open and a close that did not write.
+static int open_for_writing(const char *path)
+{
+	assert(path);
+	
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+	if (fd < 0) {
+		return(-1);
+	}
+	int result = 0;
+	if (fcntl(fd, F_SETLEASE, F_RDLCK) != 0) {
+		result = (errno == EAGAIN) ? 1 : -1;
+	}
+	else {
+		// it is let go of straight away.  Anything that opens it for writing in the meantime breaks the lease, which sends us SIGIO (ignored).
+		fcntl(fd, F_SETLEASE, F_UNLCK);
+	}
+	close(fd);
+	return(result);
+}
+
+
+// For the rules that wait for everything to close a file, the opens and closes of each file are counted, and the actions are only 
+// performed when the last one is closed.  inotify does not say whether a file was opened for writing, so the readers are counted as well.
+// Returns the close events (all of them since the file was first opened) that the actions are to be performed for, or 0 if it is still open.
+// This is done on the main thread (before the events are given to any dispatchers), as the events for a file must be counted in order.
+static uint32_t writers_closed(maindata_t *data, rule_t *rule, const char *path, const char *name, uint32_t mask)
+{
+	assert(data);
+	assert(rule);
+	assert(rule->allclosed);
+	assert(path);
+	
+	if (name && rule->filter && filter_match(rule->filter, name) == 0) {
+		// it would not be acted on anyway, so it is not worth keeping track of.
+		return(0);
+	}
+	
+	// only a hash of the rule and the path is kept, so that each file uses the same (small) amount of memory.
+	uint64_t key = fingerprint_hash(&rule, sizeof(rule), 0);
+	key = fingerprint_hash(path, strlen(path), key);
+	if (name) { key = fingerprint_hash(name, strlen(name), key); }
+	
+	openfile_t *file = hashmap_get(data->openfiles, &key, sizeof(key));
+	if (mask & IN_OPEN) {
+		if (file == NULL) {
+			if (hashmap_count(data->openfiles) >= data->maxopenfiles) {
+				// when it is closed, it will be treated as if nothing else has it open.
+				return(0);
+			}
+			file = calloc(1, sizeof(openfile_t));
+			assert(file);
+			hashmap_set(data->openfiles, &key, sizeof(key), file);
+			metrics_set(data->metrics, data->m_openfiles, hashmap_count(data->openfiles));
+		}
+		file->opens ++;
+	}
+	
+	uint32_t closes = mask & IN_CLOSE;
+	if (closes == 0) {
+		return(0);
+	}
+	
+	// a file that was opened before we were watching it (or when there were too many) is not known about, so there is nothing to wait for.
+	int stillopen = 0;
+	if (file) {
+		file->closes |= closes;
+		file->opens --;
+		stillopen = (file->opens > 0);
+		closes = file->closes;
+	}
+	
+	if (rule->confirmclosed) {
+		char full[strlen(path) + 1 + (name ? strlen(name) : 0) + 1];
+		if (name) { sprintf(full, "%s/%s", path, name); }
+		else { strcpy(full, path); }
+		
+		// The counts are not always right.  inotify merges an event with the one before it if they are the same and neither has been read
+		// (so two opens, or two closes, can arrive as one), and anything that opened the file before we were watching it was not counted.
+		// So when a writer closes it, the kernel is asked whether any others still have it open.  This is only done for the rules that 
+		// only want the closes after writing, as the open that it needs is followed by a close of its own.
+		int writers = -1;
+		if ((mask & IN_CLOSE_WRITE) && (rule->allclosed & IN_CLOSE_NOWRITE) == 0) {
+			writers = open_for_writing(full);
+		}
+		if (writers == 0) {
+			stillopen = 0;
+		}
+		else if (writers < 0 && stillopen == 0 && data->readtime > 0) {
+			// it cannot be asked, so if it has been written to since the close was read, then something that was not counted is still writing it.
+			struct statx stx;
+			if (statx(AT_FDCWD, full, AT_STATX_DONT_SYNC, STATX_MTIME, &stx) == 0 && (stx.stx_mask & STATX_MTIME)) {
+				long long mtime = ((long long) stx.stx_mtime.tv_sec * 1000000000LL) + stx.stx_mtime.tv_nsec;
+				if (mtime > data->readtime) {
+					writers = 1;
+				}
+			}
+		}
+		
+		if (writers > 0) {
+			// it will be acted on when that writer closes it (which may not have been counted, so it is counted now).
+			stillopen = 1;
+			if (file == NULL && hashmap_count(data->openfiles) < data->maxopenfiles) {
+				file = calloc(1, sizeof(openfile_t));
+				assert(file);
+				file->closes = closes;
+				hashmap_set(data->openfiles, &key, sizeof(key), file);
+				metrics_set(data->metrics, data->m_openfiles, hashmap_count(data->openfiles));
+			}
+			if (file && file->opens <= 0) {
+				file->opens = 1;
+			}
+		}
+	}
+	
+	if (stillopen) {
+		metrics_add(data->metrics, data->m_stillopen, 1);
+		return(0);
+	}
+	
+	if (file) {
+		void *removed = hashmap_remove(data->openfiles, &key, sizeof(key));
+		assert(removed == file);
+		free(file);
+		metrics_set(data->metrics, data->m_openfiles, hashmap_count(data->openfiles));
+	}
+	return(closes & rule->allclosed);
+}
+
+
+// An event has occurred that may need the actions of the rule to be performed.
+// 'path' is the directory, and 'name' is the file within it that the event is for.   If it is a file that is being watched, then there is no name.
+static void trigger_rule(maindata_t *data, rule_t *rule, const char *path, uint32_t mask, const char *name)
+{
+	assert(data);
+	assert(rule);
+	assert(path);
+	
+	if (name && name[0] == 0) { name = NULL; }
+	
+	if (rule->allclosed) {
+		mask = writers_closed(data, rule, path, name, mask);
+		if (mask == 0) {
+			return;
+		}
+	}
+	
+	if (data->dispatchers) {
+		dispatch_event(data, rule, path, mask, name);
+		return;
+	}
+	
+	if (accept_event(data, rule, name) == 0) {
+		return;
+	}
+	
+	if (rule->debounce > 0) {
+		if (debounce_event(data, -1, rule, path, name, mask)) {
+			rule->refs ++;
+		}
+	}
+	else {
+		char hash[HASH_TEXT];
+		if (should_fire(data, -1, rule, path, name, hash)) {
+			run_actions(data, rule, path, name, mask, hash[0] ? hash : NULL);
+		}
+	}
+}
+
+
+// An event has occurred on a watch.
+static void trigger_actions(maindata_t *data, watch_t *watch, uint32_t mask, const char *name)
+{
+	assert(data);
+	assert(watch);
+	assert(watch->rule);
+	trigger_rule(data, watch->rule, watch->path, mask, name);
+}
+
+
+// process a single event from the inotify API.
+static void process_event(maindata_t *data, const struct inotify_event *event)
+{
+	assert(data);
+	assert(event);
+	assert(event->wd >= 0);
+	
+	if ((event->mask & IN_IGNORED) && data->replay) {
+		// when replaying, the watches that were removed are in the recording.
+		return;
+	}
+	
+	if (event->mask & IN_IGNORED) {
+		// The kernel has removed the watch (the directory was deleted, or the filesystem unmounted), so everything subscribed to it needs to be removed as well.
+		int count = 0;
+		watch_t **matches;
+		while ((matches = (watch_t **) wdindex_get(data->wdindex, event->wd, &count)) != NULL) {
+			assert(count > 0);
+			remove_watch(data, matches[0], 0);
+		}
+		return;
+	}
+
+	// get the list of watches that are subscribed to this watch-descriptor.  
+	// Note that processing an event can add or remove watches (which can move the list), so the list is fetched again for each one.
+	int count = 0;
+	int i = 0;
+	watch_t **matches;
+	if (wdindex_get(data->wdindex, event->wd, &count) == NULL) {
+		// an event that was already queued for a watch that has since been removed.
+		metrics_add(data->metrics, data->m_dropped, 1);
+		return;
+	}
+	while ((matches = (watch_t **) wdindex_get(data->wdindex, event->wd, &count)) != NULL && i < count) {
+		assert(matches[i]);
+		watch_t *watch = matches[i];
+		assert(watch->wd == event->wd);
+		assert(watch->rule);
+		i ++;
+		
+		if (watch->rule->recursive && (event->mask & IN_ISDIR)) {
+			// a directory within a tree that we are watching has changed.
+			if (event->len == 0) {
+				// this is the watched directory itself (ie, IN_DELETE_SELF).  The kernel will follow this with IN_IGNORED.
+				continue;
+			}
+			
+			if (data->replay) {
+				// as above, the changes to the watches for the tree are in the recording.
+				continue;
+			}
+			
+			char *subpath = malloc(strlen(watch->path) + 1 + strlen(event->name) + 1);
+			assert(subpath);
+			sprintf(subpath, "%s/%s", watch->path, event->name);
+			
+			if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+				add_subtree(data, watch->rule, subpath, 1);
+			}
+			else if (event->mask & IN_MOVED_FROM) {
+				remove_subtree(data, watch->rule, subpath);
+			}
+			
+			free(subpath);
+		}
+		else if ((event->mask & watch->rule->mask & IN_CLOSE) || ((event->mask & watch->rule->mask & IN_OPEN) && (event->mask & IN_ISDIR) == 0)) {
+			// the kernel watch can be shared with other rules that want other events, so only the ones this rule wants are passed on.
+			trigger_actions(data, watch, event->mask & watch->rule->mask, event->len ? event->name : NULL);
+		}
+	}
+}
+
+
+
+// The filesystem timestamps can lag behind the clock by a tick, so a file is treated as changed if its time is this close to the cutoff.
+#define RESCAN_MARGIN_NS	(20 * 1000000LL)
+
+
+static long long realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return((ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+}
+
+
+// A file that was found in a watched directory during a rescan.
+typedef struct {
+	watch_t *watch;
+	char *name;
+	off_t size;
+	long long mtime;
+} rescanfile_t;
+
+
+// The worker threads of the walk only read 'dirs', and everything they find is collected under the lock, to be compared once the walk has finished.
+typedef struct {
+	rule_t *rule;
+	HASHMAP dirs;		// the watches of the rule, keyed on their path.
+	
+	pthread_mutex_t lock;
+	rescanfile_t *files;
+	int filecount;
+	int filesize;
+	watch_t **visited;	// the watched directories that were listed.
+	int visitedcount;
+	int visitedsize;
+	char **missing;		// directories in the tree that are not being watched (their create events were lost).
+	int missingcount;
+	int missingsize;
+} rescan_t;
+
+
+static int rescan_dir(const char *path, void *arg)
+{
+	rescan_t *rescan = arg;
+	assert(rescan);
+	assert(path);
+	
+	watch_t *watch = hashmap_get(rescan->dirs, path, strlen(path));
+	if (watch == NULL && rescan->rule->recursive == 0) {
+		// a sub-directory of a path that is not being watched recursively.
+		return(0);
+	}
+	
+	pthread_mutex_lock(&rescan->lock);
+	if (watch) {
+		if (rescan->visitedcount >= rescan->visitedsize) {
+			rescan->visitedsize = rescan->visitedsize > 0 ? rescan->visitedsize * 2 : 64;
+			rescan->visited = realloc(rescan->visited, sizeof(watch_t *) * rescan->visitedsize);
+			assert(rescan->visited);
+		}
+		rescan->visited[rescan->visitedcount ++] = watch;
+	}
+	else {
+		// this directory (and everything below it) will get new watches once the walk has finished, which will also find the files in it.
+		if (rescan->missingcount >= rescan->missingsize) {
+			rescan->missingsize = rescan->missingsize > 0 ? rescan->missingsize * 2 : 16;
+			rescan->missing = realloc(rescan->missing, sizeof(char *) * rescan->missingsize);
+			assert(rescan->missing);
+		}
+		rescan->missing[rescan->missingcount] = strdup(path);
+		assert(rescan->missing[rescan->missingcount]);
+		rescan->missingcount ++;
+	}
+	pthread_mutex_unlock(&rescan->lock);
+	
+	return(watch != NULL);
+}
+
+
+static void rescan_file(const char *dirpath, const char *name, unsigned char type, void *arg)
+{
+	rescan_t *rescan = arg;
+	assert(rescan);
+	assert(dirpath);
+	assert(name);
+	
+	if (type != DT_REG) {
+		return;
+	}
+	
+	watch_t *watch = hashmap_get(rescan->dirs, dirpath, strlen(dirpath));
+	assert(watch);
+	
+	char path[strlen(dirpath) + 1 + strlen(name) + 1];
+	sprintf(path, "%s/%s", dirpath, name);
+	struct stat sb;
+	if (lstat(path, &sb) != 0 || S_ISREG(sb.st_mode) == 0) {
+		return;
+	}
+	
+	char *copy = strdup(name);
+	assert(copy);
+	
+	pthread_mutex_lock(&rescan->lock);
+	if (rescan->filecount >= rescan->filesize) {
+		rescan->filesize = rescan->filesize > 0 ? rescan->filesize * 2 : 256;
+		rescan->files = realloc(rescan->files, sizeof(rescanfile_t) * rescan->filesize);
+		assert(rescan->files);
+	}
+	rescanfile_t *file = &rescan->files[rescan->filecount ++];
+	file->watch = watch;
+	file->name = copy;
+	file->size = sb.st_size;
+	file->mtime = (sb.st_mtim.tv_sec * 1000000000LL) + sb.st_mtim.tv_nsec;
+	pthread_mutex_unlock(&rescan->lock);
+}
+
+
+// Compare a file with what was found for it by the last rescan, and move it into the new snapshot.  
+// Returns non-zero if it could have changed without the events for it being read.
+static int snapshot_compare(HASHMAP old, HASHMAP snapshot, const char *name, off_t size, long long mtime, long long cutoff)
+{
+	assert(snapshot);
+	assert(name);
+	
+	size_t namelen = strlen(name);
+	snapentry_t *entry = old ? hashmap_remove(old, name, namelen) : NULL;
+	int changed;
+	if (entry && entry->size == size && entry->mtime == mtime) {
+		// nothing has changed since the last rescan (which could have been after the cutoff, if the queue keeps overflowing).
+		changed = 0;
+	}
+	else {
+		// any change from before the cutoff would have had its event read.
+		changed = mtime > cutoff;
+	}
+	
+	if (entry == NULL) {
+		entry = malloc(sizeof(snapentry_t));
+		assert(entry);
+	}
+	entry->size = size;
+	entry->mtime = mtime;
+	hashmap_set(snapshot, name, namelen, entry);
+	
+	return(changed);
+}
+
+
+// Look through everything watched by a rule for files that have changed since the cutoff, and perform the actions for them.
+// Returns the number of files found.
+static int rescan_rule(maindata_t *data, rule_t *rule, long long cutoff)
+{
+	assert(data);
+	assert(rule);
+	
+	int found = 0;
+	
+	if (rule->file) {
+		// a single file being watched directly.
+		watch_t *watch = rule->watches;
+		struct stat sb;
+		if (watch && stat(watch->path, &sb) == 0) {
+			HASHMAP old = watch->snapshot;
+			watch->snapshot = hashmap_new();
+			assert(watch->snapshot);
+			if (snapshot_compare(old, watch->snapshot, "", sb.st_size, (sb.st_mtim.tv_sec * 1000000000LL) + sb.st_mtim.tv_nsec, cutoff)) {
+				synthesize_close(data, watch, NULL);
+				found ++;
+			}
+			if (old) { free_snapshot(old); }
+		}
+		return(found);
+	}
+	
+	assert(rule->path);
+	
+	rescan_t rescan;
+	memset(&rescan, 0, sizeof(rescan));
+	rescan.rule = rule;
+	rescan.dirs = hashmap_new();
+	assert(rescan.dirs);
+	pthread_mutex_init(&rescan.lock, NULL);
+	
+	watch_t *watch;
+	for (watch = rule->watches; watch; watch = watch->rulenext) {
+		hashmap_set(rescan.dirs, watch->path, strlen(watch->path), watch);
+	}
+	
+	// a single directory is not worth starting threads for.
+	if (rule->watches) {
+		treewalk(rule->path, rule->recursive ? data->rescanthreads : 1, rescan_dir, rescan_file, &rescan);
+	}
+	
+	// each directory that was listed gets a new snapshot, and anything left in the old one has been removed.
+	HASHMAP snapshots = hashmap_new();
+	assert(snapshots);
+	int i;
+	for (i=0; i < rescan.visitedcount; i++) {
+		watch = rescan.visited[i];
+		HASHMAP snapshot = hashmap_new();
+		assert(snapshot);
+		hashmap_set(snapshots, &watch, sizeof(watch), snapshot);
+	}
+	for (i=0; i < rescan.filecount; i++) {
+		rescanfile_t *file = &rescan.files[i];
+		HASHMAP snapshot = hashmap_get(snapshots, &file->watch, sizeof(file->watch));
+		assert(snapshot);
+		if (snapshot_compare(file->watch->snapshot, snapshot, file->name, file->size, file->mtime, cutoff)) {
+			synthesize_close(data, file->watch, file->name);
+			found ++;
+		}
+		free(file->name);
+	}
+	for (i=0; i < rescan.visitedcount; i++) {
+		watch = rescan.visited[i];
+		if (watch->snapshot) { free_snapshot(watch->snapshot); }
+		watch->snapshot = hashmap_get(snapshots, &watch, sizeof(watch));
+		assert(watch->snapshot);
+	}
+	hashmap_free(snapshots);
+	
+	// directories that have gone away, where the IN_IGNORED for them was lost as well.
+	watch = rule->watches;
+	while (watch) {
+		watch_t *next = watch->rulenext;
+		struct stat sb;
+		if (stat(watch->path, &sb) != 0 || S_ISDIR(sb.st_mode) == 0) {
+			remove_watch(data, watch, 1);
+		}
+		watch = next;
+	}
+	
+	// directories created in the tree that we did not see.  All the files in them are new to us.
+	for (i=0; i < rescan.missingcount; i++) {
+		add_subtree(data, rule, rescan.missing[i], 1);
+		free(rescan.missing[i]);
+	}
+	
+	if (rescan.files) { free(rescan.files); }
+	if (rescan.visited) { free(rescan.visited); }
+	if (rescan.missing) { free(rescan.missing); }
+	hashmap_free(rescan.dirs);
+	pthread_mutex_destroy(&rescan.lock);
+	
+	return(found);
+}
+
+
+static void rescan_config_cb(void *value, void *arg)
+{
+	configfile_t *cfgfile = value;
+	void **args = arg;
+	maindata_t *data = args[0];
+	int *found = args[1];
+	assert(cfgfile);
+	
+	int kind;
+	for (kind=0; kind < RULE_KINDS; kind++) {
+		if (cfgfile->rules[kind]) {
+			*found += rescan_rule(data, cfgfile->rules[kind], data->rescancutoff);
+		}
+	}
+}
+
+
+// The inotify queue overflowed, so some events have been lost.  Everything being watched is checked for files that have changed since 
+// the queue was last empty, and the actions are performed for them.  A file that did have its events read can have its actions performed 
+// again, but none are missed.
+static void rescan_watches(void *arg)
+{
+	maindata_t *data = arg;
+	assert(data);
+	
+	data->rescantimer = NULL;
+	long long start = realtime_ns();
+	
+	// rescanning can add and remove watches, but not rules.
+	int found = 0;
+	void *args[] = { data, &found };
+	hashmap_foreach(data->cfgfiles, rescan_config_cb, args);
+	
+	long long elapsed = (realtime_ns() - start) / 1000;
+	data->lastrescan = timers_now();
+	metrics_add(data->metrics, data->m_rescans, 1);
+	metrics_add(data->metrics, data->m_rescan_found, found);
+	metrics_record(data->metrics, data->m_rescan_us, elapsed);
+	logger_write(data->logger, LOGGER_INFO, "Rescanned the watched paths after the event queue overflowed, %d changed files found in %lld us", found, elapsed);
+}
+
+
+// Arrange for everything to be rescanned once the queue has been emptied.  If it overflows again before then, the earliest cutoff is kept.
+static void schedule_rescan(maindata_t *data)
+{
+	assert(data);
+	
+	if (data->replay) {
+		// the files that a rescan found are in the recording.
+		return;
+	}
+	
+	if (data->rescantimer == NULL) {
+		data->rescancutoff = data->drained - RESCAN_MARGIN_NS;
+		long long when = data->lastrescan > 0 ? data->lastrescan + data->rescaninterval : 0;
+		if (when < timers_now()) { when = timers_now(); }
+		data->rescantimer = timer_add(data->timers, when, rescan_watches, data);
+		assert(data->rescantimer);
+	}
+}
+
+
+
+// process the events from a single read of the inotify fd (or a record of one).  Returns the number of events.
+static int process_buffer(maindata_t *data, const char *buf, ssize_t len)
+{
+	assert(data);
+	assert(buf);
+	
+	const struct inotify_event *event;
+	int events = 0;
+	const char *ptr;
+	for (ptr = buf; ptr + sizeof(struct inotify_event) <= buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+
+		event = (const struct inotify_event *) ptr;
+		assert(event);
+		events ++;
+		
+		if (event->mask & IN_Q_OVERFLOW) {
+			// the kernel queue was full, and events have been lost.
+			static LOGLIMIT limit = LOGLIMIT_INIT;
+			logger_limited(data->logger, &limit, 1, LOGGER_WARNING, "The inotify event queue has overflowed, events have been lost (see /proc/sys/fs/inotify/max_queued_events)");
+			metrics_add(data->metrics, data->m_overflow, 1);
+			reset_open_files(data);
+			schedule_rescan(data);
+			continue;
+		}
+		
+		assert(event->wd >= 0);
+		process_event(data, event);
+	}
+	
+	metrics_add(data->metrics, data->m_events, events);
+	metrics_record(data->metrics, data->m_per_read, events);
+	return(events);
+}
+
+
+// The read buffer starts at the size that fits a few events, and doubles (up to the maximum) whenever a read fills it, so that a burst 
+// of events takes fewer reads.  Once the reads have been small for a while, it halves again.
+#define READ_BUFFER_MIN		4096
+#define READ_BUFFER_MAX		(1024 * 1024)
+#define READ_SHRINK_AFTER	1000
+#define MAX_EVENT_SIZE		(sizeof(struct inotify_event) + NAME_MAX + 1)
+
+
+static void resize_read_buffer(maindata_t *data, size_t size)
+{
+	assert(data);
+	assert(size >= READ_BUFFER_MIN && size <= READ_BUFFER_MAX);
+	
+	// malloc() gives memory that is aligned for any type, which includes struct inotify_event.
+	if (data->readbuf) { free(data->readbuf); }
+	data->readbuf = malloc(size);
+	assert(data->readbuf);
+	data->readsize = size;
+	data->smallreads = 0;
+	metrics_set(data->metrics, data->m_read_buffer, size);
+}
+
+
+// process what a read of the inotify fd returned, and size the buffer for the next read.  Returns the number of events.
+static int consume_events(maindata_t *data, ssize_t len)
+{
+	assert(data);
+	assert(len > 0);
+	
+	if (data->record) {
+		eventlog_write(data->record, REC_EVENTS, data->readbuf, len, NULL, 0);
+	}
+
+	// the events all happened before now, so anything changed after this was changed after them.
+	data->readtime = realtime_ns();
+	int events = process_buffer(data, data->readbuf, len);
+	
+	// the buffer is only changed after the events in it have been processed.
+	if ((size_t) len + MAX_EVENT_SIZE > data->readsize && data->readsize < READ_BUFFER_MAX) {
+		resize_read_buffer(data, data->readsize * 2);
+	}
+	else if ((size_t) len < data->readsize / 8 && data->readsize > READ_BUFFER_MIN) {
+		data->smallreads ++;
+		if (data->smallreads >= READ_SHRINK_AFTER) {
+			resize_read_buffer(data, data->readsize / 2);
+		}
+	}
+	else {
+		data->smallreads = 0;
+	}
+	return(events);
+}
+
+
+// Read all available inotify events and process them.  'total' is the number of events already processed since the last wait.
+static void handle_events(maindata_t *data, int total)
+{
+	assert(data);
+	assert(data->readbuf);
+	
+	// Loop while events can be read from inotify file descriptor.
+	// note, code inside will force a break from the loop when there is nothing more to process.
+	for (;;) {
+
+		// Read some events.  If there are none, then the queue was empty at this time, and everything before it has been read.
+		assert(data->infd);
+		long long before = realtime_ns();
+		ssize_t len = read(data->infd, data->readbuf, data->readsize);
+		if (len == -1 && errno != EAGAIN) {
+			logger_write(data->logger, LOGGER_ERROR, "read: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		// If the nonblocking read() found no events to read, then it returns -1 with errno set to EAGAIN. In that case, we exit the loop.
+		if (len <= 0) {
+			assert(errno == EAGAIN);
+			data->drained = before;
+			break;
+		}
+		
+		total += consume_events(data, len);
+	}
+	
+	metrics_record(data->metrics, data->m_per_wakeup, total);
+}
+
+
+
+// used to find the rules for an event from fanotify.
+typedef struct {
+	maindata_t *data;
+	const char *dir;
+	const char *name;
+	uint32_t mask;
+} fanevent_t;
+
+
+static void fan_rule_cb(void *value, int depth, void *arg)
+{
+	rule_t *rule = value;
+	fanevent_t *event = arg;
+	assert(rule);
+	assert(event);
+	
+	uint32_t mask = event->mask & rule->mask;
+	if (mask == 0) {
+		return;
+	}
+	
+	if (rule->file) {
+		// the rule is kept under the directory the file is in, so the name of the file needs to match as well.
+		const char *slash = strrchr(rule->file, '/');
+		if (depth == 0 && event->name && strcmp(slash ? slash + 1 : rule->file, event->name) == 0) {
+			trigger_rule(event->data, rule, rule->file, mask, NULL);
+		}
+	}
+	else if (depth == 0 || rule->recursive) {
+		trigger_rule(event->data, rule, event->dir, mask, event->name);
+	}
+}
+
+
+static void fan_event_cb(const char *dir, const char *name, uint32_t mask, void *arg)
+{
+	maindata_t *data = arg;
+	assert(data);
+	
+	if (dir == NULL) {
+		// the queue is unlimited, so this shouldn't happen.
+		logger_write(data->logger, LOGGER_WARNING, "The fanotify event queue has overflowed, events have been lost");
+		metrics_add(data->metrics, data->m_overflow, 1);
+		reset_open_files(data);
+		return;
+	}
+	data->readtime = realtime_ns();
+	
+	// the events are for everything on the filesystem, most will not be for any of the rules.
+	fanevent_t event;
+	event.data = data;
+	event.dir = dir;
+	event.name = name;
+	event.mask = mask;
+	pathtrie_match(data->monitors, dir, fan_rule_cb, &event);
+}
+
+
+// Read all the available events from fanotify and process them.
+static void handle_fan_events(maindata_t *data)
+{
+	assert(data);
+	assert(data->fanwatch);
+	
+	int events = fanwatch_read(data->fanwatch, fan_event_cb, data);
+	if (events < 0) {
+		logger_write(data->logger, LOGGER_ERROR, "fanotify read: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
-	assert(data->infd >= 0);
+	metrics_add(data->metrics, data->m_events, events);
+	metrics_record(data->metrics, data->m_per_wakeup, events);
+}
+
+
+
+// used to find the rule that a record in a recording is for.
+typedef struct {
+	const char *target;
+	int recursive;
+	rule_t *rule;
+} findrule_t;
+
+
+static void find_rule_cb(void *value, void *arg)
+{
+	configfile_t *cfgfile = value;
+	findrule_t *find = arg;
+	assert(cfgfile);
+	assert(find);
+	
+	int kind;
+	for (kind=0; kind < RULE_KINDS && find->rule == NULL; kind++) {
+		rule_t *rule = cfgfile->rules[kind];
+		if (rule && rule->recursive == find->recursive && strcmp(rule->path ? rule->path : rule->file, find->target) == 0) {
+			find->rule = rule;
+		}
+	}
+}
+
+
+// process a record from the recording being replayed.
+static void replay_record(maindata_t *data, uint32_t type, const void *buf, size_t len)
+{
+	assert(data);
+	assert(buf);
+	
+	if (type == REC_EVENTS) {
+		int events = process_buffer(data, buf, len);
+		metrics_record(data->metrics, data->m_per_wakeup, events);
+		return;
+	}
+	
+	if (len < sizeof(recwatch_t) + 1) {
+		return;
+	}
+	
+	// the strings are always terminated (see eventlog_read()), but there might only be one of them.
+	const recwatch_t *rec = buf;
+	findrule_t find;
+	find.target = (const char *) buf + sizeof(recwatch_t);
+	find.recursive = rec->recursive;
+	find.rule = NULL;
+	size_t targetlen = strlen(find.target) + 1;
+	const char *str = sizeof(recwatch_t) + targetlen < len ? find.target + targetlen : NULL;
+	
+	hashmap_foreach(data->cfgfiles, find_rule_cb, &find);
+	if (find.rule == NULL) {
+		// the rule is not in the config that is being used for the replay.
+		return;
+	}
+	
+	watch_t *watch = find_watch(data, find.rule, rec->wd);
+	if (type == REC_WATCH && watch == NULL && str) {
+		new_watch(data, find.rule, rec->wd, str);
+	}
+	else if (type == REC_UNWATCH && watch) {
+		remove_watch(data, watch, 0);
+	}
+	else if (type == REC_TRIGGER && watch && str) {
+		trigger_actions(data, watch, rec->mask, str);
+	}
+}
+
+
+// process the records of the recording that are due.  When replaying as fast as possible, a limited number are processed at a time, 
+// so that the actions that have finished can still be reaped in between.
+static void replay_step(maindata_t *data)
+{
+	assert(data);
+	assert(data->replay);
+	
+	int done = 0;
+	while (done < 64) {
+		if (data->replayheld == 0) {
+			int result = eventlog_read(data->replay, &data->heldtype, &data->heldtime, &data->helddata, &data->heldlen);
+			if (result <= 0) {
+				if (result < 0) {
+					logger_write(data->logger, LOGGER_ERROR, "The recording is damaged, stopping the replay.");
+				}
+				data->replaydue = -1;
+				return;
+			}
+			data->replayheld = 1;
+		}
+		
+		long long due = data->replaystart + (data->heldtime / 1000000LL);
+		if (data->replayfast == 0 && due > timers_now()) {
+			data->replaydue = due;
+			return;
+		}
+		
+		data->replayheld = 0;
+		replay_record(data, data->heldtype, data->helddata, data->heldlen);
+		done ++;
+	}
+	
+	data->replaydue = timers_now();
+}
+
+
+static void count_batched(void *value, void *arg)
+{
+	configfile_t *cfgfile = value;
+	int *count = arg;
+	int kind;
+	for (kind=0; kind < RULE_KINDS; kind++) {
+		if (cfgfile->rules[kind] && cfgfile->rules[kind]->batch) {
+			*count += cfgfile->rules[kind]->batch->count;
+		}
+	}
+}
+
+
+// returns non-zero when the replay has finished, and everything that it triggered has run.
+static int replay_finished(maindata_t *data)
+{
+	assert(data);
+	if (data->replay == NULL || data->replaydue >= 0 || hashmap_count(data->pending) > 0 || data->dispatched > 0 || data->fileactions > 0 || executor_idle(data->executor) == 0) {
+		return(0);
+	}
+	int batched = 0;
+	hashmap_foreach(data->cfgfiles, count_batched, &batched);
+	return(batched == 0);
+}
+
+
+
+// Something has changed in one of the config directories.
+static void handle_config_events(maindata_t *data)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+
+	assert(data);
+	assert(data->cfgfd >= 0);
+	
+	for (;;) {
+		ssize_t len = read(data->cfgfd, buf, sizeof(buf));
+		if (len <= 0) {
+			break;
+		}
+
+		char *ptr;
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *) ptr;
+			
+			// files starting with '.' are ignored, the same as when the directory is first loaded (this also skips the swap files of most editors).
+			if (event->len == 0 || event->name[0] == '.') {
+				continue;
+			}
+			
+			int i;
+			for (i=0; i < data->cfgdircount; i++) {
+				if (data->cfgdirs[i].wd == event->wd) {
+					char *filepath = malloc(strlen(data->cfgdirs[i].path) + 1 + strlen(event->name) + 1);
+					assert(filepath);
+					sprintf(filepath, "%s/%s", data->cfgdirs[i].path, event->name);
+					
+					// a file that has been written or moved in is loaded again, and one that has been removed or moved out is unloaded.
+					// Either way load_config_file() works out what has changed.
+					struct timespec start, end;
+					clock_gettime(CLOCK_MONOTONIC, &start);
+					logger_write(data->logger, LOGGER_INFO, "Config file changed: %s", filepath);
+					load_config_file(data, filepath);
+					clock_gettime(CLOCK_MONOTONIC, &end);
+					logger_write(data->logger, LOGGER_INFO, "Config file applied in %lld us: %s", 
+						(((long long) end.tv_sec - start.tv_sec) * 1000000LL) + ((end.tv_nsec - start.tv_nsec) / 1000), filepath);
+					
+					free(filepath);
+				}
+			}
+		}
+	}
+}
+
+
+// While the system is busy (tasks stalled waiting for the cpu or io for more than the threshold), the limits on the actions are halved 
+// each time the pressure is looked at, down to 1%.  Once it is below the threshold again, they are eased back up, 10% at a time.
+// The actions that are held back wait in the queue, they are not dropped (unless the queue fills up).
+static void check_pressure(void *arg)
+{
+	maindata_t *data = arg;
+	assert(data);
+	assert(data->pressurecount > 0);
+	
+	int worst = 0;
+	int i;
+	for (i=0; i < data->pressurecount; i++) {
+		int pct = pressure_sample(data->pressure[i]);
+		if (pct >= 0) {
+			metrics_set(data->metrics, data->m_pressure[i], pct);
+			if (pct > worst) { worst = pct; }
+		}
+	}
+	
+	int throttle = data->throttle;
+	if (worst > data->pressurethreshold) {
+		throttle = throttle / 2;
+		if (throttle < 1) { throttle = 1; }
+	}
+	else if (throttle < 100) {
+		throttle = throttle + 10;
+		if (throttle > 100) { throttle = 100; }
+	}
+	if (throttle != data->throttle) {
+		if (throttle < data->throttle && data->throttle == 100) {
+			logger_write(data->logger, LOGGER_WARNING, "The system is busy (%d%% stalled), slowing down the actions.", worst);
+		}
+		else if (throttle == 100) {
+			logger_write(data->logger, LOGGER_INFO, "The system is no longer busy, the actions are back to full speed.");
+		}
+		data->throttle = throttle;
+		executor_throttle(data->executor, throttle);
+	}
+	timer_add(data->timers, timers_now() + data->pressureinterval, check_pressure, data);
+}
+
+
+// the messages that did not fit in the logger's ring.
+static void update_log_metrics(maindata_t *data)
+{
+	assert(data);
+	metrics_set(data->metrics, data->m_log_dropped, logger_dropped(data->logger));
+}
+
+
+static void add_sink_metrics(void *value, void *arg)
+{
+	sink_t *sink = value;
+	long long *totals = arg;
+	assert(sink);
+	assert(totals);
+	totals[0] += eventsink_subscribers(sink->sink);
+	totals[1] += eventsink_sent(sink->sink);
+	totals[2] += eventsink_dropped(sink->sink);
+}
+
+
+// the subscribers of the event sinks, and what has been sent to them (for the sinks that are open).
+static void update_sink_metrics(maindata_t *data)
+{
+	assert(data);
+	long long totals[3] = { 0, 0, 0 };
+	hashmap_foreach(data->sinks, add_sink_metrics, totals);
+	metrics_set(data->metrics, data->m_sink_subscribers, totals[0]);
+	metrics_set(data->metrics, data->m_sink_published, totals[1]);
+	metrics_set(data->metrics, data->m_sink_dropped, totals[2]);
+}
+
+
+// write the metrics to the stats file, and set the timer to do it again.
+static void save_stats(void *arg)
+{
+	maindata_t *data = arg;
+	assert(data);
+	assert(data->statsfile);
 	
-	// first we need to look in the directory locations for the config files.
-	process_config_dir(data, "/etc/fileknock.d");
-	process_config_dir(data, "/opt/fileknock/etc/fileknock.d");
-	process_config_dir(data, "/usr/local/etc/fileknock.d");
-	process_config_dir(data, "./fileknock.d");
+	update_log_metrics(data);
+	update_sink_metrics(data);
+	if (metrics_save(data->metrics, data->statsfile) != 0) {
+		logger_write(data->logger, LOGGER_ERROR, "Unable to write the stats file '%s', %s", data->statsfile, strerror(errno));
+	}
+	timer_add(data->timers, timers_now() + data->statsinterval, save_stats, data);
+}
 
 
-	// Now that we have read in all the config, and setup all the watches, we need to poll the interface to know when changes have occurred.	
-	assert(data->infd);
-	nfds_t nfds = 1;
-	struct pollfd fds[nfds];
-	fds[0].fd = data->infd;
-	fds[0].events = POLLIN;
+// SIGUSR1 has been received, so the metrics are written out.
+static void handle_signal(maindata_t *data)
+{
+	assert(data);
+	
+	struct signalfd_siginfo info;
+	while (read(data->sigfd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGUSR1) {
+			update_log_metrics(data);
+			update_sink_metrics(data);
+			logger_flush(data->logger);
+			metrics_write(data->metrics, stdout);
+			fflush(stdout);
+			if (data->statsfile) {
+				metrics_save(data->metrics, data->statsfile);
+			}
+		}
+	}
+}
+
+
+// set the timerfd to go off when the next timer expires (or disarm it if there are no timers).
+static void arm_timers(maindata_t *data)
+{
+	assert(data);
+	assert(data->timerfd >= 0);
+	
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	
+	long long next = timers_next(data->timers);
+	if (next >= 0) {
+		// a value of zero would disarm the timer, so make sure anything already expired still goes off.
+		if (next == 0) { next = 1; }
+		its.it_value.tv_sec = next / 1000;
+		its.it_value.tv_nsec = (next % 1000) * 1000000;
+	}
+	
+	timerfd_settime(data->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+// the timerfd has gone off, so fire all the timers that have expired.
+static void handle_timers(maindata_t *data)
+{
+	assert(data);
+	
+	uint64_t expirations;
+	if (read(data->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		logger_write(data->logger, LOGGER_ERROR, "read timerfd: %s", strerror(errno));
+	}
+	
+	timers_run(data->timers, timers_now());
+}
+
+
+
+// The things that the main loop waits on.  This is their order in the poll list, and they are also the tags of the polls in the ring.
+#define SRC_EVENTS		0		// inotify (or fanotify).
+#define SRC_TIMERS		1
+#define SRC_CHILDREN	2		// actions that have finished.
+#define SRC_HELPER		3		// the spawn helper.
+#define SRC_CONFIG		4		// the config directories.
+#define SRC_SIGNAL		5
+#define SRC_DISPATCH	6		// events handed back by the dispatcher threads.
+#define SRC_FILEOPS		7		// built-in actions that have been done.
+#define SOURCES			8
+
+// the tag for a read of the inotify fd in the ring.
+#define TAG_READ		SOURCES
+
+
+// the file-descriptor for each of the sources, or -1 if there isn't one.  The spawn helper can go away, in which case its socket will have been closed.
+static int source_fd(maindata_t *data, int source)
+{
+	assert(data);
+	switch (source) {
+		case SRC_EVENTS:	return(data->replay ? -1 : (data->fanwatch ? fanwatch_fd(data->fanwatch) : data->infd));
+		case SRC_TIMERS:	return(data->timerfd);
+		case SRC_CHILDREN:	return(executor_fd(data->executor));
+		case SRC_HELPER:	return(executor_helper_fd(data->executor));
+		case SRC_CONFIG:	return(data->cfgfd);
+		case SRC_SIGNAL:	return(data->sigfd);
+		case SRC_DISPATCH:	return(data->dispatchers ? workers_fd(data->dispatchers) : -1);
+		case SRC_FILEOPS:	return(data->fileworkers ? workers_fd(data->fileworkers) : -1);
+	}
+	assert(0);
+	return(-1);
+}
+
+
+// One of the sources is ready.
+static void handle_source(maindata_t *data, int source, short revents)
+{
+	assert(data);
+	
+	if (source == SRC_EVENTS && (revents & POLLIN)) {
+		// Inotify (or fanotify) events are available
+		if (data->fanwatch) {
+			handle_fan_events(data);
+		}
+		else {
+			handle_events(data, 0);
+		}
+	}
+	else if (source == SRC_TIMERS && (revents & POLLIN)) {
+		// timers have expired.
+		handle_timers(data);
+	}
+	else if (source == SRC_CHILDREN && (revents & POLLIN)) {
+		// actions have finished.
+		executor_reap(data->executor);
+	}
+	else if (source == SRC_HELPER && revents) {
+		// the spawn helper has started actions, or they have finished.
+		executor_helper_read(data->executor);
+	}
+	else if (source == SRC_CONFIG && (revents & POLLIN)) {
+		// the config files have changed.
+		handle_config_events(data);
+	}
+	else if (source == SRC_SIGNAL && (revents & POLLIN)) {
+		handle_signal(data);
+	}
+	else if (source == SRC_DISPATCH && (revents & POLLIN)) {
+		handle_dispatched(data);
+	}
+	else if (source == SRC_FILEOPS && (revents & POLLIN)) {
+		handle_file_actions(data);
+	}
+}
+
+
+// How long to wait for something to happen.  When replaying a recording, it is until the next record is due, otherwise it is until there is activity.
+static int loop_timeout(maindata_t *data)
+{
+	assert(data);
+	if (data->replay && data->replaydue >= 0) {
+		long long wait = data->replaydue - timers_now();
+		return(wait > 0 ? (int) wait : 0);
+	}
+	return(-1);
+}
+
+
+// Done after everything that was ready has been handled.  Returns 0 when the loop should stop.
+static int end_round(maindata_t *data)
+{
+	assert(data);
+	
+	// processing the events or the timers could have changed when the next timer is due.
+	arm_timers(data);
+	
+	if (replay_finished(data)) {
+		logger_write(data->logger, LOGGER_INFO, "Replay finished.");
+		update_log_metrics(data);
+		update_sink_metrics(data);
+		logger_flush(data->logger);
+		metrics_write(data->metrics, stdout);
+		return(0);
+	}
+	return(1);
+}
+
+
+static void poll_loop(maindata_t *data)
+{
+	assert(data);
+	
+	struct pollfd fds[SOURCES];
+	int i;
+	for (i=0; i < SOURCES; i++) {
+		fds[i].fd = source_fd(data, i);
+		fds[i].events = POLLIN;
+	}
 
 	int keeprunning = 1;
 	while (keeprunning == 1) {
-		// poll for API activity. Note that we are using '-1' as a timeout, this will block and not return until there is activity.
-		int poll_num = poll(fds, nfds, -1);
+		// poll for API activity.
+		int poll_num = poll(fds, SOURCES, loop_timeout(data));
 		if (poll_num == -1) {
 			if (errno == EINTR) {
 				keeprunning = 0;
 			}
 			else {
-				fprintf(stderr, "Unexpected error occured while polling for INOTIFY API activity.");
+				logger_write(data->logger, LOGGER_ERROR, "Unexpected error occured while polling for INOTIFY API activity.");
 			}
 		}
 		else {
-			// we have some activity.
-			assert(poll_num == 1);
+			// we have some activity (or it is time for more of the recording).
+			assert(poll_num > 0 || data->replay);
+			
+			if (data->replay && data->replaydue >= 0 && data->replaydue <= timers_now()) {
+				replay_step(data);
+			}
+			
+			for (i=0; i < SOURCES; i++) {
+				if (fds[i].revents) {
+					handle_source(data, i, fds[i].revents);
+				}
+			}
 			
-			if (fds[0].revents & POLLIN) {
-				// Inotify events are available
-				assert(data);
-				handle_events(data);
+			// the spawn helper can go away, and the file action threads can be started when the config is reloaded.
+			fds[SRC_HELPER].fd = source_fd(data, SRC_HELPER);
+			fds[SRC_FILEOPS].fd = source_fd(data, SRC_FILEOPS);
+			keeprunning = end_round(data);
+		}
+	}
+}
+
+
+// The same as poll_loop(), but with an io_uring.  The inotify fd is read through the ring, so when events arrive, they have already been 
+// read when the wait returns.  The other sources are polled through the ring, so they are all waited for (and re-armed) in the same system call.
+static void ring_loop(maindata_t *data, URING ring)
+{
+	assert(data);
+	assert(ring);
+	
+	// the fd that each source is armed with in the ring (or -1 when it isn't).
+	int armed[SOURCES];
+	int i;
+	for (i=0; i < SOURCES; i++) {
+		armed[i] = -1;
+	}
+	
+	// the inotify fd is read directly, unless the kernel doesn't wait for it to be readable (in which case it is polled like the others).
+	int readdirect = (source_fd(data, SRC_EVENTS) == data->infd);
+	long long readqueued = 0;
+
+	int keeprunning = 1;
+	while (keeprunning == 1) {
+		for (i=0; i < SOURCES; i++) {
+			int fd = source_fd(data, i);
+			if (fd >= 0 && armed[i] != fd) {
+				if (i == SRC_EVENTS && readdirect) {
+					readqueued = realtime_ns();
+					uring_read(ring, fd, data->readbuf, data->readsize, TAG_READ);
+				}
+				else {
+					uring_poll(ring, fd, POLLIN, i);
+				}
+				armed[i] = fd;
+			}
+		}
+		
+		if (uring_wait(ring, loop_timeout(data)) != 0) {
+			if (errno == EINTR) {
+				keeprunning = 0;
 			}
+			else {
+				logger_write(data->logger, LOGGER_ERROR, "Unexpected error occured while waiting for activity (%s).", strerror(errno));
+			}
+			continue;
+		}
+		
+		if (data->replay && data->replaydue >= 0 && data->replaydue <= timers_now()) {
+			replay_step(data);
+		}
+		
+		uint64_t tag;
+		int result;
+		while (uring_next(ring, &tag, &result)) {
+			if (tag == TAG_READ) {
+				armed[SRC_EVENTS] = -1;
+				if (result == -EAGAIN) {
+					readdirect = 0;
+				}
+				else if (result < 0) {
+					errno = -result;
+					logger_write(data->logger, LOGGER_ERROR, "read: %s", strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+				else if (result > 0) {
+					// If there was room left in the buffer for another event, the read emptied the queue.  
+					// It was done no earlier than when it was queued, so everything before then has been read.
+					int full = ((size_t) result + MAX_EVENT_SIZE > data->readsize);
+					int events = consume_events(data, result);
+					if (full) {
+						handle_events(data, events);
+					}
+					else {
+						data->drained = readqueued;
+						metrics_record(data->metrics, data->m_per_wakeup, events);
+					}
+				}
+			}
+			else {
+				assert(tag < SOURCES);
+				armed[tag] = -1;
+				if (result > 0) {
+					handle_source(data, (int) tag, (short) result);
+				}
+			}
+		}
+		
+		keeprunning = end_round(data);
+	}
+}
+
+
+static void free_sink_cb(void *value, void *arg)
+{
+	sink_t *sink = value;
+	assert(sink);
+	eventsink_free(sink->sink);
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [--record FILE] [--replay FILE [--fast] [--dry-run]]\n", name);
+	fprintf(stderr, "  --record FILE   write all the inotify events (and changes to the watches) to FILE.\n");
+	fprintf(stderr, "  --replay FILE   process the events from a recording instead of inotify, at the speed they were recorded.\n");
+	fprintf(stderr, "  --fast          replay the events as fast as possible.\n");
+	fprintf(stderr, "  --dry-run       do not run the actions, only print them.\n");
+	exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv)
+{
+	// we create a structure that will contain all the major config that we need to use.
+	maindata_t *data = calloc(1, sizeof(maindata_t));
+	assert(data->watchcount == 0);
+	assert(data->watches == NULL);
+	
+	data->wdindex = wdindex_new();
+	assert(data->wdindex);
+
+	// the timers use the monotonic clock, so the timerfd needs to use the same one.
+	data->timers = timers_new();
+	assert(data->timers);
+	data->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (data->timerfd == -1) {
+		perror("timerfd_create");
+		exit(EXIT_FAILURE);
+	}
+	data->pending = hashmap_new();
+	assert(data->pending);
+	data->kwatches = hashmap_new();
+	assert(data->kwatches);
+	
+	const char *recordpath = NULL;
+	const char *replaypath = NULL;
+	int dryrun = 0;
+	struct option options[] = {
+		{ "record", required_argument, NULL, 'r' },
+		{ "replay", required_argument, NULL, 'p' },
+		{ "fast", no_argument, NULL, 'f' },
+		{ "dry-run", no_argument, NULL, 'n' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (opt) {
+			case 'r': recordpath = optarg; break;
+			case 'p': replaypath = optarg; break;
+			case 'f': data->replayfast = 1; break;
+			case 'n': dryrun = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind < argc || (recordpath && replaypath)) {
+		usage(argv[0]);
+	}
+	if (recordpath) {
+		data->record = eventlog_create(recordpath);
+		if (data->record == NULL) {
+			perror(recordpath);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (replaypath) {
+		data->replay = eventlog_open(replaypath);
+		if (data->replay == NULL) {
+			fprintf(stderr, "Unable to open the recording '%s'\n", replaypath);
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	const char *configpath = NULL;
+	data->config = load_daemon_config(&configpath);
+	
+	// The messages are written out by a thread of the logger, so a slow reader of the output does not hold up the events.
+	// If there is no LogFile, the text is written to stdout (and the warnings and errors to stderr).
+	int loglevel = logger_level(setting_get(data, "LogLevel", "info"));
+	int logformat = logger_format(setting_get(data, "LogFormat", "text"));
+	const char *logfile = setting_get(data, "LogFile", NULL);
+	int logfd = -1;
+	if (logfile) {
+		logfd = open(logfile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (logfd < 0) {
+			perror(logfile);
+			exit(EXIT_FAILURE);
+		}
+	}
+	data->logger = logger_new(logfd, loglevel < 0 ? LOGGER_INFO : loglevel, logformat < 0 ? LOGGER_TEXT : logformat, setting_long(data, "LogBufferEntries", 4096));
+	if (data->logger == NULL) {
+		perror("logger");
+		exit(EXIT_FAILURE);
+	}
+	if (loglevel < 0) {
+		logger_write(data->logger, LOGGER_WARNING, "Unknown LogLevel '%s', using info", setting_get(data, "LogLevel", ""));
+	}
+	if (logformat < 0) {
+		logger_write(data->logger, LOGGER_WARNING, "Unknown LogFormat '%s', using text", setting_get(data, "LogFormat", ""));
+	}
+	if (configpath) {
+		logger_write(data->logger, LOGGER_INFO, "Daemon config file: %s", configpath);
+	}
+	if (recordpath) {
+		logger_write(data->logger, LOGGER_INFO, "Recording events to: %s", recordpath);
+	}
+	if (replaypath) {
+		logger_write(data->logger, LOGGER_INFO, "Replaying events from: %s", replaypath);
+	}
+	
+	// the metrics for the event loop.  Everything else registers its own.
+	data->metrics = metrics_new();
+	assert(data->metrics);
+	data->m_events = metrics_counter(data->metrics, "events.read");
+	data->m_matched = metrics_counter(data->metrics, "events.matched");
+	data->m_dropped = metrics_counter(data->metrics, "events.dropped");
+	data->m_overflow = metrics_counter(data->metrics, "events.overflow");
+	data->m_per_read = metrics_histogram(data->metrics, "events.per_read");
+	data->m_per_wakeup = metrics_histogram(data->metrics, "events.per_wakeup");
+	data->m_rescans = metrics_counter(data->metrics, "events.rescans");
+	data->m_rescan_found = metrics_counter(data->metrics, "events.rescan_found");
+	data->m_rescan_us = metrics_histogram(data->metrics, "events.rescan_us");
+	data->m_read_buffer = metrics_gauge(data->metrics, "events.read_buffer");
+	data->m_watches = metrics_gauge(data->metrics, "watches.rules");
+	data->m_kwatches = metrics_gauge(data->metrics, "watches.kernel");
+	data->m_fileops = metrics_counter(data->metrics, "actions.builtin");
+	data->m_fileops_failed = metrics_counter(data->metrics, "actions.builtin_failed");
+	data->m_fileops_dropped = metrics_counter(data->metrics, "actions.builtin_dropped");
+	data->m_unchanged = metrics_counter(data->metrics, "events.unchanged");
+	data->m_unmet = metrics_counter(data->metrics, "events.condition_false");
+	data->m_stillopen = metrics_counter(data->metrics, "events.still_open");
+	data->m_openfiles = metrics_gauge(data->metrics, "files.open");
+	data->m_log_dropped = metrics_gauge(data->metrics, "log.dropped");
+	data->m_sink_subscribers = metrics_gauge(data->metrics, "sink.subscribers");
+	data->m_sink_published = metrics_gauge(data->metrics, "sink.published");
+	data->m_sink_dropped = metrics_gauge(data->metrics, "sink.dropped");
+	resize_read_buffer(data, READ_BUFFER_MIN);
+	
+	// When the inotify queue overflows, the watched paths are rescanned to find the files that changed.  A tree is walked with this many 
+	// threads (0 to use one for each CPU), and it is not done more often than the interval, even if the queue keeps overflowing.
+	data->rescanthreads = setting_long(data, "RescanThreads", 4);
+	data->rescaninterval = setting_long(data, "RescanIntervalMs", 1000);
+	
+	// The executor limits the number of actions that can be running at the same time, and queues the rest.  When the queue is full, actions are dropped.
+	int policy = executor_policy(setting_get(data, "QueueOverflow", "drop-new"));
+	if (policy < 0) {
+		logger_write(data->logger, LOGGER_WARNING, "Unknown QueueOverflow policy '%s', using drop-new", setting_get(data, "QueueOverflow", ""));
+		policy = EXEC_DROP_NEW;
+	}
+	data->executor = executor_new(data->timers, 
+		setting_long(data, "MaxConcurrentActions", 64), 
+		setting_long(data, "MaxQueuedActions", 10000), 
+		policy, 
+		setting_long(data, "ActionTimeout", 0) * 1000);
+	assert(data->executor);
+	executor_metrics(data->executor, data->metrics);
+	executor_logger(data->executor, data->logger);
+	executor_rate(data->executor, setting_long(data, "MaxActionsPerSec", 0), setting_long(data, "Burst", 0));
+	
+	// The actions can be slowed down while the system is busy, rather than adding to it.
+	data->throttle = 100;
+	data->pressurethreshold = setting_long(data, "PressureThreshold", 0);
+	data->pressureinterval = setting_long(data, "PressureIntervalMs", 1000);
+	if (data->pressurethreshold > 0 && data->pressureinterval > 0 && data->replay == NULL) {
+		const char *resources[] = { "cpu", "io" };
+		int i;
+		for (i=0; i < 2; i++) {
+			PRESSURE pressure = pressure_new(resources[i]);
+			if (pressure == NULL) {
+				logger_write(data->logger, LOGGER_WARNING, "Unable to read the %s pressure (%s)", resources[i], strerror(errno));
+				continue;
+			}
+			char name[32];
+			sprintf(name, "pressure.%s_pct", resources[i]);
+			data->m_pressure[data->pressurecount] = metrics_gauge(data->metrics, name);
+			data->pressure[data->pressurecount ++] = pressure;
+		}
+		if (data->pressurecount > 0) {
+			timer_add(data->timers, timers_now() + data->pressureinterval, check_pressure, data);
+		}
+	}
+	
+	if (dryrun) {
+		executor_dryrun(data->executor);
+		data->dryrun = 1;
+	}
+	
+	// The metrics can be written to a file periodically, and are always written out (to stdout) when SIGUSR1 is received.
+	data->statsfile = setting_get(data, "StatsFile", NULL);
+	data->statsinterval = setting_long(data, "StatsIntervalMs", 10000);
+	if (data->statsfile && data->statsinterval > 0) {
+		timer_add(data->timers, timers_now() + data->statsinterval, save_stats, data);
+	}
+	// breaking one of the leases that are taken to see if a file is still being written would otherwise kill us (see open_for_writing()).
+	signal(SIGIO, SIG_IGN);
+	
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	data->sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (data->sigfd == -1) {
+		perror("signalfd");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Optionally, a helper process does all the spawning of actions, so that the event loop never waits for a process to be created.
+	// It is started now, while the daemon is still small, and before anything else is opened that the helper would inherit.
+	if (data->config && config_get_bool(data->config, "SpawnHelper")) {
+		if (executor_helper(data->executor) == 0) {
+			logger_write(data->logger, LOGGER_INFO, "Spawn helper started.");
+		}
+	}
+	
+	// Create interface to the inotify kernel API;
+	assert(data->infd == 0);
+	data->infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (data->infd == -1) {
+		perror("inotify_init1");
+		exit(EXIT_FAILURE);
+	}
+	assert(data->infd >= 0);
+	
+	// Instead of a watch for every directory, fanotify can watch whole filesystems, and the events are matched to the rules by their path.
+	const char *backend = setting_get(data, "Backend", "inotify");
+	if (strcasecmp(backend, "fanotify") == 0) {
+		if (data->record || data->replay) {
+			logger_write(data->logger, LOGGER_WARNING, "Recording and replaying events is only done with inotify, the fanotify backend will not be used.");
+		}
+		else if ((data->fanwatch = fanwatch_new()) == NULL) {
+			logger_write(data->logger, LOGGER_WARNING, "Unable to use fanotify (%s), using inotify instead.", strerror(errno));
+		}
+		else {
+			data->monitors = pathtrie_new();
+			assert(data->monitors);
+			logger_write(data->logger, LOGGER_INFO, "Using fanotify to watch the filesystems.");
+		}
+	}
+	else if (strcasecmp(backend, "inotify") != 0) {
+		logger_write(data->logger, LOGGER_WARNING, "Unknown Backend '%s', using inotify", backend);
+	}
+	
+	// The events can be filtered and debounced on a pool of threads, rather than on the same thread that reads them.  The actions are 
+	// still performed on the main thread, by the executor.
+	int dispatchthreads = setting_long(data, "DispatchThreads", 0);
+	if (dispatchthreads > 0) {
+		data->dispatchers = workers_new(dispatchthreads, DISPATCH_QUEUE, dispatch_cb, data);
+		if (data->dispatchers == NULL) {
+			logger_write(data->logger, LOGGER_ERROR, "Unable to start the dispatcher threads, the events will be dispatched by the main thread.");
+		}
+		else {
+			data->dispatchpending = calloc(dispatchthreads, sizeof(HASHMAP));
+			assert(data->dispatchpending);
+			int i;
+			for (i=0; i < dispatchthreads; i++) {
+				data->dispatchpending[i] = hashmap_new();
+				assert(data->dispatchpending[i]);
+			}
+			logger_write(data->logger, LOGGER_INFO, "Dispatching events with %d threads.", dispatchthreads);
+		}
+	}
+	
+	// The rules that only act on changes keep what each file had in it, up to a limit (about 100 bytes each).  It is split between the 
+	// dispatchers, as each looks after its own files.
+	int caches = data->dispatchers ? workers_count(data->dispatchers) : 1;
+	long cachesize = setting_long(data, "ContentCacheEntries", 1000000);
+	data->fingerprints = calloc(caches, sizeof(FINGERPRINTS));
+	assert(data->fingerprints);
+	int c;
+	for (c=0; c < caches; c++) {
+		data->fingerprints[c] = fingerprints_new(cachesize / caches > 0 ? cachesize / caches : 1);
+		assert(data->fingerprints[c]);
+	}
+	
+	// The events can be published to the subscribers of a sink (see EventSink), with these settings for all of them.
+	data->sinks = hashmap_new();
+	assert(data->sinks);
+	data->sinkformat = eventsink_format(setting_get(data, "EventSinkFormat", "binary"));
+	if (data->sinkformat < 0) {
+		logger_write(data->logger, LOGGER_WARNING, "Unknown EventSinkFormat '%s', using binary", setting_get(data, "EventSinkFormat", ""));
+		data->sinkformat = EVENTSINK_BINARY;
+	}
+	data->sinkpolicy = eventsink_policy(setting_get(data, "EventSinkOverflow", "drop"));
+	if (data->sinkpolicy < 0) {
+		logger_write(data->logger, LOGGER_WARNING, "Unknown EventSinkOverflow policy '%s', using drop", setting_get(data, "EventSinkOverflow", ""));
+		data->sinkpolicy = EVENTSINK_DROP;
+	}
+	data->sinkbuffer = setting_long(data, "EventSinkBufferBytes", 1024 * 1024);
+	
+	// The rules that wait for files to be closed by everything keep a count for each file that is open (about 50 bytes each).
+	data->openfiles = hashmap_new();
+	assert(data->openfiles);
+	data->maxopenfiles = setting_long(data, "OpenFileEntries", 1000000);
+	if (data->maxopenfiles <= 0) { data->maxopenfiles = 1; }
+	
+	data->cfgfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (data->cfgfd == -1) {
+		perror("inotify_init1");
+		exit(EXIT_FAILURE);
+	}
+	data->cfgfiles = hashmap_new();
+	assert(data->cfgfiles);
+	
+	// changes from before the watches were added are not ours to act on, even if the queue overflows before it has ever been empty.
+	data->drained = realtime_ns();
+	
+	// first we need to look in the directory locations for the config files.
+	process_config_dir(data, "/etc/fileknock.d");
+	process_config_dir(data, "/opt/fileknock/etc/fileknock.d");
+	process_config_dir(data, "/usr/local/etc/fileknock.d");
+	process_config_dir(data, "./fileknock.d");
+
+
+	// Now that we have read in all the config, and setup all the watches, we need to wait for changes to occur.
+	assert(data->infd);
+
+	// timers could already have been set while loading the config (eg, the stats file).
+	arm_timers(data);
+	
+	if (data->replay) {
+		data->replaystart = timers_now();
+		data->replaydue = data->replaystart;
+	}
+
+	// an io_uring is used if the kernel has it, as it can wait for everything and read the events in one system call.
+	URING ring = NULL;
+	const char *loop = setting_get(data, "EventLoop", "io_uring");
+	if (strcasecmp(loop, "io_uring") == 0) {
+		ring = uring_new(64);
+		if (ring == NULL) {
+			logger_write(data->logger, LOGGER_WARNING, "Unable to use io_uring (%s), using poll instead.", strerror(errno));
 		}
 	}
+	else if (strcasecmp(loop, "poll") != 0) {
+		logger_write(data->logger, LOGGER_WARNING, "Unknown EventLoop '%s', using poll", loop);
+	}
+	
+	if (ring) {
+		ring_loop(data, ring);
+		uring_free(ring);
+	}
+	else {
+		poll_loop(data);
+	}
 
-	fprintf(stderr, "Exiting.\n");
+	// the subscribers are given what has been published to them so far.
+	hashmap_foreach(data->sinks, free_sink_cb, NULL);
+	
+	logger_write(data->logger, LOGGER_INFO, "Exiting.");
+	logger_free(data->logger);
 
 	// We are exiting, there is no reason to bother clearing out objects, structures and file-descriptors, as they will all be free'd by the system when the process exits.
 	data = NULL;
@@ -0,0 +1,316 @@
+// fileop.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Simple operations on a file, done without starting a process.   No application specific code should be here.
+ * See fileop.h for details.
+*/
+
+
+#define _GNU_SOURCE		// for copy_file_range()
+
+#include "fileop.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+#define OP_COPY		1
+#define OP_MOVE		2
+#define OP_LINK		3
+#define OP_APPEND	4
+
+// the most that is asked of the kernel in one go, so that a very large file does not hold the thread in one system call for too long.
+#define COPY_CHUNK	(16 * 1024 * 1024)
+
+
+typedef struct {
+	char *spec;
+	int kind;
+	char *target;		// the directory (or for append, the file).
+} fileop_t;
+
+
+
+extern FILEOP fileop_new(const char *spec)
+{
+	assert(spec);
+
+	const char *colon = strchr(spec, ':');
+	if (colon == NULL || colon[1] != '/') {
+		return(NULL);
+	}
+
+	int kind;
+	size_t len = colon - spec;
+	if (len == 4 && strncmp(spec, "copy", len) == 0)			{ kind = OP_COPY; }
+	else if (len == 4 && strncmp(spec, "move", len) == 0)		{ kind = OP_MOVE; }
+	else if (len == 4 && strncmp(spec, "link", len) == 0)		{ kind = OP_LINK; }
+	else if (len == 6 && strncmp(spec, "append", len) == 0)	{ kind = OP_APPEND; }
+	else {
+		return(NULL);
+	}
+
+	fileop_t *op = calloc(1, sizeof(fileop_t));
+	assert(op);
+	op->kind = kind;
+	op->spec = strdup(spec);
+	assert(op->spec);
+	op->target = strdup(colon + 1);
+	assert(op->target);
+
+	// a trailing slash on the directory would only give us paths with '//' in them.
+	size_t tlen = strlen(op->target);
+	while (tlen > 1 && op->target[tlen - 1] == '/') {
+		op->target[-- tlen] = 0;
+	}
+	return((FILEOP) op);
+}
+
+
+extern void fileop_free(FILEOP opptr)
+{
+	fileop_t *op = opptr;
+	assert(op);
+	free(op->spec);
+	free(op->target);
+	free(op);
+}
+
+
+extern const char * fileop_spec(FILEOP opptr)
+{
+	fileop_t *op = opptr;
+	assert(op);
+	return(op->spec);
+}
+
+
+// copy everything from the current position of 'in' to the current position of 'out'.
+static int copy_data(int in, int out)
+{
+	// copy_file_range() can share the blocks on filesystems that support it, but it cannot always be used (eg, across filesystems on
+	// older kernels, or when the output is a pipe), in which case sendfile() is used for the rest.
+	int usesendfile = 0;
+	for (;;) {
+		ssize_t copied;
+		if (usesendfile == 0) {
+			copied = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+			if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				usesendfile = 1;
+				continue;
+			}
+		}
+		else {
+			copied = sendfile(out, in, NULL, COPY_CHUNK);
+		}
+
+		if (copied < 0) {
+			if (errno == EINTR) { continue; }
+			return(-1);
+		}
+		if (copied == 0) {
+			return(0);
+		}
+	}
+}
+
+
+// the path in the target directory that the file would have.  Returns -1 if it is too long.
+static int target_path(fileop_t *op, const char *path, char *buf, size_t size)
+{
+	assert(op);
+	assert(path);
+	assert(buf);
+
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	if (*name == 0 || snprintf(buf, size, "%s/%s", op->target, name) >= (int) size) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	return(0);
+}
+
+
+// a name in the same directory as 'dest' that something can be put at, before it is renamed over 'dest'.  The thread is part of the
+// name, so that the same operation running on several threads at once does not collide.
+static int temp_path(const char *dest, char *buf, size_t size)
+{
+	assert(dest);
+	assert(buf);
+
+	const char *slash = strrchr(dest, '/');
+	assert(slash);
+	int dirlen = (int) (slash - dest);
+	if (snprintf(buf, size, "%.*s/.%s.%d.%ld", dirlen, dest, slash + 1, (int) getpid(), (long) syscall(SYS_gettid)) >= (int) size) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	return(0);
+}
+
+
+static int copy_file(const char *path, const char *dest)
+{
+	assert(path);
+	assert(dest);
+
+	char temp[PATH_MAX];
+	if (temp_path(dest, temp, sizeof(temp)) != 0) {
+		return(-1);
+	}
+
+	int in = open(path, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		return(-1);
+	}
+	struct stat st;
+	if (fstat(in, &st) != 0) {
+		close(in);
+		return(-1);
+	}
+
+	int out = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (out < 0) {
+		close(in);
+		return(-1);
+	}
+
+	int result = copy_data(in, out);
+	if (result == 0) { result = fchmod(out, st.st_mode & 07777); }
+	if (result == 0) { result = rename(temp, dest); }
+
+	int e = errno;
+	close(in);
+	close(out);
+	if (result != 0) {
+		unlink(temp);
+		errno = e;
+	}
+	return(result);
+}
+
+
+static int link_file(const char *path, const char *dest)
+{
+	assert(path);
+	assert(dest);
+
+	if (link(path, dest) == 0) {
+		return(0);
+	}
+	if (errno != EEXIST) {
+		return(-1);
+	}
+
+	// if it is already linked, there is nothing to do (and renaming a link over another link to the same file would do nothing anyway).
+	struct stat src, dst;
+	if (stat(path, &src) == 0 && lstat(dest, &dst) == 0 && src.st_dev == dst.st_dev && src.st_ino == dst.st_ino) {
+		return(0);
+	}
+
+	// something else is already there, so the link is made beside it and renamed over it, so that the name is never missing.
+	char temp[PATH_MAX];
+	if (temp_path(dest, temp, sizeof(temp)) != 0) {
+		return(-1);
+	}
+	unlink(temp);
+	if (link(path, temp) != 0) {
+		return(-1);
+	}
+	if (rename(temp, dest) != 0) {
+		int e = errno;
+		unlink(temp);
+		errno = e;
+		return(-1);
+	}
+	return(0);
+}
+
+
+static int append_file(const char *path, const char *dest)
+{
+	assert(path);
+	assert(dest);
+
+	int in = open(path, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		return(-1);
+	}
+
+	// neither copy_file_range() nor sendfile() will write to a file opened with O_APPEND, so the file is locked while we add to the end of it.
+	int out = open(dest, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (out < 0) {
+		close(in);
+		return(-1);
+	}
+
+	int result = flock(out, LOCK_EX);
+	if (result == 0) {
+		result = (lseek(out, 0, SEEK_END) < 0) ? -1 : copy_data(in, out);
+	}
+
+	int e = errno;
+	close(in);
+	close(out);		// which also releases the lock.
+	errno = e;
+	return(result);
+}
+
+
+extern int fileop_run(FILEOP opptr, const char *path)
+{
+	fileop_t *op = opptr;
+	assert(op);
+	assert(path);
+
+	if (op->kind == OP_APPEND) {
+		return(append_file(path, op->target));
+	}
+
+	char dest[PATH_MAX];
+	if (target_path(op, path, dest, sizeof(dest)) != 0) {
+		return(-1);
+	}
+
+	switch (op->kind) {
+		case OP_COPY:
+			return(copy_file(path, dest));
+
+		case OP_MOVE:
+			if (rename(path, dest) == 0) {
+				return(0);
+			}
+			if (errno != EXDEV) {
+				return(-1);
+			}
+			// it is on another filesystem, so it needs to be copied.
+			if (copy_file(path, dest) != 0) {
+				return(-1);
+			}
+			return(unlink(path));
+
+		case OP_LINK:
+			return(link_file(path, dest));
+	}
+
+	assert(0);
+	errno = EINVAL;
+	return(-1);
+}
+
+
+// fin - fileop.c
@@ -0,0 +1,35 @@
+// fileop.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Simple operations on a file, done without starting a process.   No application specific code should be here.
+ * An operation is described by a string of the form "kind:target":
+ *   copy:/dir     - the file is copied into the directory (keeping its name).  The copy is written under a temporary name and
+ *                   renamed into place, so nothing sees a partial file.
+ *   move:/dir     - the file is moved into the directory.  If it is on another filesystem, it is copied and then removed.
+ *   link:/dir     - a hard link to the file is made in the directory (replacing anything there with the same name).
+ *   append:/file  - the contents of the file are added to the end of another file (which is created if it does not exist).
+ *
+ * The data is copied by the kernel (copy_file_range(), or sendfile() where that cannot be used), never through a buffer of ours.
+ * Running an operation does not change it, so the same one can be run on several threads at once.
+*/
+
+#ifndef __FILEOP_H
+#define __FILEOP_H
+
+typedef void * FILEOP;
+
+// parse the description of an operation.  Returns NULL if it is not valid.
+FILEOP fileop_new(const char *spec);
+void fileop_free(FILEOP op);
+
+// the description it was created from.
+const char * fileop_spec(FILEOP op);
+
+// perform the operation on the file at 'path'.  Returns 0, or -1 with errno set.
+int fileop_run(FILEOP op, const char *path);
+
+
+#endif
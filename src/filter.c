@@ -0,0 +1,287 @@
+// filter.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A compiled set of filename patterns.   No application specific code should be here.
+ * See filter.h for details.
+*/
+
+
+#include "filter.h"
+#include "hashmap.h"
+
+#include <assert.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define REGEX_PREFIX	"regex:"
+
+
+typedef struct trie_node_t {
+	unsigned char c;
+	int terminal;		// a pattern ends at this node.
+	struct trie_node_t *child;
+	struct trie_node_t *sibling;
+} trie_node_t;
+
+
+// all the patterns of one kind (include or exclude).
+typedef struct {
+	int count;			// the number of patterns in the set, of any shape.
+	int all;			// a pattern of just "*" was added, so everything matches.
+	HASHMAP exact;
+	trie_node_t *prefix;
+	trie_node_t *suffix;
+	char **globs;
+	int globcount;
+	char *regexsrc;		// all the regular expressions, combined into a single alternation.
+	regex_t regex;
+	int hasregex;
+} matchset_t;
+
+
+typedef struct {
+	matchset_t include;
+	matchset_t exclude;
+	int includes;		// the includes that were asked for, including any that were not valid.
+} filter_t;
+
+
+
+extern FILTER filter_new(void)
+{
+	filter_t *filter = calloc(1, sizeof(filter_t));
+	assert(filter);
+	return((FILTER) filter);
+}
+
+
+static void trie_free(trie_node_t *node)
+{
+	while (node) {
+		trie_node_t *sibling = node->sibling;
+		trie_free(node->child);
+		free(node);
+		node = sibling;
+	}
+}
+
+
+static void matchset_free(matchset_t *set)
+{
+	assert(set);
+	if (set->exact) { hashmap_free(set->exact); }
+	trie_free(set->prefix);
+	trie_free(set->suffix);
+	while (set->globcount > 0) {
+		set->globcount --;
+		free(set->globs[set->globcount]);
+	}
+	if (set->globs) { free(set->globs); }
+	if (set->hasregex) { regfree(&set->regex); }
+	if (set->regexsrc) { free(set->regexsrc); }
+}
+
+
+extern void filter_free(FILTER filterptr)
+{
+	filter_t *filter = filterptr;
+	assert(filter);
+	matchset_free(&filter->include);
+	matchset_free(&filter->exclude);
+	free(filter);
+}
+
+
+// add 'len' characters of 'str' to the trie, walking forwards (step 1) or backwards (step -1).
+static void trie_add(trie_node_t **root, const char *str, int len, int step)
+{
+	assert(root);
+	assert(str);
+	assert(len > 0);
+	assert(step == 1 || step == -1);
+
+	trie_node_t **level = root;
+	trie_node_t *node = NULL;
+	int i;
+	for (i=0; i < len; i++) {
+		unsigned char c = str[step > 0 ? i : len - 1 - i];
+		node = *level;
+		while (node && node->c != c) {
+			node = node->sibling;
+		}
+		if (node == NULL) {
+			node = calloc(1, sizeof(trie_node_t));
+			assert(node);
+			node->c = c;
+			node->sibling = *level;
+			*level = node;
+		}
+		level = &node->child;
+	}
+	assert(node);
+	node->terminal = 1;
+}
+
+
+// returns non-zero if a pattern in the trie is a prefix of the string (or a suffix, when walking backwards).
+static int trie_match(trie_node_t *node, const char *str, int len, int step)
+{
+	int i;
+	for (i=0; i < len && node; i++) {
+		unsigned char c = str[step > 0 ? i : len - 1 - i];
+		while (node && node->c != c) {
+			node = node->sibling;
+		}
+		if (node == NULL) {
+			break;
+		}
+		if (node->terminal) {
+			return(1);
+		}
+		node = node->child;
+	}
+	return(0);
+}
+
+
+// returns non-zero if the string has any characters that are special to fnmatch().
+static int has_glob(const char *str, int len)
+{
+	int i;
+	for (i=0; i < len; i++) {
+		if (str[i] == '*' || str[i] == '?' || str[i] == '[' || str[i] == '\\') {
+			return(1);
+		}
+	}
+	return(0);
+}
+
+
+static int matchset_add(matchset_t *set, const char *pattern)
+{
+	assert(set);
+	assert(pattern);
+
+	int len = strlen(pattern);
+
+	if (strncmp(pattern, REGEX_PREFIX, strlen(REGEX_PREFIX)) == 0) {
+		const char *expr = pattern + strlen(REGEX_PREFIX);
+
+		// check that it is valid on its own first, so that a bad one does not spoil the combined expression.
+		regex_t check;
+		if (regcomp(&check, expr, REG_EXTENDED | REG_NOSUB) != 0) {
+			return(-1);
+		}
+		regfree(&check);
+
+		size_t oldlen = set->regexsrc ? strlen(set->regexsrc) : 0;
+		char *src = malloc(oldlen + strlen(expr) + 4);
+		assert(src);
+		if (set->regexsrc) {
+			sprintf(src, "%s|(%s)", set->regexsrc, expr);
+			free(set->regexsrc);
+		}
+		else {
+			sprintf(src, "(%s)", expr);
+		}
+		set->regexsrc = src;
+
+		if (set->hasregex) { regfree(&set->regex); }
+		int result = regcomp(&set->regex, set->regexsrc, REG_EXTENDED | REG_NOSUB);
+		assert(result == 0);
+		set->hasregex = 1;
+	}
+	else if (len == 0) {
+		return(-1);
+	}
+	else if (strcmp(pattern, "*") == 0) {
+		set->all = 1;
+	}
+	else if (has_glob(pattern, len) == 0) {
+		if (set->exact == NULL) { set->exact = hashmap_new(); }
+		hashmap_set(set->exact, pattern, len, set);
+	}
+	else if (pattern[0] == '*' && has_glob(pattern + 1, len - 1) == 0) {
+		trie_add(&set->suffix, pattern + 1, len - 1, -1);
+	}
+	else if (pattern[len - 1] == '*' && has_glob(pattern, len - 1) == 0) {
+		trie_add(&set->prefix, pattern, len - 1, 1);
+	}
+	else {
+		set->globs = realloc(set->globs, sizeof(char *) * (set->globcount + 1));
+		assert(set->globs);
+		set->globs[set->globcount] = strdup(pattern);
+		assert(set->globs[set->globcount]);
+		set->globcount ++;
+	}
+
+	set->count ++;
+	return(0);
+}
+
+
+static int matchset_match(matchset_t *set, const char *name)
+{
+	assert(set);
+	assert(name);
+
+	if (set->all) { return(1); }
+
+	int len = strlen(name);
+	if (set->exact && hashmap_get(set->exact, name, len)) { return(1); }
+	if (set->suffix && trie_match(set->suffix, name, len, -1)) { return(1); }
+	if (set->prefix && trie_match(set->prefix, name, len, 1)) { return(1); }
+
+	int i;
+	for (i=0; i < set->globcount; i++) {
+		if (fnmatch(set->globs[i], name, 0) == 0) { return(1); }
+	}
+
+	if (set->hasregex && regexec(&set->regex, name, 0, NULL, 0) == 0) { return(1); }
+
+	return(0);
+}
+
+
+extern int filter_include(FILTER filterptr, const char *pattern)
+{
+	filter_t *filter = filterptr;
+	assert(filter);
+	filter->includes ++;
+	return(matchset_add(&filter->include, pattern));
+}
+
+
+extern int filter_exclude(FILTER filterptr, const char *pattern)
+{
+	filter_t *filter = filterptr;
+	assert(filter);
+	return(matchset_add(&filter->exclude, pattern));
+}
+
+
+extern int filter_match(FILTER filterptr, const char *name)
+{
+	filter_t *filter = filterptr;
+	assert(filter);
+	assert(name);
+
+	if (filter->exclude.count > 0 && matchset_match(&filter->exclude, name)) {
+		return(0);
+	}
+	if (filter->includes > 0) {
+		// if none of them were valid, nothing matches (rather than everything).
+		return(matchset_match(&filter->include, name));
+	}
+	return(1);
+}
+
+
+// fin - filter.c
@@ -0,0 +1,38 @@
+// filter.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A compiled set of filename patterns.   No application specific code should be here.
+ * Patterns are globs (as with fnmatch), or POSIX extended regular expressions if they start with "regex:".
+ * Each pattern is either an include or an exclude.  A name matches the filter if it does not match any of the excludes, and
+ * either there are no includes, or it matches at least one of them.
+ *
+ * The patterns are sorted by shape when they are added, so that matching does not evaluate them one at a time:
+ *   - literal names are kept in a hash map.
+ *   - globs that are a literal with a single leading '*' (eg, "*.swp") are kept in a trie of the reversed suffixes.
+ *   - globs that are a literal with a single trailing '*' (eg, "tmp*") are kept in a trie of the prefixes.
+ *   - all the regular expressions are combined into a single expression, compiled once.
+ *   - anything else is checked with fnmatch().
+*/
+
+#ifndef __FILTER_H
+#define __FILTER_H
+
+// The filter object is opaque outside of the library (it will simply be a pointer to a void object).
+typedef void * FILTER;
+
+FILTER filter_new(void);
+void filter_free(FILTER filter);
+
+// add a pattern to the filter.  Returns 0 if it was added, or -1 if it is not a valid pattern.  An include that is not valid still
+// counts as there being includes, so a filter with only invalid includes matches nothing.
+int filter_include(FILTER filter, const char *pattern);
+int filter_exclude(FILTER filter, const char *pattern);
+
+// returns non-zero if the name is accepted by the filter.
+int filter_match(FILTER filter, const char *name);
+
+
+#endif
@@ -0,0 +1,373 @@
+// fingerprint.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A cache of what the contents of files were when they were last looked at.   No application specific code should be here.
+ * See fingerprint.h for details.
+*/
+
+
+#define _GNU_SOURCE		// for O_NOATIME
+
+#include "fingerprint.h"
+#include "hashmap.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// files are read this much at a time.  It is a multiple of the 32 bytes the hash works on.
+#define READ_SIZE	(256 * 1024)
+
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+#define PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define PRIME64_5	0x27D4EB2F165667C5ULL
+
+
+typedef struct entry_t {
+	uint64_t id;			// the hash of the key, which is also the key in the map.
+	off_t size;
+	long long mtime;		// nanoseconds since the epoch.
+	uint64_t hash;
+	struct entry_t *prev, *next;	// the entries in the order they were used, most recent first.
+} entry_t;
+
+
+typedef struct {
+	HASHMAP entries;
+	int count;
+	int max;
+	entry_t *newest, *oldest;
+	char *buffer;			// files are read into this.  Allocated the first time one is read.
+} fingerprints_t;
+
+
+// The state of the hash, while it is given the contents a block at a time.  The lanes are independent of each other, so that
+// the processor can work on all four at once.
+typedef struct {
+	uint64_t v[4];
+	uint64_t total;
+} xxh64_t;
+
+
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return((x << r) | (x >> (64 - r)));
+}
+
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return(value);
+}
+
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return(value);
+}
+
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return(acc * PRIME64_1);
+}
+
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t value)
+{
+	acc ^= xxh_round(0, value);
+	return((acc * PRIME64_1) + PRIME64_4);
+}
+
+
+static void xxh_start(xxh64_t *state, uint64_t seed)
+{
+	assert(state);
+	state->v[0] = seed + PRIME64_1 + PRIME64_2;
+	state->v[1] = seed + PRIME64_2;
+	state->v[2] = seed;
+	state->v[3] = seed - PRIME64_1;
+	state->total = 0;
+}
+
+
+// add the blocks of 32 bytes.  'len' must be a multiple of 32.
+static void xxh_stripes(xxh64_t *state, const unsigned char *p, size_t len)
+{
+	assert(state);
+	assert(len % 32 == 0);
+
+	uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+	const unsigned char *end = p + len;
+	while (p < end) {
+		v0 = xxh_round(v0, read64(p));
+		v1 = xxh_round(v1, read64(p + 8));
+		v2 = xxh_round(v2, read64(p + 16));
+		v3 = xxh_round(v3, read64(p + 24));
+		p += 32;
+	}
+	state->v[0] = v0; state->v[1] = v1; state->v[2] = v2; state->v[3] = v3;
+	state->total += len;
+}
+
+
+// add the last of the input (less than 32 bytes), and return the hash.
+static uint64_t xxh_finish(xxh64_t *state, uint64_t seed, const unsigned char *p, size_t len)
+{
+	assert(state);
+	assert(len < 32);
+
+	uint64_t h;
+	if (state->total > 0) {
+		h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+		h = xxh_merge(h, state->v[0]);
+		h = xxh_merge(h, state->v[1]);
+		h = xxh_merge(h, state->v[2]);
+		h = xxh_merge(h, state->v[3]);
+	}
+	else {
+		h = seed + PRIME64_5;
+	}
+	h += state->total + len;
+
+	while (len >= 8) {
+		h ^= xxh_round(0, read64(p));
+		h = (rotl64(h, 27) * PRIME64_1) + PRIME64_4;
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t) read32(p) * PRIME64_1;
+		h = (rotl64(h, 23) * PRIME64_2) + PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	while (len > 0) {
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		p ++;
+		len --;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return(h);
+}
+
+
+extern uint64_t fingerprint_hash(const void *buf, size_t len, uint64_t seed)
+{
+	assert(buf || len == 0);
+
+	xxh64_t state;
+	xxh_start(&state, seed);
+	size_t stripes = len - (len % 32);
+	xxh_stripes(&state, buf, stripes);
+	return(xxh_finish(&state, seed, (const unsigned char *) buf + stripes, len - stripes));
+}
+
+
+extern FINGERPRINTS fingerprints_new(int max)
+{
+	assert(max > 0);
+
+	fingerprints_t *fp = calloc(1, sizeof(fingerprints_t));
+	assert(fp);
+	fp->max = max;
+	fp->entries = hashmap_new();
+	assert(fp->entries);
+	return((FINGERPRINTS) fp);
+}
+
+
+extern void fingerprints_free(FINGERPRINTS fpptr)
+{
+	fingerprints_t *fp = fpptr;
+	assert(fp);
+
+	while (fp->newest) {
+		entry_t *next = fp->newest->next;
+		free(fp->newest);
+		fp->newest = next;
+	}
+	hashmap_free(fp->entries);
+	if (fp->buffer) { free(fp->buffer); }
+	free(fp);
+}
+
+
+extern int fingerprints_count(FINGERPRINTS fpptr)
+{
+	fingerprints_t *fp = fpptr;
+	assert(fp);
+	return(fp->count);
+}
+
+
+static void unlink_entry(fingerprints_t *fp, entry_t *entry)
+{
+	assert(fp);
+	assert(entry);
+	if (entry->prev) { entry->prev->next = entry->next; }
+	else { fp->newest = entry->next; }
+	if (entry->next) { entry->next->prev = entry->prev; }
+	else { fp->oldest = entry->prev; }
+	entry->prev = entry->next = NULL;
+}
+
+
+static void push_entry(fingerprints_t *fp, entry_t *entry)
+{
+	assert(fp);
+	assert(entry);
+	entry->prev = NULL;
+	entry->next = fp->newest;
+	if (fp->newest) { fp->newest->prev = entry; }
+	else { fp->oldest = entry; }
+	fp->newest = entry;
+}
+
+
+// hash the contents of a file.  It is read rather than mapped, as a file that is truncated while it is mapped would kill us with SIGBUS.
+static int hash_file(fingerprints_t *fp, int fd, uint64_t *hash)
+{
+	assert(fp);
+	assert(fd >= 0);
+	assert(hash);
+
+	if (fp->buffer == NULL) {
+		fp->buffer = malloc(READ_SIZE);
+		assert(fp->buffer);
+	}
+
+	xxh64_t state;
+	xxh_start(&state, 0);
+
+	// what is left over from a read that was not a multiple of 32 bytes is moved to the front, and the next read goes after it.
+	size_t have = 0;
+	for (;;) {
+		ssize_t len = read(fd, fp->buffer + have, READ_SIZE - have);
+		if (len < 0) {
+			if (errno == EINTR) { continue; }
+			return(-1);
+		}
+		if (len == 0) {
+			break;
+		}
+		have += len;
+		size_t stripes = have - (have % 32);
+		xxh_stripes(&state, (unsigned char *) fp->buffer, stripes);
+		memmove(fp->buffer, fp->buffer + stripes, have - stripes);
+		have -= stripes;
+	}
+
+	*hash = xxh_finish(&state, 0, (unsigned char *) fp->buffer, have);
+	return(0);
+}
+
+
+extern int fingerprints_check(FINGERPRINTS fpptr, const void *key, size_t keylen, const char *path, uint64_t *hash)
+{
+	fingerprints_t *fp = fpptr;
+	assert(fp);
+	assert(key);
+	assert(path);
+	assert(hash);
+
+	uint64_t id = fingerprint_hash(key, keylen, 0);
+	entry_t *entry = hashmap_get(fp->entries, &id, sizeof(id));
+	if (entry) {
+		unlink_entry(fp, entry);
+		push_entry(fp, entry);
+
+		// the file is not opened unless it needs to be read, as opening it causes events of its own (which would bring us back here).
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			return(-1);
+		}
+		if (entry->size == st.st_size && entry->mtime == ((long long) st.st_mtim.tv_sec * 1000000000LL) + st.st_mtim.tv_nsec) {
+			*hash = entry->hash;
+			return(0);
+		}
+	}
+
+	// O_NOATIME is only allowed for files that we own (or with CAP_FOWNER).
+	int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+	if (fd < 0 && errno == EPERM) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		return(-1);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return(-1);
+	}
+	long long mtime = ((long long) st.st_mtim.tv_sec * 1000000000LL) + st.st_mtim.tv_nsec;
+
+	uint64_t value;
+	if (hash_file(fp, fd, &value) != 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return(-1);
+	}
+	close(fd);
+	*hash = value;
+
+	if (entry) {
+		// the time (or size) is different, but the contents may not be.
+		int changed = (entry->hash != value);
+		entry->size = st.st_size;
+		entry->mtime = mtime;
+		entry->hash = value;
+		return(changed);
+	}
+
+	if (fp->count >= fp->max) {
+		entry_t *oldest = fp->oldest;
+		assert(oldest);
+		unlink_entry(fp, oldest);
+		void *removed = hashmap_remove(fp->entries, &oldest->id, sizeof(oldest->id));
+		assert(removed == oldest);
+		free(oldest);
+		fp->count --;
+	}
+
+	entry = calloc(1, sizeof(entry_t));
+	assert(entry);
+	entry->id = id;
+	entry->size = st.st_size;
+	entry->mtime = mtime;
+	entry->hash = value;
+	hashmap_set(fp->entries, &entry->id, sizeof(entry->id), entry);
+	push_entry(fp, entry);
+	fp->count ++;
+	return(1);
+}
+
+
+// fin - fingerprint.c
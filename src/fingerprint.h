@@ -0,0 +1,40 @@
+// fingerprint.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A cache of what the contents of files were when they were last looked at, so that a file can be checked for having
+ * actually changed.   No application specific code should be here.
+ * For each key, the size, modification time and a hash (XXH64) of the contents are kept.  If the size and time are the
+ * same as last time, the file is assumed not to have changed, and it is not read again.
+ *
+ * The number of entries is limited, and when it is full, the one that was used longest ago is forgotten.  Each entry is
+ * about 100 bytes, no matter how long the key is (only a hash of the key is kept).
+ *
+ * It is not thread-safe, each thread that checks files should have its own.
+*/
+
+#ifndef __FINGERPRINT_H
+#define __FINGERPRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void * FINGERPRINTS;
+
+FINGERPRINTS fingerprints_new(int max);
+void fingerprints_free(FINGERPRINTS fp);
+
+int fingerprints_count(FINGERPRINTS fp);
+
+// look at the file at 'path', and compare it with what was found for 'key' last time.  Returns 1 if the contents have changed (or
+// nothing is known about the key), 0 if they are the same, or -1 (with errno set) if the file could not be read.
+// 'hash' is set to the hash of the contents.
+int fingerprints_check(FINGERPRINTS fp, const void *key, size_t keylen, const char *path, uint64_t *hash);
+
+// the hash of a block of memory (XXH64), the same as is used for the files.
+uint64_t fingerprint_hash(const void *buf, size_t len, uint64_t seed);
+
+
+#endif
@@ -0,0 +1,205 @@
+// hashmap.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A generic hash map, keyed on a block of bytes.   No application specific code should be here.
+ * See hashmap.h for details.
+*/
+
+
+#include "hashmap.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct hashmap_entry_t {
+	struct hashmap_entry_t *next;
+	unsigned long long hash;
+	void *value;
+	size_t keylen;
+	char key[];		// the key is stored with the entry, so there is only one allocation for each.
+} hashmap_entry_t;
+
+
+typedef struct {
+	int count;
+	int buckets;		// always a power of 2.
+	hashmap_entry_t **bucket;
+} hashmap_t;
+
+
+
+// FNV-1a.  It is simple and quick for the short keys (paths and names) that are used with the map.
+extern unsigned long long hashmap_hash(const void *key, size_t keylen)
+{
+	const unsigned char *ptr = key;
+	unsigned long long hash = 14695981039346656037ULL;
+	while (keylen > 0) {
+		hash ^= *ptr;
+		hash *= 1099511628211ULL;
+		ptr ++;
+		keylen --;
+	}
+	return(hash);
+}
+
+
+extern HASHMAP hashmap_new(void)
+{
+	hashmap_t *map = calloc(1, sizeof(hashmap_t));
+	assert(map);
+	map->buckets = 64;
+	map->bucket = calloc(map->buckets, sizeof(hashmap_entry_t *));
+	assert(map->bucket);
+	return((HASHMAP) map);
+}
+
+
+extern void hashmap_free(HASHMAP mapptr)
+{
+	hashmap_t *map = mapptr;
+	assert(map);
+
+	int i;
+	for (i=0; i < map->buckets; i++) {
+		hashmap_entry_t *entry = map->bucket[i];
+		while (entry) {
+			hashmap_entry_t *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+	free(map->bucket);
+	free(map);
+}
+
+
+// double the number of buckets, and move all the entries into them.
+static void grow(hashmap_t *map)
+{
+	assert(map);
+	int buckets = map->buckets * 2;
+	hashmap_entry_t **bucket = calloc(buckets, sizeof(hashmap_entry_t *));
+	assert(bucket);
+
+	int i;
+	for (i=0; i < map->buckets; i++) {
+		hashmap_entry_t *entry = map->bucket[i];
+		while (entry) {
+			hashmap_entry_t *next = entry->next;
+			int b = entry->hash & (buckets - 1);
+			entry->next = bucket[b];
+			bucket[b] = entry;
+			entry = next;
+		}
+	}
+
+	free(map->bucket);
+	map->bucket = bucket;
+	map->buckets = buckets;
+}
+
+
+static hashmap_entry_t ** find(hashmap_t *map, const void *key, size_t keylen, unsigned long long hash)
+{
+	hashmap_entry_t **ptr = &map->bucket[hash & (map->buckets - 1)];
+	while (*ptr) {
+		if ((*ptr)->hash == hash && (*ptr)->keylen == keylen && memcmp((*ptr)->key, key, keylen) == 0) {
+			break;
+		}
+		ptr = &(*ptr)->next;
+	}
+	return(ptr);
+}
+
+
+extern void * hashmap_get(HASHMAP mapptr, const void *key, size_t keylen)
+{
+	hashmap_t *map = mapptr;
+	assert(map);
+	assert(key);
+
+	hashmap_entry_t **ptr = find(map, key, keylen, hashmap_hash(key, keylen));
+	return(*ptr ? (*ptr)->value : NULL);
+}
+
+
+extern void hashmap_set(HASHMAP mapptr, const void *key, size_t keylen, void *value)
+{
+	hashmap_t *map = mapptr;
+	assert(map);
+	assert(key);
+
+	unsigned long long hash = hashmap_hash(key, keylen);
+	hashmap_entry_t **ptr = find(map, key, keylen, hash);
+	if (*ptr) {
+		(*ptr)->value = value;
+		return;
+	}
+
+	hashmap_entry_t *entry = malloc(sizeof(hashmap_entry_t) + keylen);
+	assert(entry);
+	entry->next = NULL;
+	entry->hash = hash;
+	entry->value = value;
+	entry->keylen = keylen;
+	memcpy(entry->key, key, keylen);
+	*ptr = entry;
+
+	map->count ++;
+	if (map->count > map->buckets) {
+		grow(map);
+	}
+}
+
+
+extern void * hashmap_remove(HASHMAP mapptr, const void *key, size_t keylen)
+{
+	hashmap_t *map = mapptr;
+	assert(map);
+	assert(key);
+
+	void *value = NULL;
+	hashmap_entry_t **ptr = find(map, key, keylen, hashmap_hash(key, keylen));
+	if (*ptr) {
+		hashmap_entry_t *entry = *ptr;
+		*ptr = entry->next;
+		value = entry->value;
+		free(entry);
+		map->count --;
+		assert(map->count >= 0);
+	}
+	return(value);
+}
+
+
+extern int hashmap_count(HASHMAP mapptr)
+{
+	hashmap_t *map = mapptr;
+	assert(map);
+	return(map->count);
+}
+
+
+extern void hashmap_foreach(HASHMAP mapptr, void (*cb)(void *value, void *arg), void *arg)
+{
+	hashmap_t *map = mapptr;
+	assert(map);
+	assert(cb);
+
+	int i;
+	for (i=0; i < map->buckets; i++) {
+		hashmap_entry_t *entry = map->bucket[i];
+		while (entry) {
+			cb(entry->value, arg);
+			entry = entry->next;
+		}
+	}
+}
+
+
+// fin - hashmap.c
@@ -0,0 +1,41 @@
+// hashmap.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A generic hash map, keyed on a block of bytes.   No application specific code should be here.
+ * The key is copied into the map, the value is simply a pointer that is owned by the caller.
+*/
+
+#ifndef __HASHMAP_H
+#define __HASHMAP_H
+
+#include <stddef.h>
+
+typedef void * HASHMAP;
+
+HASHMAP hashmap_new(void);
+
+// free the map.  The values are not freed, they should be removed (or iterated and freed) before this is called.
+void hashmap_free(HASHMAP map);
+
+// get the value for a key.  Returns NULL if it is not in the map.
+void * hashmap_get(HASHMAP map, const void *key, size_t keylen);
+
+// set the value for a key, replacing any value that is already there.
+void hashmap_set(HASHMAP map, const void *key, size_t keylen, void *value);
+
+// remove the key from the map, and return the value that it had (or NULL if it was not in the map).
+void * hashmap_remove(HASHMAP map, const void *key, size_t keylen);
+
+int hashmap_count(HASHMAP map);
+
+// call 'cb' for each of the values in the map.  The map must not be changed while this is going on.
+void hashmap_foreach(HASHMAP map, void (*cb)(void *value, void *arg), void *arg);
+
+// the hash function used by the map, available for anything else that needs a quick hash of some bytes.
+unsigned long long hashmap_hash(const void *key, size_t keylen);
+
+
+#endif
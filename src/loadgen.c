@@ -0,0 +1,485 @@
+// loadgen.c
+
+/*
+ * Part of the FileKnock Daemon
+ * by Clinton Webb (webb.clint@gmail.com)
+ *
+ * End-to-end load benchmark.  Starts fileknockd in a temporary directory (with its own ./fileknock.d and ./fileknockd.conf), and then
+ * creates, writes and closes files across a number of directories at increasing rates.
+ *
+ * One file in every 'sample' is named so that the daemon runs an action for it.  The action is this same program, which records when
+ * it was started, so that the time from the file being closed until the action is running can be measured.  The rest of the files are
+ * filtered out by the daemon, so that the rate it can process events is not limited by how fast actions can be started.
+ *
+ * For each rate, one JSON object is written on a line of its own, followed by a summary:
+ *   - the rate of files (and inotify events) that were sustained.
+ *   - p50/p99/p999 of the event-to-action latency (microseconds).
+ *   - the number of times the inotify queue overflowed.
+ *   - the CPU used by the daemon (percent of one core) and its RSS.
+ *
+ * Usage: loadgen [-f fileknockd] [-d dirs] [-r rate,rate,...] [-t seconds] [-s size,size,...] [-n sample]
+*/
+
+
+#define _GNU_SOURCE		// for nftw() flags
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define MAX_LIST	32
+
+
+typedef struct {
+	char dir[64];		// the temporary directory that everything is in.
+	char results[128];	// where the actions write when they were run.
+	char stats[128];	// the metrics from the daemon.
+	pid_t daemon;
+	int dirs;
+	int sample;
+	long sizes[MAX_LIST];
+	int sizecount;
+	char *buffer;		// the data written to the files.
+	long long seq;		// the number of files written so far.
+	long long *closed;	// when each of the sampled files was closed, indexed by sequence / sample.
+	long long closedsize;
+	off_t resultsread;	// how much of the results file has been processed.
+} bench_t;
+
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+}
+
+
+static int compare(const void *a, const void *b)
+{
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+	return((x > y) - (x < y));
+}
+
+
+// parse a comma separated list of numbers.  Returns the number found.
+static int parse_list(const char *str, long *list, int max)
+{
+	int count = 0;
+	char *copy = strdup(str);
+	assert(copy);
+	char *next = copy;
+	char *item;
+	while ((item = strsep(&next, ",")) != NULL && count < max) {
+		if (item[0]) {
+			list[count++] = atol(item);
+		}
+	}
+	free(copy);
+	return(count);
+}
+
+
+// When run by the daemon as the action, record the file that it was run for, and when.
+static int run_action(void)
+{
+	long long now = now_ns();
+	const char *monitor = getenv("FK_MONITOR");
+	const char *file = getenv("FK_FILE");
+	if (monitor == NULL || file == NULL || file[0] != 's') {
+		return(1);
+	}
+
+	char path[strlen(monitor) + 16];
+	sprintf(path, "%s/../results", monitor);
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0) {
+		return(1);
+	}
+
+	// a single small write to a file opened for append is never mixed up with the writes of other actions running at the same time.
+	char line[64];
+	int len = snprintf(line, sizeof(line), "%lld %lld\n", atoll(file + 1), now);
+	if (write(fd, line, len) != len) {
+		close(fd);
+		return(1);
+	}
+	close(fd);
+	return(0);
+}
+
+
+static void write_file(const char *path, const char *config)
+{
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	fputs(config, fp);
+	fclose(fp);
+}
+
+
+// set up the temporary directory, and start the daemon in it.
+static void start_daemon(bench_t *bench, const char *daemon, const char *self)
+{
+	assert(bench);
+
+	strcpy(bench->dir, "/tmp/fkbench.XXXXXX");
+	if (mkdtemp(bench->dir) == NULL) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(bench->results, "%s/results", bench->dir);
+	sprintf(bench->stats, "%s/stats", bench->dir);
+
+	char path[256];
+	char config[1024];
+	sprintf(path, "%s/data", bench->dir);
+	mkdir(path, 0755);
+	int i;
+	for (i=0; i < bench->dirs; i++) {
+		sprintf(path, "%s/data/d%03d", bench->dir, i);
+		mkdir(path, 0755);
+	}
+	sprintf(path, "%s/fileknock.d", bench->dir);
+	mkdir(path, 0755);
+
+	sprintf(path, "%s/fileknock.d/bench.conf", bench->dir);
+	snprintf(config, sizeof(config), "MonitorPathRecursive=%s/data\nFileClosedWriteExec=%s\nIncludePattern=s*.act\n", bench->dir, self);
+	write_file(path, config);
+
+	sprintf(path, "%s/fileknockd.conf", bench->dir);
+	snprintf(config, sizeof(config), "StatsFile=%s\nStatsIntervalMs=100\nMaxQueuedActions=100000\n", bench->stats);
+	write_file(path, config);
+
+	bench->daemon = fork();
+	if (bench->daemon < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	else if (bench->daemon == 0) {
+		if (chdir(bench->dir) != 0) { _exit(127); }
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execl(daemon, daemon, (char *) NULL);
+		_exit(127);
+	}
+
+	// the stats file is written once the daemon has set up its watches, and is in its main loop.
+	long long start = now_ns();
+	while (access(bench->stats, R_OK) != 0) {
+		if (now_ns() - start > 10000000000LL || waitpid(bench->daemon, NULL, WNOHANG) != 0) {
+			fprintf(stderr, "fileknockd did not start (%s)\n", daemon);
+			exit(EXIT_FAILURE);
+		}
+		usleep(10000);
+	}
+}
+
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+	remove(path);
+	return(0);
+}
+
+
+static void stop_daemon(bench_t *bench)
+{
+	assert(bench);
+	kill(bench->daemon, SIGTERM);
+	waitpid(bench->daemon, NULL, 0);
+	nftw(bench->dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+
+// get a value from the daemon's stats file (0 if it is not there).
+static long long read_stat(bench_t *bench, const char *name)
+{
+	assert(bench);
+	assert(name);
+
+	long long value = 0;
+	FILE *fp = fopen(bench->stats, "r");
+	if (fp) {
+		char line[512];
+		size_t len = strlen(name);
+		while (fgets(line, sizeof(line), fp)) {
+			if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+				value = atoll(line + len + 1);
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	return(value);
+}
+
+
+// the CPU time (in clock ticks) used by the daemon so far.
+static long long daemon_cpu(bench_t *bench)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/stat", bench->daemon);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return(0);
+	}
+	char line[1024];
+	long long ticks = 0;
+	if (fgets(line, sizeof(line), fp)) {
+		// the fields after the command name (which can have spaces in it).  utime and stime are the 14th and 15th fields.
+		char *ptr = strrchr(line, ')');
+		unsigned long long utime = 0, stime = 0;
+		if (ptr && sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2) {
+			ticks = utime + stime;
+		}
+	}
+	fclose(fp);
+	return(ticks);
+}
+
+
+static long daemon_rss(bench_t *bench)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/status", bench->daemon);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		return(0);
+	}
+	char line[256];
+	long rss = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			rss = atol(line + 6);
+		}
+	}
+	fclose(fp);
+	return(rss);
+}
+
+
+// create, write and close one file.
+static void make_file(bench_t *bench)
+{
+	assert(bench);
+
+	long long seq = bench->seq ++;
+	char path[256];
+	int sampled = (seq % bench->sample) == 0;
+	if (sampled) {
+		sprintf(path, "%s/data/d%03d/s%lld.act", bench->dir, (int) (seq % bench->dirs), seq);
+	}
+	else {
+		// the other files are re-used, so that the directories do not grow without limit.
+		sprintf(path, "%s/data/d%03d/f%lld.dat", bench->dir, (int) (seq % bench->dirs), (seq / bench->dirs) % 256);
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	long size = bench->sizes[seq % bench->sizecount];
+	if (size > 0 && write(fd, bench->buffer, size) != size) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	// the event is generated by the close, so the time is taken just before it.
+	long long closing = now_ns();
+	close(fd);
+
+	if (sampled) {
+		long long index = seq / bench->sample;
+		if (index >= bench->closedsize) {
+			bench->closedsize = bench->closedsize ? bench->closedsize * 2 : 4096;
+			bench->closed = realloc(bench->closed, sizeof(long long) * bench->closedsize);
+			assert(bench->closed);
+		}
+		bench->closed[index] = closing;
+	}
+}
+
+
+// collect the latencies reported by the actions since the last time.  Returns the number added to 'latencies'.
+static int read_results(bench_t *bench, long long *latencies, int max)
+{
+	int count = 0;
+	FILE *fp = fopen(bench->results, "r");
+	if (fp == NULL) {
+		return(0);
+	}
+	fseeko(fp, bench->resultsread, SEEK_SET);
+	char line[128];
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len = strlen(line);
+		if (len == 0 || line[len - 1] != '\n') {
+			// only part of the line has been written so far.
+			break;
+		}
+		bench->resultsread += len;
+		long long seq, when;
+		if (sscanf(line, "%lld %lld", &seq, &when) == 2 && seq % bench->sample == 0 && seq / bench->sample < bench->closedsize && count < max) {
+			latencies[count++] = when - bench->closed[seq / bench->sample];
+		}
+	}
+	fclose(fp);
+	return(count);
+}
+
+
+int main(int argc, char **argv)
+{
+	// when the daemon runs us as the action.
+	if (getenv("FK_ACTION")) {
+		return(run_action());
+	}
+
+	bench_t bench;
+	memset(&bench, 0, sizeof(bench));
+	bench.dirs = 16;
+	bench.sample = 100;
+	bench.sizecount = parse_list("0,4096,65536", bench.sizes, MAX_LIST);
+	long rates[MAX_LIST];
+	int ratecount = parse_list("1000,5000,20000,50000,100000", rates, MAX_LIST);
+	int seconds = 2;
+	const char *daemon = "./fileknockd";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "f:d:r:t:s:n:")) != -1) {
+		switch (opt) {
+			case 'f': daemon = optarg; break;
+			case 'd': bench.dirs = atoi(optarg); break;
+			case 'r': ratecount = parse_list(optarg, rates, MAX_LIST); break;
+			case 't': seconds = atoi(optarg); break;
+			case 's': bench.sizecount = parse_list(optarg, bench.sizes, MAX_LIST); break;
+			case 'n': bench.sample = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-f fileknockd] [-d dirs] [-r rate,rate,...] [-t seconds] [-s size,size,...] [-n sample]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (bench.dirs <= 0 || bench.sample <= 0 || seconds <= 0 || ratecount == 0 || bench.sizecount == 0) {
+		fprintf(stderr, "Invalid options.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	long maxsize = 0;
+	int i;
+	for (i=0; i < bench.sizecount; i++) {
+		if (bench.sizes[i] > maxsize) { maxsize = bench.sizes[i]; }
+	}
+	bench.buffer = calloc(1, maxsize + 1);
+	assert(bench.buffer);
+
+	// the action needs the full path to this program, as it is run from the daemon's directory.
+	char self[4096];
+	ssize_t selflen = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (selflen <= 0) {
+		perror("readlink");
+		exit(EXIT_FAILURE);
+	}
+	self[selflen] = 0;
+
+	char daemonpath[4096];
+	if (realpath(daemon, daemonpath) == NULL) {
+		perror(daemon);
+		exit(EXIT_FAILURE);
+	}
+
+	start_daemon(&bench, daemonpath, self);
+
+	long ticks = sysconf(_SC_CLK_TCK);
+	double sustained = 0;
+	long overflowat = -1;
+
+	int phase;
+	for (phase=0; phase < ratecount; phase++) {
+		long rate = rates[phase];
+		long long events_before = read_stat(&bench, "events.read");
+		long long overflow_before = read_stat(&bench, "events.overflow");
+		long long cpu_before = daemon_cpu(&bench);
+		long long first = bench.seq;
+
+		// create the files at a steady rate, catching up in bursts if we fall behind.
+		long long start = now_ns();
+		long long duration = seconds * 1000000000LL;
+		long long elapsed;
+		while ((elapsed = now_ns() - start) < duration) {
+			long long due = first + ((elapsed * rate) / 1000000000LL);
+			if (bench.seq < due) {
+				make_file(&bench);
+			}
+			else {
+				struct timespec pause = { 0, 50000 };
+				nanosleep(&pause, NULL);
+			}
+		}
+		long long files = bench.seq - first;
+		double actual = (now_ns() - start) / 1000000000.0;
+
+		// give the daemon (and the actions) time to catch up.  The stats file is rewritten every 100ms.
+		int samples = (int) ((bench.seq + bench.sample - 1) / bench.sample - (first + bench.sample - 1) / bench.sample);
+		long long *latencies = calloc(samples + 1, sizeof(long long));
+		assert(latencies);
+		int got = 0;
+		long long waitstart = now_ns();
+		while (got < samples && now_ns() - waitstart < 5000000000LL) {
+			usleep(20000);
+			got += read_results(&bench, latencies + got, samples - got);
+		}
+		long long events = 0, lastevents = -1;
+		while (events != lastevents && now_ns() - waitstart < 10000000000LL) {
+			lastevents = events;
+			usleep(250000);
+			events = read_stat(&bench, "events.read") - events_before;
+		}
+		double cpu = ((daemon_cpu(&bench) - cpu_before) / (double) ticks) * 100.0 / actual;
+		long long overflows = read_stat(&bench, "events.overflow") - overflow_before;
+
+		qsort(latencies, got, sizeof(long long), compare);
+		long long p50 = got ? latencies[(got * 500) / 1000] / 1000 : 0;
+		long long p99 = got ? latencies[(got * 990) / 1000] / 1000 : 0;
+		long long p999 = got ? latencies[(got * 999) / 1000] / 1000 : 0;
+		free(latencies);
+
+		double filerate = files / actual;
+		printf("{\"phase\":%d,\"target_files_per_sec\":%ld,\"files_per_sec\":%.1f,\"events_per_sec\":%.1f,\"overflows\":%lld,"
+			"\"samples\":%d,\"samples_seen\":%d,\"latency_p50_us\":%lld,\"latency_p99_us\":%lld,\"latency_p999_us\":%lld,"
+			"\"daemon_cpu_pct\":%.1f,\"daemon_rss_kb\":%ld}\n",
+			phase + 1, rate, filerate, events / actual, overflows, samples, got, p50, p99, p999, cpu, daemon_rss(&bench));
+		fflush(stdout);
+
+		if (overflows > 0 && overflowat < 0) {
+			overflowat = rate;
+		}
+		if (overflows == 0 && got == samples && filerate > sustained) {
+			sustained = filerate;
+		}
+	}
+
+	printf("{\"summary\":1,\"dirs\":%d,\"sample\":%d,\"seconds\":%d,\"sustained_files_per_sec\":%.1f,\"overflow_threshold_files_per_sec\":%ld,\"daemon_rss_kb\":%ld}\n",
+		bench.dirs, bench.sample, seconds, sustained, overflowat, daemon_rss(&bench));
+
+	stop_daemon(&bench);
+	return(0);
+}
+
+
+// fin - loadgen.c
@@ -0,0 +1,476 @@
+// logger.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A logger that never makes the caller wait for the output.   No application specific code should be here.
+ * See logger.h for details.
+*/
+
+
+#include "logger.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// the messages are collected into this before being written, so that a burst of them is one write.
+#define OUTPUT_SIZE		65536
+
+// how long the thread sleeps when there is nothing to write, if it is not woken.
+#define IDLE_MS			1000
+
+
+// A slot in the ring.  Its sequence says whose turn it is: when it equals the position of the slot, it is free for the producer
+// at that position, and when it is one more, the message in it is ready for the thread to write out.
+typedef struct {
+	atomic_ulong seq;
+	long long time;		// nanoseconds since the epoch.
+	int level;
+	int len;
+	char text[LOGGER_MESSAGE_MAX];
+} slot_t;
+
+
+typedef struct {
+	slot_t *slots;
+	unsigned long mask;
+	atomic_ulong tail;		// the next position for a producer to take.
+	unsigned long head;		// the next position for the thread to write out.  Only used by the thread.
+	atomic_ulong written;	// the same, for logger_flush() to look at.
+
+	int fd;
+	int level;
+	int format;
+
+	pthread_t thread;
+	int wakefd;
+	atomic_int sleeping;	// the thread is (about to be) waiting, so it needs to be woken when a message is added.
+	atomic_int stop;
+	atomic_llong dropped;
+
+	char *output;			// only used by the thread.
+	size_t outlen;
+	int outfd;
+} logger_t;
+
+
+static const char *level_names[] = { "error", "warning", "info", "debug" };
+
+
+
+static long long realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return(((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+}
+
+
+static void wake(logger_t *logger)
+{
+	assert(logger);
+	if (atomic_exchange(&logger->sleeping, 0)) {
+		uint64_t one = 1;
+		while (write(logger->wakefd, &one, sizeof(one)) < 0 && errno == EINTR);
+	}
+}
+
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t sent = write(fd, buf, len);
+		if (sent < 0) {
+			if (errno == EINTR) { continue; }
+			// there is nowhere to report it.
+			return;
+		}
+		buf += sent;
+		len -= sent;
+	}
+}
+
+
+static void output_flush(logger_t *logger)
+{
+	assert(logger);
+	if (logger->outlen > 0) {
+		write_all(logger->outfd, logger->output, logger->outlen);
+		logger->outlen = 0;
+	}
+}
+
+
+// make room in the output for 'len' bytes that are going to 'fd'.
+static void output_reserve(logger_t *logger, int fd, size_t len)
+{
+	assert(logger);
+	assert(len <= OUTPUT_SIZE);
+	if (fd != logger->outfd || logger->outlen + len > OUTPUT_SIZE) {
+		output_flush(logger);
+		logger->outfd = fd;
+	}
+}
+
+
+static void output_json(logger_t *logger, slot_t *slot)
+{
+	assert(logger);
+	assert(slot);
+
+	// every character could need escaping as \u00XX.
+	output_reserve(logger, logger->fd, 96 + (slot->len * 6));
+	char *out = logger->output + logger->outlen;
+
+	time_t secs = slot->time / 1000000000LL;
+	struct tm tm;
+	gmtime_r(&secs, &tm);
+	out += sprintf(out, "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06dZ\",\"level\":\"%s\",\"msg\":\"",
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int) ((slot->time % 1000000000LL) / 1000),
+		level_names[slot->level]);
+
+	int i;
+	for (i=0; i < slot->len; i++) {
+		unsigned char c = slot->text[i];
+		if (c == '"' || c == '\\') {
+			*out++ = '\\';
+			*out++ = c;
+		}
+		else if (c == '\n') { *out++ = '\\'; *out++ = 'n'; }
+		else if (c == '\t') { *out++ = '\\'; *out++ = 't'; }
+		else if (c < 0x20) {
+			out += sprintf(out, "\\u%04x", c);
+		}
+		else {
+			*out++ = c;
+		}
+	}
+	*out++ = '"';
+	*out++ = '}';
+	*out++ = '\n';
+	logger->outlen = out - logger->output;
+}
+
+
+static void output_slot(logger_t *logger, slot_t *slot)
+{
+	assert(logger);
+	assert(slot);
+
+	if (logger->format == LOGGER_JSON) {
+		output_json(logger, slot);
+	}
+	else if (logger->format == LOGGER_BINARY) {
+		uint64_t time = slot->time;
+		uint8_t head[4] = { slot->level, 0, 0, 0 };
+		uint16_t len = slot->len;
+		memcpy(head + 2, &len, sizeof(len));
+		output_reserve(logger, logger->fd, sizeof(time) + sizeof(head) + len);
+		memcpy(logger->output + logger->outlen, &time, sizeof(time));
+		memcpy(logger->output + logger->outlen + sizeof(time), head, sizeof(head));
+		memcpy(logger->output + logger->outlen + sizeof(time) + sizeof(head), slot->text, len);
+		logger->outlen += sizeof(time) + sizeof(head) + len;
+	}
+	else {
+		int fd = logger->fd >= 0 ? logger->fd : (slot->level <= LOGGER_WARNING ? STDERR_FILENO : STDOUT_FILENO);
+		output_reserve(logger, fd, slot->len + 1);
+		memcpy(logger->output + logger->outlen, slot->text, slot->len);
+		logger->output[logger->outlen + slot->len] = '\n';
+		logger->outlen += slot->len + 1;
+	}
+}
+
+
+// take the messages that are ready out of the ring.  Returns the number there were.
+static int drain(logger_t *logger)
+{
+	assert(logger);
+	int count = 0;
+	for (;;) {
+		slot_t *slot = &logger->slots[logger->head & logger->mask];
+		if (atomic_load(&slot->seq) != logger->head + 1) {
+			break;
+		}
+		output_slot(logger, slot);
+
+		// the slot is free for the producer that will get to it next time around the ring.
+		atomic_store(&slot->seq, logger->head + logger->mask + 1);
+		logger->head ++;
+		count ++;
+	}
+	output_flush(logger);
+	atomic_store(&logger->written, logger->head);
+	return(count);
+}
+
+
+static void * logger_main(void *arg)
+{
+	logger_t *logger = arg;
+	assert(logger);
+
+	struct pollfd pfd;
+	pfd.fd = logger->wakefd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		if (drain(logger) > 0) {
+			continue;
+		}
+		if (atomic_load(&logger->stop)) {
+			break;
+		}
+
+		// it says it is going to sleep before looking again, so that a message added after this will wake it.
+		atomic_store(&logger->sleeping, 1);
+		if (drain(logger) > 0) {
+			atomic_store(&logger->sleeping, 0);
+			continue;
+		}
+		if (poll(&pfd, 1, IDLE_MS) > 0) {
+			uint64_t value;
+			while (read(logger->wakefd, &value, sizeof(value)) < 0 && errno == EINTR);
+		}
+		atomic_store(&logger->sleeping, 0);
+	}
+	return(NULL);
+}
+
+
+extern LOGGER logger_new(int fd, int level, int format, int entries)
+{
+	assert(level >= LOGGER_ERROR && level <= LOGGER_DEBUG);
+	assert(format == LOGGER_TEXT || format == LOGGER_JSON || format == LOGGER_BINARY);
+	assert(entries > 0);
+
+	logger_t *logger = calloc(1, sizeof(logger_t));
+	assert(logger);
+	logger->fd = fd;
+	if (format != LOGGER_TEXT && fd < 0) {
+		// everything needs to be in the one stream.
+		logger->fd = STDOUT_FILENO;
+	}
+	logger->level = level;
+	logger->format = format;
+	logger->outfd = logger->fd;
+
+	// the size is rounded up to a power of 2, so that the position in the ring is a mask rather than a divide.
+	unsigned long slots = 1;
+	while (slots < (unsigned long) entries) {
+		slots <<= 1;
+	}
+	logger->mask = slots - 1;
+	logger->slots = calloc(slots, sizeof(slot_t));
+	assert(logger->slots);
+	unsigned long i;
+	for (i=0; i < slots; i++) {
+		atomic_init(&logger->slots[i].seq, i);
+	}
+	atomic_init(&logger->tail, 0);
+	atomic_init(&logger->written, 0);
+	atomic_init(&logger->sleeping, 0);
+	atomic_init(&logger->stop, 0);
+	atomic_init(&logger->dropped, 0);
+
+	logger->output = malloc(OUTPUT_SIZE);
+	assert(logger->output);
+
+	// the thread takes none of the signals.  The logger is usually started before the caller blocks the ones it waits for (eg, with a
+	// signalfd), and one given to this thread would have its default action (which for SIGUSR1 is to end the process).
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	logger->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int started = (logger->wakefd >= 0 && pthread_create(&logger->thread, NULL, logger_main, logger) == 0);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (started == 0) {
+		if (logger->wakefd >= 0) { close(logger->wakefd); }
+		free(logger->output);
+		free(logger->slots);
+		free(logger);
+		return(NULL);
+	}
+	return((LOGGER) logger);
+}
+
+
+extern void logger_free(LOGGER loggerptr)
+{
+	logger_t *logger = loggerptr;
+	assert(logger);
+
+	// the thread writes out everything before it stops.
+	atomic_store(&logger->stop, 1);
+	atomic_store(&logger->sleeping, 1);
+	wake(logger);
+	pthread_join(logger->thread, NULL);
+
+	close(logger->wakefd);
+	free(logger->output);
+	free(logger->slots);
+	free(logger);
+}
+
+
+extern int logger_level(const char *name)
+{
+	assert(name);
+	int i;
+	for (i=LOGGER_ERROR; i <= LOGGER_DEBUG; i++) {
+		if (strcasecmp(name, level_names[i]) == 0) {
+			return(i);
+		}
+	}
+	if (strcasecmp(name, "warn") == 0) {
+		return(LOGGER_WARNING);
+	}
+	return(-1);
+}
+
+
+extern int logger_format(const char *name)
+{
+	assert(name);
+	if (strcasecmp(name, "text") == 0)		{ return(LOGGER_TEXT); }
+	if (strcasecmp(name, "json") == 0)		{ return(LOGGER_JSON); }
+	if (strcasecmp(name, "binary") == 0)	{ return(LOGGER_BINARY); }
+	return(-1);
+}
+
+
+extern int logger_enabled(LOGGER loggerptr, int level)
+{
+	logger_t *logger = loggerptr;
+	assert(logger);
+	return(level <= logger->level);
+}
+
+
+extern void logger_vwrite(LOGGER loggerptr, int level, const char *fmt, va_list args)
+{
+	logger_t *logger = loggerptr;
+	assert(logger);
+	assert(level >= LOGGER_ERROR && level <= LOGGER_DEBUG);
+	assert(fmt);
+
+	if (level > logger->level) {
+		return;
+	}
+
+	// claim a slot.  Any number of threads can be doing this at once.
+	unsigned long pos = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+	slot_t *slot;
+	for (;;) {
+		slot = &logger->slots[pos & logger->mask];
+		unsigned long seq = atomic_load(&slot->seq);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak(&logger->tail, &pos, pos + 1)) {
+				break;
+			}
+			// another thread got it, and 'pos' has been updated to where it got to.
+		}
+		else if ((long) (seq - pos) < 0) {
+			// the slot still has the message from the last time around the ring in it, so it is full.
+			atomic_fetch_add(&logger->dropped, 1);
+			return;
+		}
+		else {
+			pos = atomic_load_explicit(&logger->tail, memory_order_relaxed);
+		}
+	}
+
+	slot->time = realtime_ns();
+	slot->level = level;
+	int len = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+	if (len < 0) { len = 0; }
+	if (len >= (int) sizeof(slot->text)) {
+		len = sizeof(slot->text) - 1;
+		memcpy(slot->text + len - 3, "...", 3);
+	}
+	slot->len = len;
+	atomic_store(&slot->seq, pos + 1);
+
+	wake(logger);
+}
+
+
+extern void logger_write(LOGGER logger, int level, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	logger_vwrite(logger, level, fmt, args);
+	va_end(args);
+}
+
+
+extern void logger_limited(LOGGER loggerptr, LOGLIMIT *limit, int persec, int level, const char *fmt, ...)
+{
+	logger_t *logger = loggerptr;
+	assert(logger);
+	assert(limit);
+	assert(persec > 0);
+
+	if (level > logger->level) {
+		return;
+	}
+
+	long long second = realtime_ns() / 1000000000LL;
+	if (second != limit->second) {
+		limit->second = second;
+		limit->count = 0;
+	}
+	if (limit->count >= persec) {
+		limit->suppressed ++;
+		return;
+	}
+	limit->count ++;
+
+	if (limit->suppressed > 0) {
+		logger_write(logger, level, "(%d similar messages were not logged)", limit->suppressed);
+		limit->suppressed = 0;
+	}
+	va_list args;
+	va_start(args, fmt);
+	logger_vwrite(logger, level, fmt, args);
+	va_end(args);
+}
+
+
+extern void logger_flush(LOGGER loggerptr)
+{
+	logger_t *logger = loggerptr;
+	assert(logger);
+
+	unsigned long tail = atomic_load(&logger->tail);
+	while ((long) (atomic_load(&logger->written) - tail) < 0) {
+		atomic_store(&logger->sleeping, 1);
+		wake(logger);
+		struct timespec ts = { 0, 1000000 };
+		nanosleep(&ts, NULL);
+	}
+}
+
+
+extern long long logger_dropped(LOGGER loggerptr)
+{
+	logger_t *logger = loggerptr;
+	assert(logger);
+	return(atomic_load(&logger->dropped));
+}
+
+
+// fin - logger.c
@@ -0,0 +1,74 @@
+// logger.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A logger that never makes the caller wait for the output.   No application specific code should be here.
+ * Each message is formatted into a slot in a ring (by the thread that logs it, which can be any thread), and a thread of the
+ * logger writes them out.  If the output is slow (eg, a pipe that is not being read), the ring fills up, and the messages that
+ * do not fit are dropped (and counted) rather than holding up the caller.  Messages longer than LOGGER_MESSAGE_MAX are cut short.
+ *
+ * The output can be:
+ *   LOGGER_TEXT   - each message on a line of its own.  If no fd is given, warnings and errors go to stderr and the rest to stdout.
+ *   LOGGER_JSON   - a JSON object on each line, {"time":"2024-01-02T03:04:05.678901Z","level":"info","msg":"..."}
+ *   LOGGER_BINARY - a record for each message: the time (uint64_t nanoseconds since the epoch), the level (uint8_t), a zero byte,
+ *                   the length of the message (uint16_t), and then the message (not terminated).  All in the byte order of the host.
+*/
+
+#ifndef __LOGGER_H
+#define __LOGGER_H
+
+#include <stdarg.h>
+
+typedef void * LOGGER;
+
+#define LOGGER_ERROR	0
+#define LOGGER_WARNING	1
+#define LOGGER_INFO		2
+#define LOGGER_DEBUG	3
+
+#define LOGGER_TEXT		0
+#define LOGGER_JSON		1
+#define LOGGER_BINARY	2
+
+#define LOGGER_MESSAGE_MAX	480
+
+// Used to limit how often a message (usually from one place in the code) is logged.  Each one should only be used by one thread.
+typedef struct {
+	long long second;	// the second that the messages are being counted for.
+	int count;
+	int suppressed;		// the messages that were not logged, which are reported with the next one that is.
+} LOGLIMIT;
+
+#define LOGLIMIT_INIT	{ 0, 0, 0 }
+
+// Start the logger.  The messages are written to 'fd' (-1 for stdout and stderr, see above), which the logger does not close.
+// Only the messages at 'level' or more important (ie, a lower number) are logged.  'entries' is the size of the ring.
+// Returns NULL if the thread could not be started.
+LOGGER logger_new(int fd, int level, int format, int entries);
+
+// Write out everything that has been logged, and stop the thread.
+void logger_free(LOGGER logger);
+
+// Parse the name of a level (error, warning, info, debug) or format (text, json, binary).  Returns -1 if it is not known.
+int logger_level(const char *name);
+int logger_format(const char *name);
+
+// returns non-zero if messages at this level are logged, for when it is worth avoiding the work of preparing them.
+int logger_enabled(LOGGER logger, int level);
+
+void logger_write(LOGGER logger, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void logger_vwrite(LOGGER logger, int level, const char *fmt, va_list args);
+
+// Log a message, unless more than 'persec' have already been logged through 'limit' this second.
+void logger_limited(LOGGER logger, LOGLIMIT *limit, int persec, int level, const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+// Wait until everything logged so far has been written out (eg, before writing to the same output directly).
+void logger_flush(LOGGER logger);
+
+// the number of messages that were dropped because the ring was full.
+long long logger_dropped(LOGGER logger);
+
+
+#endif
@@ -0,0 +1,246 @@
+// metrics.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Counters, gauges and histograms that can be updated without taking a lock.   No application specific code should be here.
+ * See metrics.h for details.
+*/
+
+
+#include "metrics.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+// the list of metrics never moves, so that they can be updated while another one is being registered.
+#define MAX_METRICS		128
+
+// bucket 0 is for values of 0 (or less), and bucket n is for values from 2^(n-1) up to 2^n - 1.
+#define BUCKETS			64
+
+#define TYPE_COUNTER	0
+#define TYPE_GAUGE		1
+#define TYPE_HISTOGRAM	2
+
+
+typedef struct {
+	char *name;
+	int type;
+	atomic_llong value;		// counters and gauges.  For histograms, this is the number of values.
+	atomic_llong sum;
+	atomic_llong max;
+	atomic_llong bucket[BUCKETS];
+} metric_t;
+
+
+typedef struct {
+	int count;
+	metric_t *metric[MAX_METRICS];
+} metrics_t;
+
+
+
+extern METRICS metrics_new(void)
+{
+	metrics_t *metrics = calloc(1, sizeof(metrics_t));
+	assert(metrics);
+	return((METRICS) metrics);
+}
+
+
+extern void metrics_free(METRICS metricsptr)
+{
+	metrics_t *metrics = metricsptr;
+	assert(metrics);
+	while (metrics->count > 0) {
+		metrics->count --;
+		free(metrics->metric[metrics->count]->name);
+		free(metrics->metric[metrics->count]);
+	}
+	free(metrics);
+}
+
+
+static int add_metric(metrics_t *metrics, const char *name, int type)
+{
+	assert(metrics);
+	assert(name);
+
+	int i;
+	for (i=0; i < metrics->count; i++) {
+		if (strcmp(metrics->metric[i]->name, name) == 0) {
+			assert(metrics->metric[i]->type == type);
+			return(i);
+		}
+	}
+
+	assert(metrics->count < MAX_METRICS);
+	metric_t *metric = calloc(1, sizeof(metric_t));
+	assert(metric);
+	metric->name = strdup(name);
+	assert(metric->name);
+	metric->type = type;
+	metrics->metric[metrics->count] = metric;
+	metrics->count ++;
+	return(metrics->count - 1);
+}
+
+
+extern int metrics_counter(METRICS metricsptr, const char *name)
+{
+	return(add_metric(metricsptr, name, TYPE_COUNTER));
+}
+
+
+extern int metrics_gauge(METRICS metricsptr, const char *name)
+{
+	return(add_metric(metricsptr, name, TYPE_GAUGE));
+}
+
+
+extern int metrics_histogram(METRICS metricsptr, const char *name)
+{
+	return(add_metric(metricsptr, name, TYPE_HISTOGRAM));
+}
+
+
+static metric_t * get_metric(metrics_t *metrics, int id)
+{
+	assert(metrics);
+	assert(id >= 0 && id < metrics->count);
+	assert(metrics->metric[id]);
+	return(metrics->metric[id]);
+}
+
+
+extern void metrics_add(METRICS metricsptr, int id, long long value)
+{
+	metric_t *metric = get_metric(metricsptr, id);
+	assert(metric->type != TYPE_HISTOGRAM);
+	atomic_fetch_add_explicit(&metric->value, value, memory_order_relaxed);
+}
+
+
+extern void metrics_set(METRICS metricsptr, int id, long long value)
+{
+	metric_t *metric = get_metric(metricsptr, id);
+	assert(metric->type == TYPE_GAUGE);
+	atomic_store_explicit(&metric->value, value, memory_order_relaxed);
+}
+
+
+extern long long metrics_value(METRICS metricsptr, int id)
+{
+	metric_t *metric = get_metric(metricsptr, id);
+	return(atomic_load_explicit(&metric->value, memory_order_relaxed));
+}
+
+
+static int bucket_for(long long value)
+{
+	if (value <= 0) {
+		return(0);
+	}
+	return(64 - __builtin_clzll((unsigned long long) value));
+}
+
+
+extern void metrics_record(METRICS metricsptr, int id, long long value)
+{
+	metric_t *metric = get_metric(metricsptr, id);
+	assert(metric->type == TYPE_HISTOGRAM);
+
+	int b = bucket_for(value);
+	if (b >= BUCKETS) { b = BUCKETS - 1; }
+	atomic_fetch_add_explicit(&metric->bucket[b], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&metric->value, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&metric->sum, value, memory_order_relaxed);
+
+	long long max = atomic_load_explicit(&metric->max, memory_order_relaxed);
+	while (value > max && !atomic_compare_exchange_weak_explicit(&metric->max, &max, value, memory_order_relaxed, memory_order_relaxed)) {
+	}
+}
+
+
+// the value below which the given fraction (in thousandths) of the values are.  This is the top of the bucket, so it can be up to twice the real value.
+static long long percentile(long long *buckets, long long count, long long max, int thousandths)
+{
+	if (count == 0) {
+		return(0);
+	}
+
+	long long want = ((count * thousandths) + 999) / 1000;
+	long long seen = 0;
+	int b;
+	for (b=0; b < BUCKETS; b++) {
+		seen += buckets[b];
+		if (seen >= want) {
+			long long top = b == 0 ? 0 : (long long) ((1ULL << b) - 1);
+			return(top < max ? top : max);
+		}
+	}
+	return(max);
+}
+
+
+extern void metrics_write(METRICS metricsptr, FILE *fp)
+{
+	metrics_t *metrics = metricsptr;
+	assert(metrics);
+	assert(fp);
+
+	int i;
+	for (i=0; i < metrics->count; i++) {
+		metric_t *metric = metrics->metric[i];
+		assert(metric);
+
+		if (metric->type != TYPE_HISTOGRAM) {
+			fprintf(fp, "%s %lld\n", metric->name, atomic_load_explicit(&metric->value, memory_order_relaxed));
+		}
+		else {
+			// take a copy of the buckets, so that the percentiles all come from the same numbers (they can still be updated while this is going on).
+			long long buckets[BUCKETS];
+			long long count = 0;
+			int b;
+			for (b=0; b < BUCKETS; b++) {
+				buckets[b] = atomic_load_explicit(&metric->bucket[b], memory_order_relaxed);
+				count += buckets[b];
+			}
+			long long max = atomic_load_explicit(&metric->max, memory_order_relaxed);
+
+			fprintf(fp, "%s count=%lld sum=%lld max=%lld p50=%lld p99=%lld p999=%lld\n", metric->name, count,
+				atomic_load_explicit(&metric->sum, memory_order_relaxed), max,
+				percentile(buckets, count, max, 500), percentile(buckets, count, max, 990), percentile(buckets, count, max, 999));
+		}
+	}
+}
+
+
+extern int metrics_save(METRICS metricsptr, const char *path)
+{
+	assert(metricsptr);
+	assert(path);
+
+	char tmp[strlen(path) + 5];
+	sprintf(tmp, "%s.tmp", path);
+
+	FILE *fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		return(-1);
+	}
+	metrics_write(metricsptr, fp);
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return(-1);
+	}
+	return(0);
+}
+
+
+// fin - metrics.c
@@ -0,0 +1,44 @@
+// metrics.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Counters, gauges and histograms that can be updated from anywhere without taking a lock.   No application specific code should be here.
+ * Each metric is registered once (by name) and is then referred to by the id that is returned, so updating one is a single atomic add.
+ * Histograms have a bucket for each power of 2, which is enough to give the percentiles to within a factor of 2.
+*/
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdio.h>
+
+typedef void * METRICS;
+
+METRICS metrics_new(void);
+void metrics_free(METRICS metrics);
+
+// register a metric, and return the id that is used to update it.  Registering is not thread-safe, it should be done before anything
+// starts updating.  Registering a name that is already there returns the same id.
+int metrics_counter(METRICS metrics, const char *name);
+int metrics_gauge(METRICS metrics, const char *name);
+int metrics_histogram(METRICS metrics, const char *name);
+
+// counters (and gauges) are added to, gauges can also be set.
+void metrics_add(METRICS metrics, int id, long long value);
+void metrics_set(METRICS metrics, int id, long long value);
+long long metrics_value(METRICS metrics, int id);
+
+// add a value to a histogram.
+void metrics_record(METRICS metrics, int id, long long value);
+
+// write all the metrics as text, one per line.
+// Counters and gauges are "name value", histograms are "name count=N sum=N max=N p50=N p99=N p999=N".
+void metrics_write(METRICS metrics, FILE *fp);
+
+// write the metrics to a file, replacing it in one step (so that a reader never sees a partly written file).  Returns 0 on success.
+int metrics_save(METRICS metrics, const char *path);
+
+
+#endif
@@ -0,0 +1,198 @@
+// pathtrie.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A trie of filesystem paths, split on each component.   No application specific code should be here.
+ * See pathtrie.h for details.
+*/
+
+
+#include "pathtrie.h"
+#include "hashmap.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct {
+	HASHMAP children;	// keyed on the name of the component (NULL if there are none).
+	void **values;
+	int count;
+	int size;
+} pathnode_t;
+
+
+
+extern PATHTRIE pathtrie_new(void)
+{
+	pathnode_t *root = calloc(1, sizeof(pathnode_t));
+	assert(root);
+	return((PATHTRIE) root);
+}
+
+
+static void free_node(void *value, void *arg)
+{
+	pathnode_t *node = value;
+	assert(node);
+	if (node->children) {
+		hashmap_foreach(node->children, free_node, NULL);
+		hashmap_free(node->children);
+	}
+	if (node->values) { free(node->values); }
+	free(node);
+}
+
+
+extern void pathtrie_free(PATHTRIE trie)
+{
+	assert(trie);
+	free_node(trie, NULL);
+}
+
+
+// return the next component of the path, and its length.  Returns NULL when there are no more.
+static const char * next_component(const char *path, size_t *len)
+{
+	assert(path);
+	assert(len);
+
+	while (*path == '/') {
+		path ++;
+	}
+	if (*path == 0) {
+		return(NULL);
+	}
+
+	const char *end = strchr(path, '/');
+	*len = end ? (size_t) (end - path) : strlen(path);
+	return(path);
+}
+
+
+extern void pathtrie_add(PATHTRIE trie, const char *path, void *value)
+{
+	pathnode_t *node = trie;
+	assert(node);
+	assert(path);
+	assert(value);
+
+	const char *comp;
+	size_t len;
+	while ((comp = next_component(path, &len)) != NULL) {
+		if (node->children == NULL) {
+			node->children = hashmap_new();
+			assert(node->children);
+		}
+		pathnode_t *child = hashmap_get(node->children, comp, len);
+		if (child == NULL) {
+			child = calloc(1, sizeof(pathnode_t));
+			assert(child);
+			hashmap_set(node->children, comp, len, child);
+		}
+		node = child;
+		path = comp + len;
+	}
+
+	if (node->count >= node->size) {
+		node->size = node->size > 0 ? node->size * 2 : 4;
+		node->values = realloc(node->values, sizeof(void *) * node->size);
+		assert(node->values);
+	}
+	node->values[node->count ++] = value;
+}
+
+
+// remove the value from below the node, and return non-zero if the node is then empty (so that it can be removed as well).
+static int remove_below(pathnode_t *node, const char *path, void *value, int *removed)
+{
+	assert(node);
+	assert(path);
+	assert(removed);
+
+	size_t len;
+	const char *comp = next_component(path, &len);
+	if (comp == NULL) {
+		int i;
+		for (i=0; i < node->count; i++) {
+			if (node->values[i] == value) {
+				node->count --;
+				node->values[i] = node->values[node->count];
+				*removed = 1;
+				break;
+			}
+		}
+	}
+	else if (node->children) {
+		pathnode_t *child = hashmap_get(node->children, comp, len);
+		if (child && remove_below(child, comp + len, value, removed)) {
+			hashmap_remove(node->children, comp, len);
+			free_node(child, NULL);
+			if (hashmap_count(node->children) == 0) {
+				hashmap_free(node->children);
+				node->children = NULL;
+			}
+		}
+	}
+
+	return(node->count == 0 && node->children == NULL);
+}
+
+
+extern int pathtrie_remove(PATHTRIE trie, const char *path, void *value)
+{
+	assert(trie);
+	assert(path);
+
+	// the root itself is never freed, even when it is empty.
+	int removed = 0;
+	remove_below(trie, path, value, &removed);
+	return(removed ? 0 : -1);
+}
+
+
+extern int pathtrie_match(PATHTRIE trie, const char *path, pathtrie_cb cb, void *arg)
+{
+	pathnode_t *node = trie;
+	assert(node);
+	assert(path);
+	assert(cb);
+
+	// the number of components in the path is needed first, so that the depth of each value is known as it is found.
+	int total = 0;
+	const char *comp;
+	const char *p = path;
+	size_t len;
+	while ((comp = next_component(p, &len)) != NULL) {
+		total ++;
+		p = comp + len;
+	}
+
+	int found = 0;
+	int depth = 0;
+	for (;;) {
+		int i;
+		for (i=0; i < node->count; i++) {
+			cb(node->values[i], total - depth, arg);
+			found ++;
+		}
+
+		comp = next_component(path, &len);
+		if (comp == NULL || node->children == NULL) {
+			break;
+		}
+		node = hashmap_get(node->children, comp, len);
+		if (node == NULL) {
+			break;
+		}
+		depth ++;
+		path = comp + len;
+	}
+	return(found);
+}
+
+
+// fin - pathtrie.c
@@ -0,0 +1,36 @@
+// pathtrie.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A trie of filesystem paths, split on each component.   No application specific code should be here.
+ * Values are added for a path, and a lookup finds the values for that path and for every directory above it,
+ * so it costs one step for each component of the path, no matter how many paths are in the trie.
+*/
+
+#ifndef __PATHTRIE_H
+#define __PATHTRIE_H
+
+typedef void * PATHTRIE;
+
+// called for each value found by a lookup.  'depth' is the number of components in the path below the one the value was added for (0 for the path itself).
+typedef void (*pathtrie_cb)(void *value, int depth, void *arg);
+
+PATHTRIE pathtrie_new(void);
+
+// free the trie.  The values are not freed.
+void pathtrie_free(PATHTRIE trie);
+
+// add a value for a path.  A path can have any number of values.  Repeated and trailing slashes are ignored.
+void pathtrie_add(PATHTRIE trie, const char *path, void *value);
+
+// remove a value from a path.  Returns 0 if it was removed, or -1 if it was not there.
+int pathtrie_remove(PATHTRIE trie, const char *path, void *value);
+
+// call 'cb' for all the values of the path, and of each directory above it (the top-most first).  Returns the number of values found.
+// The trie must not be changed by the callback.
+int pathtrie_match(PATHTRIE trie, const char *path, pathtrie_cb cb, void *arg);
+
+
+#endif
@@ -0,0 +1,131 @@
+// pressure.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Reads the Pressure Stall Information of the kernel.   No application specific code should be here.
+ * See pressure.h for details.
+*/
+
+
+#include "pressure.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+typedef struct {
+	int fd;					// kept open, and read from the start each time.
+	long long total;		// the microseconds that tasks have been stalled, as of the last sample.
+	long long when;			// when it was taken (microseconds, monotonic).
+} pressure_t;
+
+
+
+static long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long) ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000));
+}
+
+
+// the total from the 'some' line, which looks like "some avg10=0.00 avg60=0.00 avg300=0.00 total=12345".
+static int read_total(pressure_t *pressure, long long *total)
+{
+	assert(pressure);
+	assert(total);
+
+	char buf[256];
+	ssize_t len = pread(pressure->fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		return(-1);
+	}
+	buf[len] = 0;
+
+	if (strncmp(buf, "some ", 5) != 0) {
+		return(-1);
+	}
+	char *eol = strchr(buf, '\n');
+	if (eol) { *eol = 0; }
+	char *field = strstr(buf, " total=");
+	if (field == NULL) {
+		return(-1);
+	}
+	*total = strtoll(field + 7, NULL, 10);
+	return(0);
+}
+
+
+extern PRESSURE pressure_new(const char *resource)
+{
+	assert(resource);
+
+	char path[64];
+	if (snprintf(path, sizeof(path), "/proc/pressure/%s", resource) >= (int) sizeof(path)) {
+		errno = EINVAL;
+		return(NULL);
+	}
+
+	pressure_t *pressure = calloc(1, sizeof(pressure_t));
+	assert(pressure);
+	pressure->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (pressure->fd < 0) {
+		free(pressure);
+		return(NULL);
+	}
+
+	// PSI can be built in but turned off (psi=0 on the kernel command line), in which case the file is there, but cannot be read.
+	if (read_total(pressure, &pressure->total) != 0) {
+		close(pressure->fd);
+		free(pressure);
+		errno = EOPNOTSUPP;
+		return(NULL);
+	}
+	pressure->when = now_us();
+	return((PRESSURE) pressure);
+}
+
+
+extern void pressure_free(PRESSURE pressureptr)
+{
+	pressure_t *pressure = pressureptr;
+	assert(pressure);
+	close(pressure->fd);
+	free(pressure);
+}
+
+
+extern int pressure_sample(PRESSURE pressureptr)
+{
+	pressure_t *pressure = pressureptr;
+	assert(pressure);
+
+	long long total;
+	if (read_total(pressure, &total) != 0) {
+		return(-1);
+	}
+	long long now = now_us();
+	long long stalled = total - pressure->total;
+	long long elapsed = now - pressure->when;
+	pressure->total = total;
+	pressure->when = now;
+
+	if (elapsed <= 0 || stalled <= 0) {
+		return(0);
+	}
+	if (stalled >= elapsed) {
+		return(100);
+	}
+	return((int) ((stalled * 100) / elapsed));
+}
+
+
+// fin - pressure.c
@@ -0,0 +1,27 @@
+// pressure.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Reads the Pressure Stall Information of the kernel (/proc/pressure/cpu, io and memory, Linux 4.20 or later).   No application
+ * specific code should be here.
+ * Rather than the averages that the kernel gives (which are over 10 seconds at the least), the total stall time is compared with what
+ * it was last time, so the pressure is for exactly the time since it was last looked at.
+*/
+
+#ifndef __PRESSURE_H
+#define __PRESSURE_H
+
+typedef void * PRESSURE;
+
+// 'resource' is cpu, io or memory.  Returns NULL (with errno set) if the kernel does not have it.
+PRESSURE pressure_new(const char *resource);
+void pressure_free(PRESSURE pressure);
+
+// the percentage (0 to 100) of the time since it was last called (or created) that some tasks were stalled waiting for the resource.
+// Returns -1 if it could not be read.
+int pressure_sample(PRESSURE pressure);
+
+
+#endif
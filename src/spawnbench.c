@@ -0,0 +1,152 @@
+// spawnbench.c
+
+/*
+ * Part of the FileKnock Daemon
+ * by Clinton Webb (webb.clint@gmail.com)
+ *
+ * Measures how long it takes to start an action with fork()+execve() compared to posix_spawn(), while the process is holding
+ * a watch table of a given size.  The time measured is from just before the action is started, until the daemon would be able
+ * to carry on processing events (ie, until fork() or posix_spawn() returns in the parent).
+ *
+ * Usage: spawnbench [runs] [watches...]
+ *        (defaults to 500 runs, with 1000 and 100000 watches)
+*/
+
+
+#include <assert.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wdindex.h"
+
+
+#define ACTION "/bin/true"
+
+
+// roughly what the daemon keeps for each watch.
+typedef struct {
+	int wd;
+	char *path;
+	void *rule;
+	int index;
+} benchwatch_t;
+
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec);
+}
+
+
+static int compare(const void *a, const void *b)
+{
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+	return((x > y) - (x < y));
+}
+
+
+static pid_t start_fork(char **argv, char **envp)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		execve(argv[0], argv, envp);
+		_exit(127);
+	}
+	return(pid);
+}
+
+
+static pid_t start_spawn(char **argv, char **envp)
+{
+	pid_t pid = -1;
+	if (posix_spawn(&pid, argv[0], NULL, NULL, argv, envp) != 0) {
+		return(-1);
+	}
+	return(pid);
+}
+
+
+static void run(const char *method, pid_t (*start)(char **, char **), int watches, int runs)
+{
+	char *argv[] = { ACTION, NULL };
+	char *envp[] = { "FK_PATH=/data/bench", "FK_FILE=file", "FK_ACTION=CLOSED_WRITE", NULL };
+
+	long long *times = calloc(runs, sizeof(long long));
+	assert(times);
+
+	int i;
+	for (i=0; i < runs; i++) {
+		long long start_ns = now_ns();
+		pid_t pid = start(argv, envp);
+		times[i] = now_ns() - start_ns;
+		if (pid <= 0) {
+			perror(method);
+			exit(EXIT_FAILURE);
+		}
+		waitpid(pid, NULL, 0);
+	}
+
+	qsort(times, runs, sizeof(long long), compare);
+	long long total = 0;
+	for (i=0; i < runs; i++) { total += times[i]; }
+
+	printf("%-12s %10d %10.1f %10.1f %10.1f\n", method, watches,
+		(total / (double) runs) / 1000.0,
+		times[runs / 2] / 1000.0,
+		times[(runs * 99) / 100] / 1000.0);
+
+	free(times);
+}
+
+
+int main(int argc, char **argv)
+{
+	int runs = 500;
+	if (argc > 1) {
+		runs = atoi(argv[1]);
+		if (runs <= 0) { runs = 500; }
+	}
+
+	int defaults[] = { 1000, 100000 };
+	int count = argc > 2 ? argc - 2 : 2;
+
+	printf("%-12s %10s %10s %10s %10s\n", "method", "watches", "mean(us)", "p50(us)", "p99(us)");
+
+	// the table is built up as we go, so each size includes the watches of the ones before it.
+	WDINDEX index = wdindex_new();
+	int have = 0;
+
+	int i;
+	for (i=0; i < count; i++) {
+		int watches = argc > 2 ? atoi(argv[i + 2]) : defaults[i];
+
+		while (have < watches) {
+			benchwatch_t *watch = calloc(1, sizeof(benchwatch_t));
+			assert(watch);
+			watch->wd = have + 1;
+			watch->index = have;
+			watch->path = malloc(96);
+			assert(watch->path);
+			snprintf(watch->path, 96, "/data/dropzone/customer-%06d/incoming/%06d", have / 100, have);
+			wdindex_add(index, watch->wd, watch);
+			have ++;
+		}
+
+		run("fork+exec", start_fork, watches, runs);
+		run("posix_spawn", start_spawn, watches, runs);
+	}
+
+	return(0);
+}
+
+
+// fin - spawnbench.c
@@ -0,0 +1,213 @@
+// timers.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A set of one-shot timers, kept in a binary heap ordered by when they expire.   No application specific code should be here.
+ * See timers.h for details.
+*/
+
+
+#include "timers.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+typedef struct {
+	long long when;
+	int pos;		// position in the heap, so that the timer can be moved or cancelled without searching for it.
+	timer_cb cb;
+	void *arg;
+} timer_entry_t;
+
+
+typedef struct {
+	int count;
+	int size;
+	timer_entry_t **heap;
+} timers_t;
+
+
+
+extern long long timers_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(((long long) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+
+
+extern TIMERS timers_new(void)
+{
+	timers_t *timers = calloc(1, sizeof(timers_t));
+	assert(timers);
+	return((TIMERS) timers);
+}
+
+
+extern void timers_free(TIMERS timersptr)
+{
+	timers_t *timers = timersptr;
+	assert(timers);
+	while (timers->count > 0) {
+		timers->count --;
+		free(timers->heap[timers->count]);
+	}
+	if (timers->heap) { free(timers->heap); }
+	free(timers);
+}
+
+
+static void place(timers_t *timers, timer_entry_t *timer, int pos)
+{
+	timers->heap[pos] = timer;
+	timer->pos = pos;
+}
+
+
+// move a timer up the heap until its parent expires before it.
+static void sift_up(timers_t *timers, int pos)
+{
+	timer_entry_t *timer = timers->heap[pos];
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (timers->heap[parent]->when <= timer->when) {
+			break;
+		}
+		place(timers, timers->heap[parent], pos);
+		pos = parent;
+	}
+	place(timers, timer, pos);
+}
+
+
+// move a timer down the heap until both children expire after it.
+static void sift_down(timers_t *timers, int pos)
+{
+	timer_entry_t *timer = timers->heap[pos];
+	for (;;) {
+		int child = (pos * 2) + 1;
+		if (child >= timers->count) {
+			break;
+		}
+		if (child + 1 < timers->count && timers->heap[child + 1]->when < timers->heap[child]->when) {
+			child ++;
+		}
+		if (timer->when <= timers->heap[child]->when) {
+			break;
+		}
+		place(timers, timers->heap[child], pos);
+		pos = child;
+	}
+	place(timers, timer, pos);
+}
+
+
+extern TIMER timer_add(TIMERS timersptr, long long when, timer_cb cb, void *arg)
+{
+	timers_t *timers = timersptr;
+	assert(timers);
+	assert(cb);
+
+	timer_entry_t *timer = calloc(1, sizeof(timer_entry_t));
+	assert(timer);
+	timer->when = when;
+	timer->cb = cb;
+	timer->arg = arg;
+
+	if (timers->count >= timers->size) {
+		timers->size = timers->size > 0 ? timers->size * 2 : 64;
+		timers->heap = realloc(timers->heap, sizeof(timer_entry_t *) * timers->size);
+		assert(timers->heap);
+	}
+
+	timers->count ++;
+	place(timers, timer, timers->count - 1);
+	sift_up(timers, timer->pos);
+
+	return((TIMER) timer);
+}
+
+
+extern void timer_move(TIMERS timersptr, TIMER timerptr, long long when)
+{
+	timers_t *timers = timersptr;
+	timer_entry_t *timer = timerptr;
+	assert(timers);
+	assert(timer);
+	assert(timers->heap[timer->pos] == timer);
+
+	long long old = timer->when;
+	timer->when = when;
+	if (when < old) {
+		sift_up(timers, timer->pos);
+	}
+	else {
+		sift_down(timers, timer->pos);
+	}
+}
+
+
+// take a timer out of the heap (without freeing it).
+static void take(timers_t *timers, timer_entry_t *timer)
+{
+	assert(timers->count > 0);
+	int pos = timer->pos;
+	timers->count --;
+	if (pos < timers->count) {
+		// the last timer goes into the hole, and then needs to be moved to wherever it belongs.
+		place(timers, timers->heap[timers->count], pos);
+		sift_down(timers, pos);
+		sift_up(timers, timers->heap[pos]->pos);
+	}
+	timers->heap[timers->count] = NULL;
+}
+
+
+extern void timer_cancel(TIMERS timersptr, TIMER timerptr)
+{
+	timers_t *timers = timersptr;
+	timer_entry_t *timer = timerptr;
+	assert(timers);
+	assert(timer);
+	assert(timers->heap[timer->pos] == timer);
+
+	take(timers, timer);
+	free(timer);
+}
+
+
+extern long long timers_next(TIMERS timersptr)
+{
+	timers_t *timers = timersptr;
+	assert(timers);
+	return(timers->count > 0 ? timers->heap[0]->when : -1);
+}
+
+
+extern int timers_run(TIMERS timersptr, long long now)
+{
+	timers_t *timers = timersptr;
+	assert(timers);
+
+	int fired = 0;
+	while (timers->count > 0 && timers->heap[0]->when <= now) {
+		timer_entry_t *timer = timers->heap[0];
+		take(timers, timer);
+
+		// the timer is freed before the callback, so the callback is free to add new timers (including with the same arg).
+		timer_cb cb = timer->cb;
+		void *arg = timer->arg;
+		free(timer);
+
+		cb(arg);
+		fired ++;
+	}
+	return(fired);
+}
+
+
+// fin - timers.c
@@ -0,0 +1,43 @@
+// timers.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A set of one-shot timers, kept in a binary heap ordered by when they expire.   No application specific code should be here.
+ * Adding, moving and cancelling a timer are all O(log n), and finding the next one to expire is constant time.
+ * Nothing here waits, the owner is expected to sleep until timers_next() (for example with a timerfd), and then call timers_run().
+ *
+ * Times are in milliseconds, from the monotonic clock.
+*/
+
+#ifndef __TIMERS_H
+#define __TIMERS_H
+
+typedef void * TIMERS;
+typedef void * TIMER;
+
+typedef void (*timer_cb)(void *arg);
+
+TIMERS timers_new(void);
+void timers_free(TIMERS timers);
+
+// the current time of the clock that the timers use.
+long long timers_now(void);
+
+// add a timer that will call 'cb' at the time 'when'.  The handle returned is valid until the timer has fired or been cancelled.
+TIMER timer_add(TIMERS timers, long long when, timer_cb cb, void *arg);
+
+// change the time that a timer will fire.
+void timer_move(TIMERS timers, TIMER timer, long long when);
+
+void timer_cancel(TIMERS timers, TIMER timer);
+
+// return the time the next timer will expire, or -1 if there are no timers.
+long long timers_next(TIMERS timers);
+
+// fire all the timers that have expired by 'now'.  Returns the number of timers that fired.
+int timers_run(TIMERS timers, long long now);
+
+
+#endif
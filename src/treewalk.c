@@ -0,0 +1,230 @@
+// treewalk.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Parallel directory tree walker.   No application specific code should be here.
+ * See treewalk.h for details.
+*/
+
+
+#include "treewalk.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// the upper limit on worker threads.  Beyond this, the walk is limited by the filesystem and not by us.
+#define TREEWALK_MAX_THREADS 16
+
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// stack of directories that still need to be listed.  A stack (rather than a queue) keeps the amount of
+	// pending paths small, because it walks depth first.
+	char **pending;
+	int pendingcount;
+	int pendingsize;
+
+	int active;		// number of workers currently listing a directory.
+	long visited;
+
+	treewalk_dir_cb dircb;
+	treewalk_file_cb filecb;
+	void *arg;
+} treewalk_t;
+
+
+
+static void push_dir(treewalk_t *walk, char *path)
+{
+	assert(walk);
+	assert(path);
+
+	if (walk->pendingcount >= walk->pendingsize) {
+		walk->pendingsize = walk->pendingsize > 0 ? walk->pendingsize * 2 : 256;
+		walk->pending = realloc(walk->pending, sizeof(char *) * walk->pendingsize);
+		assert(walk->pending);
+	}
+	walk->pending[walk->pendingcount] = path;
+	walk->pendingcount ++;
+}
+
+
+// list a single directory, adding any sub-directories found to the pending stack.
+static void list_dir(treewalk_t *walk, const char *path)
+{
+	assert(walk);
+	assert(path);
+
+	DIR *d = opendir(path);
+	if (d == NULL) {
+		return;
+	}
+
+	size_t pathlen = strlen(path);
+
+	// sub-directories are collected locally, and added to the shared stack in one go, so that the lock is
+	// only taken once per directory.
+	char **found = NULL;
+	int foundcount = 0;
+	int foundsize = 0;
+
+	struct dirent *dir;
+	while ((dir = readdir(d)) != NULL) {
+		if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0) {
+			continue;
+		}
+
+		unsigned char type = dir->d_type;
+		if (type == DT_UNKNOWN) {
+			// some filesystems do not fill in the type, so we need to look at it ourselves.
+			struct stat sb;
+			if (fstatat(dirfd(d), dir->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+				continue;
+			}
+			if (S_ISDIR(sb.st_mode)) 		{ type = DT_DIR; }
+			else if (S_ISREG(sb.st_mode)) 	{ type = DT_REG; }
+			else if (S_ISLNK(sb.st_mode)) 	{ type = DT_LNK; }
+		}
+
+		if (type == DT_DIR) {
+			char *subpath = malloc(pathlen + 1 + strlen(dir->d_name) + 1);
+			assert(subpath);
+			sprintf(subpath, "%s/%s", path, dir->d_name);
+
+			if (foundcount >= foundsize) {
+				foundsize = foundsize > 0 ? foundsize * 2 : 16;
+				found = realloc(found, sizeof(char *) * foundsize);
+				assert(found);
+			}
+			found[foundcount] = subpath;
+			foundcount ++;
+		}
+		else if (walk->filecb) {
+			walk->filecb(path, dir->d_name, type, walk->arg);
+		}
+	}
+	closedir(d);
+
+	if (foundcount > 0) {
+		pthread_mutex_lock(&walk->lock);
+		int i;
+		for (i=0; i < foundcount; i++) {
+			push_dir(walk, found[i]);
+		}
+		pthread_cond_broadcast(&walk->cond);
+		pthread_mutex_unlock(&walk->lock);
+	}
+
+	if (found) { free(found); }
+}
+
+
+static void * walk_worker(void *arg)
+{
+	treewalk_t *walk = arg;
+	assert(walk);
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		// wait until there is something to do, or until everything is finished.
+		while (walk->pendingcount == 0 && walk->active > 0) {
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		}
+
+		if (walk->pendingcount == 0) {
+			// nothing pending, and no one is working on anything that could add more.  We are finished.
+			assert(walk->active == 0);
+			pthread_cond_broadcast(&walk->cond);
+			break;
+		}
+
+		walk->pendingcount --;
+		char *path = walk->pending[walk->pendingcount];
+		walk->active ++;
+		walk->visited ++;
+		pthread_mutex_unlock(&walk->lock);
+
+		if (walk->dircb == NULL || walk->dircb(path, walk->arg) != 0) {
+			list_dir(walk, path);
+		}
+		free(path);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->active --;
+		if (walk->active == 0 && walk->pendingcount == 0) {
+			pthread_cond_broadcast(&walk->cond);
+		}
+	}
+	pthread_mutex_unlock(&walk->lock);
+
+	return(NULL);
+}
+
+
+extern long treewalk(const char *root, int threads, treewalk_dir_cb dircb, treewalk_file_cb filecb, void *arg)
+{
+	assert(root);
+
+	if (threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (int) cpus : 1;
+	}
+	if (threads > TREEWALK_MAX_THREADS) { threads = TREEWALK_MAX_THREADS; }
+
+	treewalk_t walk;
+	memset(&walk, 0, sizeof(walk));
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+	walk.dircb = dircb;
+	walk.filecb = filecb;
+	walk.arg = arg;
+
+	char *start = strdup(root);
+	assert(start);
+	push_dir(&walk, start);
+
+	// the calling thread is also used as one of the workers.
+	pthread_t *workers = NULL;
+	if (threads > 1) {
+		workers = calloc(threads - 1, sizeof(pthread_t));
+		assert(workers);
+	}
+	int started = 0;
+	while (started < threads - 1) {
+		if (pthread_create(&workers[started], NULL, walk_worker, &walk) != 0) {
+			// we can still continue with the workers we have.
+			break;
+		}
+		started ++;
+	}
+
+	walk_worker(&walk);
+
+	while (started > 0) {
+		started --;
+		pthread_join(workers[started], NULL);
+	}
+	if (workers) { free(workers); }
+
+	assert(walk.pendingcount == 0);
+	if (walk.pending) { free(walk.pending); }
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+
+	return(walk.visited);
+}
+
+
+// fin - treewalk.c
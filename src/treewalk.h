@@ -0,0 +1,30 @@
+// treewalk.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * Parallel directory tree walker.   No application specific code should be here.
+ * A pool of threads enumerates the directories of a tree, so that very large trees (100k+ directories)
+ * can be walked without being limited by the latency of a single readdir() at a time.
+ *
+ * The callbacks are called from the worker threads, so they must be thread-safe.
+*/
+
+#ifndef __TREEWALK_H
+#define __TREEWALK_H
+
+// Called for every directory before it is listed (including the root).  If it returns 0, the directory
+// is not listed, and nothing below it is visited.
+typedef int (*treewalk_dir_cb)(const char *path, void *arg);
+
+// Called for every entry in a directory that is not itself a directory.  'type' is the d_type of the entry.
+// This callback is optional.
+typedef void (*treewalk_file_cb)(const char *dirpath, const char *name, unsigned char type, void *arg);
+
+// Walk the tree below 'root' using 'threads' workers.  If threads is 0, a number is chosen based on the
+// number of CPUs available.  Symbolic links are not followed.  Returns the number of directories visited.
+long treewalk(const char *root, int threads, treewalk_dir_cb dircb, treewalk_file_cb filecb, void *arg);
+
+
+#endif
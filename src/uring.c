@@ -0,0 +1,253 @@
+// uring.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A small io_uring(7) wrapper, using the system calls directly.   No application specific code should be here.
+ * See uring.h for details.
+*/
+
+
+#include "uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+typedef struct {
+	int fd;
+
+	// the submission queue.  We are the only one adding to it, the kernel moves the head along as it takes them.
+	unsigned *sqhead;
+	unsigned *sqtail;
+	unsigned sqmask;
+	unsigned *sqarray;
+	unsigned sqentries;
+	struct io_uring_sqe *sqes;
+	unsigned queued;		// added since the last submit.
+
+	// the completion queue.  The kernel adds to it, and we move the head along as we take them.
+	unsigned *cqhead;
+	unsigned *cqtail;
+	unsigned cqmask;
+	struct io_uring_cqe *cqes;
+
+	void *sqring;
+	size_t sqringsize;
+	void *cqring;
+	size_t cqringsize;
+	size_t sqessize;
+} uring_t;
+
+
+
+static int ring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return((int) syscall(__NR_io_uring_setup, entries, params));
+}
+
+
+static int ring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsize)
+{
+	return((int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsize));
+}
+
+
+extern URING uring_new(unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int fd = ring_setup(entries, &params);
+	if (fd == -1) {
+		return(NULL);
+	}
+
+	// the timeout for waiting needs IORING_FEAT_EXT_ARG, and it is simpler to only handle rings that are in a single mapping.
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0 || (params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+		close(fd);
+		errno = ENOSYS;
+		return(NULL);
+	}
+
+	uring_t *ring = calloc(1, sizeof(uring_t));
+	assert(ring);
+	ring->fd = fd;
+
+	size_t sqsize = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+	size_t cqsize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+	ring->sqringsize = sqsize > cqsize ? sqsize : cqsize;
+	ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sqring == MAP_FAILED) {
+		close(fd);
+		free(ring);
+		return(NULL);
+	}
+	ring->cqring = ring->sqring;
+
+	ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap(ring->sqring, ring->sqringsize);
+		close(fd);
+		free(ring);
+		return(NULL);
+	}
+
+	char *sq = ring->sqring;
+	ring->sqhead = (unsigned *) (sq + params.sq_off.head);
+	ring->sqtail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sqmask = *(unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sqarray = (unsigned *) (sq + params.sq_off.array);
+	ring->sqentries = params.sq_entries;
+
+	char *cq = ring->cqring;
+	ring->cqhead = (unsigned *) (cq + params.cq_off.head);
+	ring->cqtail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cqmask = *(unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return((URING) ring);
+}
+
+
+extern void uring_free(URING ringptr)
+{
+	uring_t *ring = ringptr;
+	assert(ring);
+	munmap(ring->sqes, ring->sqessize);
+	munmap(ring->sqring, ring->sqringsize);
+	close(ring->fd);
+	free(ring);
+}
+
+
+static int submit(uring_t *ring, unsigned wait, unsigned flags, void *arg, size_t argsize)
+{
+	assert(ring);
+	int result = ring_enter(ring->fd, ring->queued, wait, flags, arg, argsize);
+	if (result >= 0) {
+		assert((unsigned) result <= ring->queued);
+		ring->queued -= result;
+	}
+	return(result);
+}
+
+
+// get the next free entry in the submission queue.  If it is full, what is there is submitted first.
+static struct io_uring_sqe * next_sqe(uring_t *ring)
+{
+	assert(ring);
+
+	unsigned tail = *ring->sqtail;
+	while (tail - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >= ring->sqentries) {
+		if (submit(ring, 0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			assert(0);
+		}
+	}
+
+	unsigned index = tail & ring->sqmask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqarray[index] = index;
+	return(sqe);
+}
+
+
+static void queue_sqe(uring_t *ring)
+{
+	assert(ring);
+	__atomic_store_n(ring->sqtail, *ring->sqtail + 1, __ATOMIC_RELEASE);
+	ring->queued ++;
+}
+
+
+extern void uring_read(URING ringptr, int fd, void *buf, size_t len, uint64_t tag)
+{
+	uring_t *ring = ringptr;
+	assert(ring);
+	assert(fd >= 0);
+	assert(buf);
+
+	struct io_uring_sqe *sqe = next_sqe(ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = (uint64_t) -1;		// the current position, as read() would.
+	sqe->user_data = tag;
+	queue_sqe(ring);
+}
+
+
+extern void uring_poll(URING ringptr, int fd, short events, uint64_t tag)
+{
+	uring_t *ring = ringptr;
+	assert(ring);
+	assert(fd >= 0);
+
+	struct io_uring_sqe *sqe = next_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = (unsigned short) events;
+	sqe->user_data = tag;
+	queue_sqe(ring);
+}
+
+
+extern int uring_wait(URING ringptr, int timeout)
+{
+	uring_t *ring = ringptr;
+	assert(ring);
+
+	// if there are completions waiting already, there is no need to wait for more.
+	unsigned wait = (*ring->cqhead == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE)) ? 1 : 0;
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000LL;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+	}
+
+	int result = submit(ring, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (result < 0) {
+		if (errno == ETIME) {
+			return(0);
+		}
+		return(-1);
+	}
+	return(0);
+}
+
+
+extern int uring_next(URING ringptr, uint64_t *tag, int *result)
+{
+	uring_t *ring = ringptr;
+	assert(ring);
+	assert(tag);
+	assert(result);
+
+	unsigned head = *ring->cqhead;
+	if (head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE)) {
+		return(0);
+	}
+
+	struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqmask];
+	*tag = cqe->user_data;
+	*result = cqe->res;
+	__atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+	return(1);
+}
+
+
+// fin - uring.c
@@ -0,0 +1,40 @@
+// uring.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A small io_uring(7) wrapper, using the system calls directly.   No application specific code should be here.
+ * Only what an event loop needs is here: reads, one-shot polls, and waiting for completions with a timeout, so that
+ * everything that is ready can be found out (and the reads done) with a single system call.
+ * Each request is given a tag, which is returned with its completion.  It is not thread-safe.
+*/
+
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void * URING;
+
+// returns NULL (with errno set) if io_uring is not available, or the kernel is too old for it to be used here (before 5.11).
+URING uring_new(unsigned entries);
+void uring_free(URING ring);
+
+// queue a read from 'fd' into 'buf'.  The result of the completion is what read() would have returned (or -errno).
+// The buffer must not be touched until it has completed.
+void uring_read(URING ring, int fd, void *buf, size_t len, uint64_t tag);
+
+// queue a poll on 'fd'.  The result of the completion is the poll events that are ready (or -errno).  It only completes once.
+void uring_poll(URING ring, int fd, short events, uint64_t tag);
+
+// submit everything that has been queued, and wait until at least one request has completed, or 'timeout' milliseconds have
+// passed (-1 to wait as long as it takes).  Returns 0, or -1 with errno set (EINTR if a signal interrupted it).
+int uring_wait(URING ring, int timeout);
+
+// get the next completion.  Returns 1 if there was one, or 0 if there are no more.
+int uring_next(URING ring, uint64_t *tag, int *result);
+
+
+#endif
@@ -0,0 +1,243 @@
+// wdindex.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A lookup index keyed on watch-descriptors.   No application specific code should be here.
+ * See wdindex.h for details.
+*/
+
+
+#include "wdindex.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// the descriptor of a slot that has never been used, or one that was used and has been emptied (which a lookup has to go past).
+#define WDINDEX_EMPTY		-1
+#define WDINDEX_REMOVED		-2
+
+#define WDINDEX_MIN_SLOTS	64
+
+
+typedef struct {
+	int wd;
+	int count;
+	int size;
+	void **entries;
+} wdindex_slot_t;
+
+
+typedef struct {
+	int slots;			// always a power of 2 (or 0).
+	int used;			// slots with a descriptor in them.
+	int removed;		// slots that have been emptied.
+	wdindex_slot_t *slot;
+} wdindex_t;
+
+
+
+extern WDINDEX wdindex_new(void)
+{
+	wdindex_t *index = calloc(1, sizeof(wdindex_t));
+	assert(index);
+	assert(index->slots == 0);
+	assert(index->slot == NULL);
+	return((WDINDEX) index);
+}
+
+
+extern void wdindex_free(WDINDEX indexptr)
+{
+	wdindex_t *index = indexptr;
+	assert(index);
+
+	if (index->slot) {
+		assert(index->slots > 0);
+		while (index->slots > 0) {
+			index->slots --;
+			if (index->slot[index->slots].entries) {
+				free(index->slot[index->slots].entries);
+				index->slot[index->slots].entries = NULL;
+			}
+		}
+		free(index->slot);
+		index->slot = NULL;
+	}
+
+	free(index);
+}
+
+
+// The descriptors are issued in sequence, so the low bits spread them evenly over the slots without needing to hash them further.
+static inline int wdindex_home(wdindex_t *index, int wd)
+{
+	assert(index->slots > 0);
+	return(wd & (index->slots - 1));
+}
+
+
+// return the slot that the descriptor is in, or NULL if it isn't in the index.
+static wdindex_slot_t * wdindex_find(wdindex_t *index, int wd)
+{
+	assert(index);
+
+	if (wd < 0 || index->used == 0) {
+		return(NULL);
+	}
+
+	int i = wdindex_home(index, wd);
+	while (index->slot[i].wd != WDINDEX_EMPTY) {
+		if (index->slot[i].wd == wd) {
+			return(&index->slot[i]);
+		}
+		i = (i + 1) & (index->slots - 1);
+	}
+	return(NULL);
+}
+
+
+// Rebuild the table with enough slots for what is in it (which also clears out the removed slots).  It can get smaller as well as bigger.
+static void wdindex_resize(wdindex_t *index, int needed)
+{
+	assert(index);
+	assert(needed >= index->used);
+
+	int slots = WDINDEX_MIN_SLOTS;
+	while (slots < needed * 2) { slots *= 2; }
+
+	wdindex_slot_t *old = index->slot;
+	int oldslots = index->slots;
+
+	index->slot = malloc(sizeof(wdindex_slot_t) * slots);
+	assert(index->slot);
+	index->slots = slots;
+	index->removed = 0;
+
+	int i;
+	for (i=0; i < slots; i++) {
+		index->slot[i].wd = WDINDEX_EMPTY;
+		index->slot[i].count = 0;
+		index->slot[i].size = 0;
+		index->slot[i].entries = NULL;
+	}
+
+	for (i=0; i < oldslots; i++) {
+		if (old[i].wd >= 0) {
+			int j = wdindex_home(index, old[i].wd);
+			while (index->slot[j].wd != WDINDEX_EMPTY) {
+				j = (j + 1) & (slots - 1);
+			}
+			index->slot[j] = old[i];
+		}
+	}
+
+	if (old) { free(old); }
+}
+
+
+// add an entry to the list for the watch-descriptor.  The table is rebuilt if it is getting full.
+extern void wdindex_add(WDINDEX indexptr, int wd, void *entry)
+{
+	wdindex_t *index = indexptr;
+	assert(index);
+	assert(wd >= 0);
+	assert(entry);
+
+	wdindex_slot_t *slot = wdindex_find(index, wd);
+	if (slot == NULL) {
+		// keep the table no more than 3/4 full (counting the removed slots, as a lookup has to go past them).
+		if ((index->used + index->removed + 1) * 4 > index->slots * 3) {
+			wdindex_resize(index, index->used + 1);
+		}
+
+		// use the first slot that is free, whether it has been used before or not.
+		int i = wdindex_home(index, wd);
+		while (index->slot[i].wd >= 0) {
+			i = (i + 1) & (index->slots - 1);
+		}
+		slot = &index->slot[i];
+		if (slot->wd == WDINDEX_REMOVED) { index->removed --; }
+		assert(slot->count == 0);
+		assert(slot->entries == NULL);
+		slot->wd = wd;
+		index->used ++;
+	}
+	assert(slot->wd == wd);
+
+	if (slot->count >= slot->size) {
+		slot->size = slot->size > 0 ? slot->size * 2 : 2;
+		slot->entries = realloc(slot->entries, sizeof(void *) * slot->size);
+		assert(slot->entries);
+	}
+
+	slot->entries[slot->count] = entry;
+	slot->count ++;
+}
+
+
+// remove an entry from the list for the watch-descriptor.  Returns the number of entries still in that list.
+// When the table is mostly empty, it is rebuilt smaller.
+extern int wdindex_remove(WDINDEX indexptr, int wd, void *entry)
+{
+	wdindex_t *index = indexptr;
+	assert(index);
+	assert(entry);
+
+	wdindex_slot_t *slot = wdindex_find(index, wd);
+	if (slot == NULL) {
+		return(0);
+	}
+
+	int i;
+	for (i=0; i < slot->count; i++) {
+		if (slot->entries[i] == entry) {
+			// the order of the entries is kept, so that events are handed out in the same order the watches were added.
+			slot->count --;
+			memmove(&slot->entries[i], &slot->entries[i+1], sizeof(void *) * (slot->count - i));
+			break;
+		}
+	}
+
+	int count = slot->count;
+	if (count == 0) {
+		if (slot->entries) {
+			free(slot->entries);
+			slot->entries = NULL;
+		}
+		slot->size = 0;
+		slot->wd = WDINDEX_REMOVED;
+		index->used --;
+		index->removed ++;
+
+		if (index->slots > WDINDEX_MIN_SLOTS && index->used * 8 < index->slots) {
+			wdindex_resize(index, index->used);
+		}
+	}
+
+	return(count);
+}
+
+
+// return the list of entries for the watch-descriptor.
+extern void ** wdindex_get(WDINDEX indexptr, int wd, int *count)
+{
+	wdindex_t *index = indexptr;
+	assert(index);
+	assert(count);
+
+	wdindex_slot_t *slot = wdindex_find(index, wd);
+	if (slot == NULL || slot->count == 0) {
+		*count = 0;
+		return(NULL);
+	}
+
+	*count = slot->count;
+	return(slot->entries);
+}
+
+
+// fin - wdindex.c
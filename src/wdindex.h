@@ -0,0 +1,34 @@
+// wdindex.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A lookup index keyed on watch-descriptors.   No application specific code should be here.
+ * The kernel hands out watch-descriptors in sequence, but never reuses them, so in a process that keeps adding and removing watches
+ * they grow without limit.  The index is therefore a hash table (open addressing) keyed on the descriptor, where each slot holds the
+ * list of entries subscribed to it, and its size follows the number of descriptors in it rather than the highest one ever used.
+ * Lookup, add and remove are all constant time (on average) regardless of how many descriptors are in the index.
+*/
+
+#ifndef __WDINDEX_H
+#define __WDINDEX_H
+
+// The index object is opaque outside of the library (it will simply be a pointer to a void object).
+typedef void * WDINDEX;
+
+WDINDEX wdindex_new(void);
+void wdindex_free(WDINDEX index);
+
+// add an entry to the list for the watch-descriptor.
+void wdindex_add(WDINDEX index, int wd, void *entry);
+
+// remove an entry from the list for the watch-descriptor.  Returns the number of entries still in that list.
+int wdindex_remove(WDINDEX index, int wd, void *entry);
+
+// return the list of entries for the watch-descriptor, and sets 'count' to the number of entries in it.
+// Returns NULL (and a count of 0) if there are no entries for the descriptor.
+void ** wdindex_get(WDINDEX index, int wd, int *count);
+
+
+#endif
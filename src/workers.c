@@ -0,0 +1,337 @@
+// workers.c
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A pool of worker threads, each with its own queue of work.   No application specific code should be here.
+ * See workers.h for details.
+*/
+
+
+#include "workers.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// how long a worker sleeps when the queue back to the owner is full, before trying again.
+#define DONE_RETRY_NS	100000
+
+
+// A ring with a single producer and a single consumer.  The head and tail only ever increase (and wrap), so the number of items
+// in the ring is always 'tail - head'.
+typedef struct {
+	atomic_uint head;		// only changed by the consumer.
+	atomic_uint tail;		// only changed by the producer.
+	unsigned mask;
+	void **items;
+} queue_t;
+
+
+typedef struct workers_t workers_t;
+
+typedef struct {
+	workers_t *workers;
+	int index;
+	pthread_t thread;
+	queue_t in;			// from the owner to the worker.
+	queue_t out;		// handed back from the worker to the owner.
+	int wakefd;			// written to when the worker could be waiting for items.
+	TIMERS timers;
+} worker_t;
+
+
+struct workers_t {
+	int count;
+	worker_t *worker;
+	int donefd;			// written to when the owner could be waiting for items to be handed back.
+	int next;			// the worker that the owner looks at first for items handed back, so that one busy worker does not hold up the rest.
+	atomic_int stop;
+	workers_cb cb;
+	void *arg;
+};
+
+
+
+static void queue_init(queue_t *queue, int size)
+{
+	assert(queue);
+	assert(size > 0);
+
+	// the size is rounded up to a power of 2, so that the position in the ring is a mask rather than a divide.
+	unsigned slots = 1;
+	while (slots < (unsigned) size) {
+		slots <<= 1;
+	}
+	queue->mask = slots - 1;
+	queue->items = calloc(slots, sizeof(void *));
+	assert(queue->items);
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+}
+
+
+// add an item to the ring.  Returns -1 if it is full.  Otherwise returns 0, and sets 'wake' if the consumer had already taken everything
+// before this item (and so could be waiting for more).
+static int queue_push(queue_t *queue, void *item, int *wake)
+{
+	assert(queue);
+	assert(item);
+	assert(wake);
+
+	unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if (tail - atomic_load(&queue->head) > queue->mask) {
+		return(-1);
+	}
+	queue->items[tail & queue->mask] = item;
+	atomic_store(&queue->tail, tail + 1);
+
+	// the consumer stores the head before it looks at the tail, and we store the tail before looking at the head, so either it will
+	// see this item, or we will see that it has taken everything.
+	*wake = (atomic_load(&queue->head) == tail);
+	return(0);
+}
+
+
+// take the next item from the ring, or NULL if it is empty.
+static void * queue_pop(queue_t *queue)
+{
+	assert(queue);
+
+	unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	if (head == atomic_load(&queue->tail)) {
+		return(NULL);
+	}
+	void *item = queue->items[head & queue->mask];
+	atomic_store(&queue->head, head + 1);
+	return(item);
+}
+
+
+static void signal_fd(int fd)
+{
+	uint64_t one = 1;
+	while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+
+static void clear_fd(int fd)
+{
+	uint64_t value;
+	while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+
+static void * worker_main(void *arg)
+{
+	worker_t *worker = arg;
+	assert(worker);
+	workers_t *workers = worker->workers;
+	assert(workers);
+
+	struct pollfd pfd;
+	pfd.fd = worker->wakefd;
+	pfd.events = POLLIN;
+
+	while (atomic_load(&workers->stop) == 0) {
+
+		// sleep until there are items, or a timer is due.
+		int timeout = -1;
+		long long next = timers_next(worker->timers);
+		if (next >= 0) {
+			long long now = timers_now();
+			timeout = next > now ? (int) (next - now) : 0;
+		}
+		if (poll(&pfd, 1, timeout) > 0) {
+			// it is cleared before the ring is emptied, so that nothing pushed after this is missed.
+			clear_fd(worker->wakefd);
+		}
+
+		void *item;
+		while ((item = queue_pop(&worker->in)) != NULL) {
+			workers->cb((WORKERS) workers, worker->index, item, workers->arg);
+		}
+
+		timers_run(worker->timers, timers_now());
+	}
+	return(NULL);
+}
+
+
+extern WORKERS workers_new(int count, int queuesize, workers_cb cb, void *arg)
+{
+	assert(count > 0);
+	assert(queuesize > 0);
+	assert(cb);
+
+	workers_t *workers = calloc(1, sizeof(workers_t));
+	assert(workers);
+	workers->cb = cb;
+	workers->arg = arg;
+	atomic_init(&workers->stop, 0);
+	workers->donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (workers->donefd < 0) {
+		free(workers);
+		return(NULL);
+	}
+
+	workers->worker = calloc(count, sizeof(worker_t));
+	assert(workers->worker);
+
+	int i;
+	for (i=0; i < count; i++) {
+		worker_t *worker = &workers->worker[i];
+		worker->workers = workers;
+		worker->index = i;
+		queue_init(&worker->in, queuesize);
+		queue_init(&worker->out, queuesize);
+		worker->timers = timers_new();
+		assert(worker->timers);
+		worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (worker->wakefd < 0 || pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+			// unlike a tree walk, the items are given to a particular worker, so we cannot carry on with fewer of them.
+			if (worker->wakefd >= 0) { close(worker->wakefd); }
+			timers_free(worker->timers);
+			free(worker->in.items);
+			free(worker->out.items);
+			workers_free((WORKERS) workers);
+			return(NULL);
+		}
+		workers->count ++;
+	}
+
+	return((WORKERS) workers);
+}
+
+
+extern void workers_free(WORKERS workersptr)
+{
+	workers_t *workers = workersptr;
+	assert(workers);
+
+	atomic_store(&workers->stop, 1);
+	int i;
+	for (i=0; i < workers->count; i++) {
+		signal_fd(workers->worker[i].wakefd);
+	}
+	for (i=0; i < workers->count; i++) {
+		worker_t *worker = &workers->worker[i];
+		pthread_join(worker->thread, NULL);
+		close(worker->wakefd);
+		timers_free(worker->timers);
+		free(worker->in.items);
+		free(worker->out.items);
+	}
+	close(workers->donefd);
+	free(workers->worker);
+	free(workers);
+}
+
+
+extern int workers_count(WORKERS workersptr)
+{
+	workers_t *workers = workersptr;
+	assert(workers);
+	return(workers->count);
+}
+
+
+extern TIMERS workers_timers(WORKERS workersptr, int index)
+{
+	workers_t *workers = workersptr;
+	assert(workers);
+	assert(index >= 0 && index < workers->count);
+	return(workers->worker[index].timers);
+}
+
+
+extern int workers_push(WORKERS workersptr, int index, void *item)
+{
+	workers_t *workers = workersptr;
+	assert(workers);
+	assert(index >= 0 && index < workers->count);
+	assert(item);
+
+	worker_t *worker = &workers->worker[index];
+	int wake = 0;
+	if (queue_push(&worker->in, item, &wake) != 0) {
+		return(-1);
+	}
+	if (wake) {
+		signal_fd(worker->wakefd);
+	}
+	return(0);
+}
+
+
+extern void workers_done(WORKERS workersptr, int index, void *item)
+{
+	workers_t *workers = workersptr;
+	assert(workers);
+	assert(index >= 0 && index < workers->count);
+	assert(item);
+
+	worker_t *worker = &workers->worker[index];
+	int wake = 0;
+	while (queue_push(&worker->out, item, &wake) != 0) {
+		// the owner is behind.  It will make room as it catches up.
+		struct timespec ts = { 0, DONE_RETRY_NS };
+		nanosleep(&ts, NULL);
+	}
+	if (wake) {
+		signal_fd(workers->donefd);
+	}
+}
+
+
+extern int workers_fd(WORKERS workersptr)
+{
+	workers_t *workers = workersptr;
+	assert(workers);
+	return(workers->donefd);
+}
+
+
+// look through the workers for an item that has been handed back.
+static void * next_done(workers_t *workers)
+{
+	assert(workers);
+	int i;
+	for (i=0; i < workers->count; i++) {
+		int index = (workers->next + i) % workers->count;
+		void *item = queue_pop(&workers->worker[index].out);
+		if (item) {
+			workers->next = (index + 1) % workers->count;
+			return(item);
+		}
+	}
+	return(NULL);
+}
+
+
+extern void * workers_next(WORKERS workersptr)
+{
+	workers_t *workers = workersptr;
+	assert(workers);
+
+	void *item = next_done(workers);
+	if (item == NULL) {
+		// the fd is only cleared once everything has been taken, and then we look again, so that an item handed back just before
+		// it was cleared is not left behind.
+		clear_fd(workers->donefd);
+		item = next_done(workers);
+	}
+	return(item);
+}
+
+
+// fin - workers.c
@@ -0,0 +1,52 @@
+// workers.h
+
+/*
+ * Written by Clinton Webb
+ * Published under the GNU Lesser Licence.  See configfile.LICENSE.
+ *
+ * A pool of worker threads, each with its own queue of work.   No application specific code should be here.
+ * The owner decides which worker each item goes to, so that items that must be handled in order can always be given
+ * to the same one (eg, by hashing a key).  When a worker has finished with an item, it hands it back to the owner, which
+ * gets them in the order each worker handed them back.
+ *
+ * The queues are single-producer, single-consumer rings that do not take a lock: only the owner's thread can give items
+ * to the workers (and take them back), and only a worker's own thread can hand its items back.
+ *
+ * Each worker also has its own set of timers, so that it can hold on to items for a while.  The timers are only to be
+ * used from the worker's thread (ie, from the callbacks).
+*/
+
+#ifndef __WORKERS_H
+#define __WORKERS_H
+
+#include "timers.h"
+
+typedef void * WORKERS;
+
+// Called on the worker's thread for each item it is given.  The item is then the worker's until it is handed back with workers_done().
+typedef void (*workers_cb)(WORKERS workers, int worker, void *item, void *arg);
+
+// start 'count' workers.  'queuesize' is the number of items that can be waiting in each direction for each worker.
+WORKERS workers_new(int count, int queuesize, workers_cb cb, void *arg);
+
+// stop the workers, and wait for their threads to finish.  Anything still queued (or held by the workers) is lost.
+void workers_free(WORKERS workers);
+
+int workers_count(WORKERS workers);
+
+// the timers for a worker.  Only to be used on the worker's thread.
+TIMERS workers_timers(WORKERS workers, int worker);
+
+// give an item to a worker.  Returns 0, or -1 if its queue is full (in which case the owner should take back the items that have
+// been handed back to it, and then try again).
+int workers_push(WORKERS workers, int worker, void *item);
+
+// hand an item back to the owner.  Only to be called on the worker's thread.  If the queue back to the owner is full, it waits for room.
+void workers_done(WORKERS workers, int worker, void *item);
+
+// The file descriptor that becomes readable when items have been handed back.  When it is, workers_next() should be called until it returns NULL.
+int workers_fd(WORKERS workers);
+void * workers_next(WORKERS workers);
+
+
+#endif